@@ -167,6 +167,9 @@
 -- - add_rat(pos)
 -- - add_firefly(pos)
 -- - get_meta(pos) -- Get a NodeMetaRef at that position
+-- - set_node_timer(pos, timeout) -- Start the timer of a node
+--   ^ on_timer of the node is called when it expires; 0 or nil stops it
+-- - get_node_timer(pos) -> time left or nil if the timer is not running
 -- - get_player_by_name(name) -- Get an ObjectRef to a player
 -- - get_objects_inside_radius(pos, radius)
 -- - set_timeofday(val): val: 0...1; 0 = midnight, 0.5 = midday
@@ -378,6 +381,9 @@
 --     },
 --     legacy_facedir_simple = false, -- Support maps made in and before January 2012
 --     legacy_wallmounted = false, -- Support maps made in and before January 2012
+--     on_timer = func(pos, elapsed),
+--     ^ Called when the node timer expires; return true to run it again
+--       with the same timeout
 -- }
 --
 -- Recipe:
@@ -0,0 +1,247 @@
+/*
+Minetest-c55
+Copyright (C) 2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BLOCKPOSMAP_HEADER
+#define BLOCKPOSMAP_HEADER
+
+#include "irrlichttypes.h"
+#include "debug.h"
+
+// Initial number of slots; must be a power of two
+#define BLOCKPOSMAP_INITIAL_CAPACITY 64
+
+/*
+	Packs a block position into an integer.
+	The result is never 0, so 0 can be used for marking empty slots.
+*/
+inline u64 blockPosToKey(v3s16 p)
+{
+	return ((u64)(u16)p.X)
+			| ((u64)(u16)p.Y << 16)
+			| ((u64)(u16)p.Z << 32)
+			| ((u64)1 << 48);
+}
+
+inline v3s16 keyToBlockPos(u64 key)
+{
+	return v3s16((s16)(key & 0xffff),
+			(s16)((key >> 16) & 0xffff),
+			(s16)((key >> 32) & 0xffff));
+}
+
+/*
+	A hash table keyed by block position.
+
+	Uses open addressing with linear probing in flat arrays, so a lookup
+	is usually a single cache miss. Removal shifts the following entries
+	back, so no tombstones are needed.
+
+	T must be default-constructible and copyable; it is normally a
+	pointer or a small struct.
+
+	This is not thread-safe.
+*/
+template<typename T>
+class BlockPosMap
+{
+public:
+	BlockPosMap():
+		m_keys(NULL),
+		m_values(NULL),
+		m_capacity(0),
+		m_size(0)
+	{
+		allocate(BLOCKPOSMAP_INITIAL_CAPACITY);
+	}
+
+	~BlockPosMap()
+	{
+		delete[] m_keys;
+		delete[] m_values;
+	}
+
+	// Returns NULL if not found
+	T * find(v3s16 p)
+	{
+		u64 key = blockPosToKey(p);
+		u32 mask = m_capacity - 1;
+		for(u32 i = hash(key) & mask; ; i = (i + 1) & mask)
+		{
+			if(m_keys[i] == key)
+				return &m_values[i];
+			if(m_keys[i] == 0)
+				return NULL;
+		}
+	}
+
+	// Inserts or replaces the value at p
+	void set(v3s16 p, const T &value)
+	{
+		// Keep the load factor at most 1/2
+		if((m_size + 1) * 2 > m_capacity)
+			rehash(m_capacity * 2);
+
+		u64 key = blockPosToKey(p);
+		u32 mask = m_capacity - 1;
+		for(u32 i = hash(key) & mask; ; i = (i + 1) & mask)
+		{
+			if(m_keys[i] == key)
+			{
+				m_values[i] = value;
+				return;
+			}
+			if(m_keys[i] == 0)
+			{
+				m_keys[i] = key;
+				m_values[i] = value;
+				m_size++;
+				return;
+			}
+		}
+	}
+
+	// Returns false if p was not in the map
+	bool remove(v3s16 p)
+	{
+		u64 key = blockPosToKey(p);
+		u32 mask = m_capacity - 1;
+		u32 i = hash(key) & mask;
+		for(;;)
+		{
+			if(m_keys[i] == 0)
+				return false;
+			if(m_keys[i] == key)
+				break;
+			i = (i + 1) & mask;
+		}
+
+		/*
+			Shift back the entries following the removed one that would
+			otherwise become unreachable
+		*/
+		u32 j = i;
+		for(;;)
+		{
+			j = (j + 1) & mask;
+			if(m_keys[j] == 0)
+				break;
+			u32 home = hash(m_keys[j]) & mask;
+			// Skip if home is cyclically in (i, j]
+			if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+				continue;
+			m_keys[i] = m_keys[j];
+			m_values[i] = m_values[j];
+			i = j;
+		}
+		m_keys[i] = 0;
+		m_values[i] = T();
+		m_size--;
+		return true;
+	}
+
+	void clear()
+	{
+		for(u32 i=0; i<m_capacity; i++)
+		{
+			m_keys[i] = 0;
+			m_values[i] = T();
+		}
+		m_size = 0;
+	}
+
+	u32 size()
+	{
+		return m_size;
+	}
+
+	/*
+		Iteration over the slots:
+		for(u32 i=0; i<map.capacity(); i++)
+			if(map.used(i)) ... map.posAt(i), map.valueAt(i)
+		The map must not be modified while iterating.
+	*/
+	u32 capacity()
+	{
+		return m_capacity;
+	}
+	bool used(u32 i)
+	{
+		return m_keys[i] != 0;
+	}
+	v3s16 posAt(u32 i)
+	{
+		return keyToBlockPos(m_keys[i]);
+	}
+	T & valueAt(u32 i)
+	{
+		return m_values[i];
+	}
+
+private:
+	// Not copyable
+	BlockPosMap(const BlockPosMap &);
+	BlockPosMap & operator=(const BlockPosMap &);
+
+	static u32 hash(u64 key)
+	{
+		// Fibonacci hashing; the high bits are the best mixed
+		return (u32)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	void allocate(u32 capacity)
+	{
+		m_capacity = capacity;
+		m_keys = new u64[capacity];
+		m_values = new T[capacity];
+		for(u32 i=0; i<capacity; i++)
+			m_keys[i] = 0;
+	}
+
+	void rehash(u32 capacity)
+	{
+		u64 *old_keys = m_keys;
+		T *old_values = m_values;
+		u32 old_capacity = m_capacity;
+
+		allocate(capacity);
+
+		u32 mask = m_capacity - 1;
+		for(u32 k=0; k<old_capacity; k++)
+		{
+			if(old_keys[k] == 0)
+				continue;
+			u32 i = hash(old_keys[k]) & mask;
+			while(m_keys[i] != 0)
+				i = (i + 1) & mask;
+			m_keys[i] = old_keys[k];
+			m_values[i] = old_values[k];
+		}
+
+		delete[] old_keys;
+		delete[] old_values;
+	}
+
+	u64 *m_keys;
+	T *m_values;
+	u32 m_capacity;
+	u32 m_size;
+};
+
+#endif
+
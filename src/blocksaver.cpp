@@ -0,0 +1,253 @@
+/*
+Minetest-c55
+Copyright (C) 2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "blocksaver.h"
+#include "main.h" // For g_profiler
+#include "profiler.h"
+#include "porting.h"
+#include "debug.h"
+#include "log.h"
+
+BlockSaver::BlockSaver(Database *database, Table<v3s16,binary_t> &blocks,
+		u32 queue_size_max):
+	SimpleThread(),
+	m_database(database),
+	m_blocks(blocks),
+	m_queue_size_max(queue_size_max)
+{
+	m_mutex.Init();
+	assert(m_mutex.IsInitialized());
+
+	if(m_queue_size_max == 0)
+		m_queue_size_max = 1;
+}
+
+BlockSaver::~BlockSaver()
+{
+	// Write everything that is left
+	stop();
+	while(writeBatch() != 0);
+
+	for(core::map<v3s16, QueuedBlock*>::Iterator
+			i = m_pending.getIterator();
+			i.atEnd() == false; i++)
+	{
+		delete i.getNode()->getValue();
+	}
+}
+
+void * BlockSaver::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("BlockSaver");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		if(writeBatch() == 0)
+			sleep_ms(10);
+	}
+
+	// Don't leave anything unwritten when stopping
+	while(writeBatch() != 0);
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+
+	return NULL;
+}
+
+void BlockSaver::queueBlock(v3s16 p, const std::string &data)
+{
+	for(;;)
+	{
+		{
+			JMutexAutoLock lock(m_mutex);
+
+			core::map<v3s16, QueuedBlock*>::Node *n = m_pending.find(p);
+			if(n != NULL)
+			{
+				// Replace the old data; no new slot is needed
+				QueuedBlock *q = n->getValue();
+				q->data = data;
+				q->version++;
+				if(q->queued == false)
+				{
+					// Being written right now; write again afterwards
+					q->queued = true;
+					m_order.push_back(p);
+				}
+				return;
+			}
+
+			if(m_pending.size() < m_queue_size_max)
+			{
+				QueuedBlock *q = new QueuedBlock;
+				q->data = data;
+				q->queued = true;
+				m_pending.insert(p, q);
+				m_order.push_back(p);
+				return;
+			}
+		}
+
+		// Queue is full; wait for the saver thread.
+		// If the thread is not running, write by ourselves.
+		if(IsRunning() == false)
+			writeBatch();
+		else
+			sleep_ms(10);
+	}
+}
+
+bool BlockSaver::getQueuedBlock(v3s16 p, std::string &data)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<v3s16, QueuedBlock*>::Node *n = m_pending.find(p);
+	if(n == NULL)
+		return false;
+	data = n->getValue()->data;
+	return true;
+}
+
+u32 BlockSaver::size()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_pending.size();
+}
+
+void BlockSaver::flush()
+{
+	while(size() != 0)
+	{
+		if(IsRunning() == false)
+			writeBatch();
+		else
+			sleep_ms(10);
+	}
+}
+
+struct BatchItem
+{
+	v3s16 p;
+	u32 version;
+	std::string data;
+};
+
+u32 BlockSaver::writeBatch()
+{
+	core::list<BatchItem> batch;
+
+	/*
+		Take a batch from the queue.
+		The data is copied so that the queue can be modified while
+		the batch is being written.
+	*/
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		g_profiler->avg("BlockSaver: queue size", m_pending.size());
+
+		while(m_order.size() != 0 && batch.size() < BLOCKSAVER_BATCH_SIZE)
+		{
+			core::list<v3s16>::Iterator i = m_order.begin();
+			v3s16 p = *i;
+			m_order.erase(i);
+
+			core::map<v3s16, QueuedBlock*>::Node *n = m_pending.find(p);
+			assert(n);
+			QueuedBlock *q = n->getValue();
+			q->queued = false;
+
+			BatchItem item;
+			item.p = p;
+			item.version = q->version;
+			item.data = q->data;
+			batch.push_back(item);
+		}
+	}
+
+	if(batch.size() == 0)
+		return 0;
+
+	/*
+		Write the batch in transactions of a bounded size, releasing
+		the database between them
+	*/
+	{
+		ScopeProfiler sp(g_profiler, "BlockSaver: write batch", SPT_AVG);
+
+		core::list<BatchItem>::Iterator i = batch.begin();
+		while(i != batch.end())
+		{
+			JMutexAutoLock dblock(m_database->getMutex());
+
+			// Without a transaction, every block is committed by itself
+			bool transaction = m_database->begin();
+			if(transaction == false)
+				errorstream<<"BlockSaver: Failed to begin a transaction"
+						<<std::endl;
+
+			for(u32 count = 0; i != batch.end()
+					&& count < BLOCKSAVER_TRANSACTION_SIZE; i++, count++)
+			{
+				if(m_blocks.put(i->p, i->data) == false)
+					errorstream<<"BlockSaver: Failed to write block ("
+							<<i->p.X<<","<<i->p.Y<<","<<i->p.Z<<")"
+							<<std::endl;
+			}
+
+			if(transaction && m_database->commit() == false)
+				errorstream<<"BlockSaver: Failed to commit a transaction"
+						<<std::endl;
+		}
+	}
+
+	g_profiler->add("BlockSaver: written blocks", batch.size());
+
+	/*
+		Remove written blocks from the queue unless they have been
+		queued again in the meantime
+	*/
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		for(core::list<BatchItem>::Iterator i = batch.begin();
+				i != batch.end(); i++)
+		{
+			core::map<v3s16, QueuedBlock*>::Node *n = m_pending.find(i->p);
+			assert(n);
+			QueuedBlock *q = n->getValue();
+			if(q->version != i->version)
+				continue;
+			assert(q->queued == false);
+			delete q;
+			m_pending.remove(i->p);
+		}
+	}
+
+	return batch.size();
+}
+
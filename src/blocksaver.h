@@ -0,0 +1,111 @@
+/*
+Minetest-c55
+Copyright (C) 2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BLOCKSAVER_HEADER
+#define BLOCKSAVER_HEADER
+
+#include <jmutex.h>
+#include <jmutexautolock.h>
+#include <string>
+#include "common_irrlicht.h"
+#include "utility.h"
+#include "db.h"
+
+// Maximum number of blocks taken from the queue at a time
+#define BLOCKSAVER_BATCH_SIZE 256
+// Maximum number of blocks written in one database transaction.
+// The database is locked for the duration of a transaction, so this
+// bounds how long the server thread may wait for it.
+#define BLOCKSAVER_TRANSACTION_SIZE 32
+
+/*
+	Write-behind saver of serialized MapBlocks.
+
+	The server thread serializes blocks under the environment lock and
+	queues the resulting blobs here. A background thread then writes
+	them to the database in short transactions.
+
+	Blocks stay visible through getQueuedBlock() until they have been
+	committed, so that a block unloaded and loaded again before being
+	written is not read back stale from the database.
+
+	This is a thread-safe class.
+*/
+class BlockSaver : public SimpleThread
+{
+public:
+	BlockSaver(Database *database, Table<v3s16,binary_t> &blocks,
+			u32 queue_size_max);
+	~BlockSaver();
+
+	void * Thread();
+
+	/*
+		Queues a serialized block for writing. If the block is already
+		queued, the older data is replaced.
+		Waits for the saver thread if the queue is full.
+	*/
+	void queueBlock(v3s16 p, const std::string &data);
+
+	// Gets the data of a block that is waiting to be written.
+	// Returns false if block is not in the queue.
+	bool getQueuedBlock(v3s16 p, std::string &data);
+
+	u32 size();
+
+	bool isFull()
+	{
+		return size() >= m_queue_size_max;
+	}
+
+	// Waits until everything queued so far has been written
+	void flush();
+
+private:
+	// Writes one batch of blocks; returns the number of blocks written
+	u32 writeBatch();
+
+	struct QueuedBlock
+	{
+		std::string data;
+		// Incremented every time the data is replaced
+		u32 version;
+		// false while the block is being written by the saver thread
+		bool queued;
+
+		QueuedBlock():
+			version(0),
+			queued(false)
+		{}
+	};
+
+	Database *m_database;
+	Table<v3s16,binary_t> &m_blocks;
+	u32 m_queue_size_max;
+
+	// Protects m_pending and m_order
+	JMutex m_mutex;
+	// Blocks waiting to be written or being written
+	core::map<v3s16, QueuedBlock*> m_pending;
+	// Write order of the queued blocks
+	core::list<v3s16> m_order;
+};
+
+#endif
+
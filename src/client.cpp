@@ -973,6 +973,59 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		//infostream<<"Adding mesh update task for received block"<<std::endl;
 		addUpdateMeshTaskWithEdge(p, true);
 	}
+	else if(command == TOCLIENT_BLOCK_DELTA)
+	{
+		// Ignore too small packet
+		if(datasize < 2+6+1+2)
+			return;
+
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+
+		v3s16 p = readV3S16(is);
+
+		// The block may have been deleted after the server sent this
+		MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(p);
+		if(block == NULL || block->isDummy())
+			return;
+
+		block->deSerializeFlags(readU8(is));
+
+		u16 count = readU16(is);
+		u32 nodelen = MapNode::serializedLength(ser_version);
+		SharedBuffer<u8> nodebuf(nodelen);
+		for(u16 i=0; i<count; i++)
+		{
+			u16 index = readU16(is);
+			is.read((char*)*nodebuf, nodelen);
+			if(is.gcount() != (std::streamsize)nodelen)
+				throw SerializationError("TOCLIENT_BLOCK_DELTA: "
+						"truncated node data");
+			if(index >= MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE)
+				continue;
+			v3s16 p_rel(index % MAP_BLOCKSIZE,
+					(index / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+					index / MAP_BLOCKSIZE / MAP_BLOCKSIZE);
+			MapNode n;
+			n.deSerialize(*nodebuf, ser_version);
+			block->setNodeNoCheck(p_rel, n);
+		}
+
+		bool has_metadata = readU8(is);
+		if(has_metadata)
+		{
+			std::ostringstream oss(std::ios_base::binary);
+			decompressZlib(is, oss);
+			std::istringstream iss(oss.str(), std::ios_base::binary);
+			block->m_node_metadata->deSerialize(iss, this);
+		}
+
+		/*
+			Update the mesh of this block and the neighbors that may
+			show the changed nodes
+		*/
+		addUpdateMeshTaskWithEdge(p);
+	}
 	else if(command == TOCLIENT_INVENTORY)
 	{
 		if(datasize < 3)
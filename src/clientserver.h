@@ -44,9 +44,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		Obsolete TOCLIENT_TOOLDEF
 		Obsolete TOCLIENT_CRAFTITEMDEF
 		Compress the contents of TOCLIENT_ITEMDEF and TOCLIENT_NODEDEF
+	PROTOCOL_VERSION 8:
+		Add TOCLIENT_BLOCK_DELTA
 */
 
-#define PROTOCOL_VERSION 7
+#define PROTOCOL_VERSION 8
 
 #define PROTOCOL_ID 0x4f457403
 
@@ -265,6 +267,23 @@ enum ToClientCommand
 		serialized ItemDefManager
 	*/
 
+	TOCLIENT_BLOCK_DELTA = 0x3e,
+	/*
+		Changes to a block that has already been sent to the client.
+		Sent on the same channel as TOCLIENT_BLOCKDATA.
+
+		u16 command
+		v3s16 block position
+		u8 flags (the first byte of a serialized MapBlock)
+		u16 node count
+		for each node:
+			u16 node index (z*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+			                + y*MAP_BLOCKSIZE + x)
+			MapNode serialized in the serialization version in use
+		u8 1 if node metadata follows, else 0
+		[zlib-compressed node metadata list of the block]
+	*/
+
 };
 
 enum ToServerCommand
@@ -154,71 +154,111 @@ SharedBuffer<u8> makeReliablePacket(
 }
 
 /*
-	ReliablePacketBuffer
+	PacketTimeHeap
 */
 
-void ReliablePacketBuffer::print()
+void PacketTimeHeap::push(double time, u16 seqnum)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	Entry e;
+	e.time = time;
+	e.seqnum = seqnum;
+	m_heap.push_back(e);
+	u32 i = m_heap.size() - 1;
+	while(i != 0)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		dout_con<<s<<" ";
+		u32 parent = (i - 1) / 2;
+		if(m_heap[parent].time <= m_heap[i].time)
+			break;
+		Entry tmp = m_heap[parent];
+		m_heap[parent] = m_heap[i];
+		m_heap[i] = tmp;
+		i = parent;
 	}
 }
-bool ReliablePacketBuffer::empty()
+
+void PacketTimeHeap::pop()
 {
-	return m_list.empty();
+	u32 last = m_heap.size() - 1;
+	m_heap[0] = m_heap[last];
+	m_heap.erase(last);
+	u32 size = m_heap.size();
+	u32 i = 0;
+	for(;;)
+	{
+		u32 l = i * 2 + 1;
+		u32 r = i * 2 + 2;
+		u32 smallest = i;
+		if(l < size && m_heap[l].time < m_heap[smallest].time)
+			smallest = l;
+		if(r < size && m_heap[r].time < m_heap[smallest].time)
+			smallest = r;
+		if(smallest == i)
+			break;
+		Entry tmp = m_heap[smallest];
+		m_heap[smallest] = m_heap[i];
+		m_heap[i] = tmp;
+		i = smallest;
+	}
 }
-u32 ReliablePacketBuffer::size()
+
+/*
+	ReliablePacketBuffer
+*/
+
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_slots(NULL),
+	m_capacity(RELIABLE_BUFFER_INITIAL_SIZE),
+	m_count(0),
+	m_first(0),
+	m_last(0),
+	m_time(0.0)
 {
-	return m_list.getSize();
+	m_slots = new Slot[m_capacity];
 }
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	delete[] m_slots;
+}
+void ReliablePacketBuffer::print()
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	if(empty())
+		return;
+	for(u16 s=m_first; ; s++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
+		if(slot(s).used)
+			dout_con<<s<<" ";
+		if(s == m_last)
 			break;
 	}
-	return i;
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+bool ReliablePacketBuffer::empty()
+{
+	return m_count == 0;
+}
+u32 ReliablePacketBuffer::size()
 {
-	return m_list.end();
+	return m_count;
 }
 u16 ReliablePacketBuffer::getFirstSeqnum()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	return readU16(&p.data[BASE_HEADER_SIZE+1]);
+	return m_first;
 }
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	core::list<BufferedPacket>::Iterator i = m_list.begin();
-	m_list.erase(i);
-	return p;
+	return take(m_first);
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	if(empty() || (u16)(seqnum - m_first) > (u16)(m_last - m_first)
+			|| slot(seqnum).used == false){
 		dout_con<<"Not found"<<std::endl;
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-	m_list.erase(r);
-	return p;
+	return take(seqnum);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p)
 {
@@ -227,67 +267,86 @@ void ReliablePacketBuffer::insert(BufferedPacket &p)
 	assert(type == TYPE_RELIABLE);
 	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
 
-	// Find the right place for the packet and insert it there
-
-	// If list is empty, just add it
-	if(m_list.empty())
+	if(empty())
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
-	}
-	// Otherwise find the right place
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	for(; i != m_list.end(); i++){
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		if(s == seqnum){
-			throw AlreadyExistsException("Same seqnum in list");
-		}
-		if(seqnum_higher(s, seqnum)){
-			break;
-		}
+		m_first = seqnum;
+		m_last = seqnum;
 	}
-	// If we're at the end of the list, add the packet to the
-	// end of the list
-	if(i == m_list.end())
+	else
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
+		/*
+			Position relative to the current range. Offsets over half
+			of the seqnum space are before the range.
+		*/
+		u16 first = m_first;
+		u16 last = m_last;
+		u16 offset = seqnum - m_first;
+		if(offset > SEQNUM_MAX/2)
+			first = seqnum;
+		else if(offset > (u16)(m_last - m_first))
+			last = seqnum;
+		else if(slot(seqnum).used)
+			throw AlreadyExistsException("Same seqnum in list");
+
+		// All seqnums from first to last must map to different slots
+		u32 span = (u16)(last - first) + 1;
+		if(span > RELIABLE_BUFFER_MAX_SIZE)
+			throw ContainerFullException("Seqnum too far from the others");
+		if(span > m_capacity)
+			grow(span);
+		m_first = first;
+		m_last = last;
 	}
-	// Insert before i
-	m_list.insert_before(i, p);
+
+	Slot &s = slot(seqnum);
+	s.packet = p;
+	s.seqnum = seqnum;
+	s.used = true;
+	s.sent_at = m_time - p.time;
+	s.buffered_at = m_time - p.totaltime;
+	m_count++;
+
+	m_sent_heap.push(s.sent_at, seqnum);
+	m_buffered_heap.push(s.buffered_at, seqnum);
+
+	// Don't let the stale entries pile up
+	if(m_sent_heap.size() > m_count * 2 + 16
+			|| m_buffered_heap.size() > m_count * 2 + 16)
+		rebuildHeaps();
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		i->time += dtime;
-		i->totaltime += dtime;
-	}
+	m_time += dtime;
 }
 
 void ReliablePacketBuffer::resetTimedOuts(float timeout)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		if(i->time >= timeout)
-			i->time = 0.0;
+	core::list<u16> reset;
+	while(m_sent_heap.empty() == false
+			&& m_time - m_sent_heap.top().time >= timeout)
+	{
+		PacketTimeHeap::Entry e = m_sent_heap.top();
+		m_sent_heap.pop();
+		Slot &s = slot(e.seqnum);
+		if(s.used == false || s.seqnum != e.seqnum || s.sent_at != e.time)
+			continue;
+		s.sent_at = m_time;
+		reset.push_back(e.seqnum);
 	}
+	for(core::list<u16>::Iterator i = reset.begin(); i != reset.end(); i++)
+		m_sent_heap.push(m_time, *i);
 }
 
 bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		if(i->totaltime >= timeout)
-			return true;
+	while(m_buffered_heap.empty() == false)
+	{
+		PacketTimeHeap::Entry &e = m_buffered_heap.top();
+		Slot &s = slot(e.seqnum);
+		if(s.used && s.seqnum == e.seqnum && s.buffered_at == e.time)
+			return (m_time - e.time >= timeout);
+		m_buffered_heap.pop();
 	}
 	return false;
 }
@@ -295,28 +354,110 @@ bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 core::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout)
 {
 	core::list<BufferedPacket> timed_outs;
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	if(m_sent_heap.empty())
+		return timed_outs;
+
+	/*
+		Walk the part of the heap that is old enough. The heap is not
+		modified; resetTimedOuts() does that.
+	*/
+	core::array<u32> stack;
+	stack.push_back(0);
+	while(stack.size() != 0)
 	{
-		if(i->time >= timeout)
-			timed_outs.push_back(*i);
+		u32 i = stack[stack.size() - 1];
+		stack.erase(stack.size() - 1);
+		if(i >= m_sent_heap.size())
+			continue;
+		PacketTimeHeap::Entry &e = m_sent_heap.at(i);
+		if(m_time - e.time < timeout)
+			continue;
+		stack.push_back(i * 2 + 1);
+		stack.push_back(i * 2 + 2);
+
+		Slot &s = slot(e.seqnum);
+		if(s.used == false || s.seqnum != e.seqnum || s.sent_at != e.time)
+			continue;
+		BufferedPacket p = s.packet;
+		p.time = m_time - s.sent_at;
+		p.totaltime = m_time - s.buffered_at;
+		timed_outs.push_back(p);
 	}
 	return timed_outs;
 }
 
+BufferedPacket ReliablePacketBuffer::take(u16 seqnum)
+{
+	Slot &s = slot(seqnum);
+	assert(s.used && s.seqnum == seqnum);
+	BufferedPacket p = s.packet;
+	p.time = m_time - s.sent_at;
+	p.totaltime = m_time - s.buffered_at;
+	s.packet = BufferedPacket();
+	s.used = false;
+	m_count--;
+
+	// Move the ends of the range to the next buffered packets
+	if(m_count != 0)
+	{
+		if(seqnum == m_first)
+			while(slot(m_first).used == false)
+				m_first++;
+		else if(seqnum == m_last)
+			while(slot(m_last).used == false)
+				m_last--;
+	}
+	return p;
+}
+
+void ReliablePacketBuffer::grow(u32 span)
+{
+	u32 capacity = m_capacity;
+	while(capacity < span)
+		capacity *= 2;
+	Slot *slots = new Slot[capacity];
+	for(u32 i=0; i<m_capacity; i++)
+	{
+		if(m_slots[i].used)
+			slots[m_slots[i].seqnum & (capacity - 1)] = m_slots[i];
+	}
+	delete[] m_slots;
+	m_slots = slots;
+	m_capacity = capacity;
+}
+
+void ReliablePacketBuffer::rebuildHeaps()
+{
+	m_sent_heap.clear();
+	m_buffered_heap.clear();
+	for(u32 i=0; i<m_capacity; i++)
+	{
+		Slot &s = m_slots[i];
+		if(s.used == false)
+			continue;
+		m_sent_heap.push(s.sent_at, s.seqnum);
+		m_buffered_heap.push(s.buffered_at, s.seqnum);
+	}
+}
+
 /*
 	IncomingSplitBuffer
 */
 
+IncomingSplitBuffer::IncomingSplitBuffer():
+	m_slots(NULL),
+	m_capacity(SPLIT_BUFFER_INITIAL_SIZE),
+	m_time(0.0)
+{
+	m_slots = new IncomingSplitPacket*[m_capacity];
+	for(u32 i=0; i<m_capacity; i++)
+		m_slots[i] = NULL;
+}
 IncomingSplitBuffer::~IncomingSplitBuffer()
 {
-	core::map<u16, IncomingSplitPacket*>::Iterator i;
-	i = m_buf.getIterator();
-	for(; i.atEnd() == false; i++)
-	{
-		delete i.getNode()->getValue();
-	}
+	for(u32 i=0; i<m_capacity; i++)
+		delete m_slots[i];
+	delete[] m_slots;
 }
 /*
 	This will throw a GotSplitPacketException when a full
@@ -332,17 +473,35 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	u16 chunk_count = readU16(&p.data[BASE_HEADER_SIZE+3]);
 	u16 chunk_num = readU16(&p.data[BASE_HEADER_SIZE+5]);
 
+	if(chunk_num >= chunk_count)
+		throw InvalidIncomingDataException("Invalid split chunk number");
+	if(chunk_count > SPLIT_CHUNK_COUNT_MAX)
+		throw InvalidIncomingDataException("Too many split chunks");
+	// The sender never makes empty chunks
+	if(p.data.getSize() == headersize)
+		throw InvalidIncomingDataException("Empty split chunk");
+
 	// Add if doesn't exist
-	if(m_buf.find(seqnum) == NULL)
+	IncomingSplitPacket *sp = find(seqnum);
+	if(sp == NULL)
 	{
-		IncomingSplitPacket *sp = new IncomingSplitPacket();
-		sp->chunk_count = chunk_count;
-		sp->reliable = reliable;
-		m_buf[seqnum] = sp;
+		while(slot(seqnum) != NULL && m_capacity < SPLIT_BUFFER_MAX_SIZE)
+			grow();
+		if(slot(seqnum) != NULL)
+		{
+			// Full; only an unreliable packet may be dropped for this
+			if(slot(seqnum)->reliable)
+				throw InvalidIncomingDataException("Split buffer full");
+			dout_con<<"NOTE: Split buffer full, dropping unreliable "
+					"split packet"<<std::endl;
+			remove(slot(seqnum)->seqnum);
+		}
+		sp = new IncomingSplitPacket(seqnum, chunk_count, reliable, m_time);
+		slot(seqnum) = sp;
+		if(reliable == false)
+			m_timeout_heap.push(sp->added, seqnum);
 	}
 	
-	IncomingSplitPacket *sp = m_buf[seqnum];
-	
 	// TODO: These errors should be thrown or something? Dunno.
 	if(chunk_count != sp->chunk_count)
 		derr_con<<"Connection: WARNING: chunk_count="<<chunk_count
@@ -353,6 +512,9 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 				<<" != sp->reliable="<<sp->reliable
 				<<std::endl;
 
+	if(chunk_num >= sp->chunk_count)
+		throw InvalidIncomingDataException("Invalid split chunk number");
+
 	// If chunk already exists, cancel
 	if(sp->chunks.find(chunk_num) != NULL)
 		throw AlreadyExistsException("Chunk already in buffer");
@@ -372,56 +534,73 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	// Calculate total size
 	u32 totalsize = 0;
 	core::map<u16, SharedBuffer<u8> >::Iterator i;
-	i = sp->chunks.getIterator();
-	for(; i.atEnd() == false; i++)
-	{
+	for(i = sp->chunks.getIterator(); i.atEnd() == false; i++)
 		totalsize += i.getNode()->getValue().getSize();
-	}
 	
 	SharedBuffer<u8> fulldata(totalsize);
 
-	// Copy chunks to data buffer
+	// Copy chunks to data buffer; the map is in chunk number order
 	u32 start = 0;
-	for(u32 chunk_i=0; chunk_i<sp->chunk_count;
-			chunk_i++)
+	for(i = sp->chunks.getIterator(); i.atEnd() == false; i++)
 	{
-		SharedBuffer<u8> buf = sp->chunks[chunk_i];
+		SharedBuffer<u8> &buf = i.getNode()->getValue();
 		u16 chunkdatasize = buf.getSize();
 		memcpy(&fulldata[start], *buf, chunkdatasize);
-		start += chunkdatasize;;
+		start += chunkdatasize;
 	}
 
 	// Remove sp from buffer
-	m_buf.remove(seqnum);
-	delete sp;
+	remove(seqnum);
 
 	return fulldata;
 }
 void IncomingSplitBuffer::removeUnreliableTimedOuts(float dtime, float timeout)
 {
-	core::list<u16> remove_queue;
-	core::map<u16, IncomingSplitPacket*>::Iterator i;
-	i = m_buf.getIterator();
-	for(; i.atEnd() == false; i++)
+	m_time += dtime;
+	while(m_timeout_heap.empty() == false
+			&& m_time - m_timeout_heap.top().time >= timeout)
 	{
-		IncomingSplitPacket *p = i.getNode()->getValue();
-		// Reliable ones are not removed by timeout
-		if(p->reliable == true)
+		PacketTimeHeap::Entry e = m_timeout_heap.top();
+		m_timeout_heap.pop();
+		// Skip if already completed or dropped
+		IncomingSplitPacket *sp = find(e.seqnum);
+		if(sp == NULL || sp->reliable || sp->added != e.time)
 			continue;
-		p->time += dtime;
-		if(p->time >= timeout)
-			remove_queue.push_back(i.getNode()->getKey());
-	}
-	core::list<u16>::Iterator j;
-	j = remove_queue.begin();
-	for(; j != remove_queue.end(); j++)
-	{
 		dout_con<<"NOTE: Removing timed out unreliable split packet"
 				<<std::endl;
-		delete m_buf[*j];
-		m_buf.remove(*j);
+		remove(e.seqnum);
 	}
 }
+IncomingSplitPacket * IncomingSplitBuffer::find(u16 seqnum)
+{
+	IncomingSplitPacket *sp = slot(seqnum);
+	if(sp == NULL || sp->seqnum != seqnum)
+		return NULL;
+	return sp;
+}
+void IncomingSplitBuffer::remove(u16 seqnum)
+{
+	IncomingSplitPacket *&sp = slot(seqnum);
+	assert(sp != NULL && sp->seqnum == seqnum);
+	delete sp;
+	sp = NULL;
+}
+void IncomingSplitBuffer::grow()
+{
+	u32 capacity = m_capacity * 2;
+	assert(capacity <= SEQNUM_MAX + 1);
+	IncomingSplitPacket **slots = new IncomingSplitPacket*[capacity];
+	for(u32 i=0; i<capacity; i++)
+		slots[i] = NULL;
+	for(u32 i=0; i<m_capacity; i++)
+	{
+		if(m_slots[i] != NULL)
+			slots[m_slots[i]->seqnum & (capacity - 1)] = m_slots[i];
+	}
+	delete[] m_slots;
+	m_slots = slots;
+	m_capacity = capacity;
+}
 
 /*
 	Channel
@@ -449,11 +628,18 @@ Peer::Peer(u16 a_id, Address a_address):
 	resend_timeout(0.5),
 	avg_rtt(-1.0),
 	has_sent_with_id(false),
+	congestion_window(CONGESTION_WINDOW_INITIAL),
+	slow_start_threshold(CONGESTION_WINDOW_MAX),
+	time_from_loss(0.0),
+	acked_count(0),
+	resent_count(0),
+	loss_count(0),
 	m_sendtime_accu(0),
 	m_max_packets_per_second(10),
 	m_num_sent(0),
 	m_max_num_sent(0)
 {
+	updatePacingRate();
 }
 Peer::~Peer()
 {
@@ -461,20 +647,6 @@ Peer::~Peer()
 
 void Peer::reportRTT(float rtt)
 {
-	if(rtt >= 0.0){
-		if(rtt < 0.01){
-			if(m_max_packets_per_second < 100)
-				m_max_packets_per_second += 10;
-		} else if(rtt < 0.2){
-			if(m_max_packets_per_second < 100)
-				m_max_packets_per_second += 2;
-		} else {
-			m_max_packets_per_second *= 0.8;
-			if(m_max_packets_per_second < 10)
-				m_max_packets_per_second = 10;
-		}
-	}
-
 	if(rtt < -0.999)
 	{}
 	else if(avg_rtt < 0.0)
@@ -498,22 +670,102 @@ void Peer::reportRTT(float rtt)
 	if(timeout > RESEND_TIMEOUT_MAX)
 		timeout = RESEND_TIMEOUT_MAX;
 	resend_timeout = timeout;
+
+	updatePacingRate();
+}
+
+void Peer::reportAck()
+{
+	acked_count++;
+	if(congestion_window < slow_start_threshold)
+		congestion_window += 1.0;
+	else
+		congestion_window += 1.0 / congestion_window;
+	if(congestion_window > CONGESTION_WINDOW_MAX)
+		congestion_window = CONGESTION_WINDOW_MAX;
+	updatePacingRate();
+}
+
+void Peer::reportLoss(u32 resent)
+{
+	resent_count += resent;
+
+	// Packets sent before the last decrease are still timing out;
+	// decrease only once for them
+	if(loss_count != 0 && time_from_loss < resend_timeout)
+		return;
+
+	loss_count++;
+	time_from_loss = 0.0;
+	slow_start_threshold = congestion_window / 2;
+	if(slow_start_threshold < CONGESTION_WINDOW_MIN)
+		slow_start_threshold = CONGESTION_WINDOW_MIN;
+	congestion_window = slow_start_threshold;
+	updatePacingRate();
+}
+
+u32 Peer::getReliablesInFlight()
+{
+	u32 count = 0;
+	for(u16 i=0; i<CHANNEL_COUNT; i++)
+		count += channels[i].outgoing_reliables.size();
+	return count;
+}
+
+void Peer::PrintInfo(std::ostream &out)
+{
+	out<<"Peer "<<id<<": "
+			<<"avg_rtt="<<avg_rtt
+			<<", resend_timeout="<<resend_timeout
+			<<", congestion_window="<<congestion_window
+			<<", slow_start_threshold="<<slow_start_threshold
+			<<", in_flight="<<getReliablesInFlight()
+			<<", packets_per_second="<<m_max_packets_per_second
+			<<", acked="<<acked_count
+			<<", resent="<<resent_count
+			<<", losses="<<loss_count
+			<<std::endl;
+}
+
+void Peer::updatePacingRate()
+{
+	// Until the RTT is known, assume a typical one
+	float rtt = (avg_rtt > 0.0) ? avg_rtt : 0.1;
+	if(rtt < 0.01)
+		rtt = 0.01;
+	m_max_packets_per_second = congestion_window / rtt * PACING_GAIN;
+	if(m_max_packets_per_second < 10)
+		m_max_packets_per_second = 10;
 }
 				
 /*
 	Connection
 */
 
+// Size of the buffer for receiving a single datagram
+static u32 receiveBufferSize(u32 max_packet_size)
+{
+	// The size is doubled just to be safe.
+	// TODO: We can not know how many layers of header there are.
+	// For now, just assume there are no other than the base headers.
+	return max_packet_size * 2 + BASE_HEADER_SIZE;
+}
+
 Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout):
 	m_protocol_id(protocol_id),
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
 	m_peer_id(0),
+	m_receive_buffer_size(receiveBufferSize(max_packet_size)),
+	m_receive_buffers(NULL),
 	m_bc_peerhandler(NULL),
 	m_bc_receive_timeout(0),
 	m_indentation(0)
 {
 	m_socket.setTimeoutMs(5);
+	m_peers_mutex.Init();
+	m_receive_buffers = new u8[CONNECTION_BATCH_SIZE * m_receive_buffer_size];
+	m_send_batch.reserve(CONNECTION_BATCH_SIZE);
 
 	Start();
 }
@@ -524,11 +776,16 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
 	m_peer_id(0),
+	m_receive_buffer_size(receiveBufferSize(max_packet_size)),
+	m_receive_buffers(NULL),
 	m_bc_peerhandler(peerhandler),
 	m_bc_receive_timeout(0),
 	m_indentation(0)
 {
 	m_socket.setTimeoutMs(5);
+	m_peers_mutex.Init();
+	m_receive_buffers = new u8[CONNECTION_BATCH_SIZE * m_receive_buffer_size];
+	m_send_batch.reserve(CONNECTION_BATCH_SIZE);
 
 	Start();
 }
@@ -537,6 +794,7 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 Connection::~Connection()
 {
 	stop();
+	delete[] m_receive_buffers;
 }
 
 /* Internal stuff */
@@ -572,7 +830,12 @@ void * Connection::Thread()
 
 		send(dtime);
 
+		flushSends();
+
 		receive();
+
+		// Replies and acks generated while receiving
+		flushSends();
 		
 		END_DEBUG_EXCEPTION_HANDLER(derr_con);
 	}
@@ -638,7 +901,10 @@ void Connection::send(float dtime)
 		Peer *peer = getPeerNoEx(packet.peer_id);
 		if(!peer)
 			continue;
-		if(peer->channels[packet.channelnum].outgoing_reliables.size() >= 5){
+		// Reliables wait for room in the congestion window
+		if(packet.reliable && (peer->getReliablesInFlight()
+				>= peer->congestion_window
+				|| peer->channels[packet.channelnum].outgoingWindowFull())){
 			postponed_packets.push_back(packet);
 		} else if(peer->m_num_sent < peer->m_max_num_sent){
 			rawSendAsPacket(packet.peer_id, packet.channelnum,
@@ -666,49 +932,43 @@ void Connection::send(float dtime)
 // Receive packets from the network and buffers and create ConnectionEvents
 void Connection::receive()
 {
-	u32 datasize = m_max_packet_size * 2;  // Double it just to be safe
-	// TODO: We can not know how many layers of header there are.
-	// For now, just assume there are no other than the base headers.
-	u32 packet_maxsize = datasize + BASE_HEADER_SIZE;
-	SharedBuffer<u8> packetdata(packet_maxsize);
+	UDPDatagram datagrams[CONNECTION_BATCH_SIZE];
+	for(u32 i=0; i<CONNECTION_BATCH_SIZE; i++)
+		datagrams[i].data = &m_receive_buffers[i * m_receive_buffer_size];
+
+	receiveFromBuffers();
+
+	// Only wait for the first batch
+	bool wait = true;
 
-	bool single_wait_done = false;
-	
 	for(;;)
 	{
-	try{
-		/* Check if some buffer has relevant data */
+		int count = m_socket.ReceiveBatch(datagrams, CONNECTION_BATCH_SIZE,
+				m_receive_buffer_size, wait);
+		wait = false;
+		if(count == 0)
+			break;
+
+		for(int i=0; i<count; i++)
 		{
-			u16 peer_id;
-			SharedBuffer<u8> resultdata;
-			bool got = getFromBuffers(peer_id, resultdata);
-			if(got){
-				ConnectionEvent e;
-				e.dataReceived(peer_id, resultdata);
-				putEvent(e);
-				continue;
-			}
+			receiveDatagram(datagrams[i].address,
+					(u8*)datagrams[i].data, datagrams[i].size);
+			receiveFromBuffers();
 		}
-		
-		if(single_wait_done){
-			if(m_socket.WaitData(0) == false)
-				break;
-		}
-		
-		single_wait_done = true;
-
-		Address sender;
-		s32 received_size = m_socket.Receive(sender, *packetdata, packet_maxsize);
+	}
+}
 
-		if(received_size < 0)
-			break;
+void Connection::receiveDatagram(Address sender, u8 *packetdata,
+		s32 received_size)
+{
+	try{
 		if(received_size < BASE_HEADER_SIZE)
-			continue;
+			return;
 		if(readU32(&packetdata[0]) != m_protocol_id)
-			continue;
+			return;
 		
-		u16 peer_id = readPeerId(*packetdata);
-		u8 channelnum = readChannel(*packetdata);
+		u16 peer_id = readPeerId(packetdata);
+		u8 channelnum = readChannel(packetdata);
 		if(channelnum > CHANNEL_COUNT-1){
 			PrintInfo(derr_con);
 			derr_con<<"Receive(): Invalid channel "<<channelnum<<std::endl;
@@ -782,7 +1042,7 @@ void Connection::receive()
 			}
 			if(out_of_ids){
 				errorstream<<getDesc()<<" ran out of peer ids"<<std::endl;
-				continue;
+				return;
 			}
 
 			PrintInfo();
@@ -791,7 +1051,10 @@ void Connection::receive()
 
 			// Create a peer
 			Peer *peer = new Peer(peer_id_new, sender);
-			m_peers.insert(peer->id, peer);
+			{
+				JMutexAutoLock peerlock(m_peers_mutex);
+				m_peers.insert(peer->id, peer);
+			}
 			
 			// Create peer addition event
 			ConnectionEvent e;
@@ -831,7 +1094,7 @@ void Connection::receive()
 			PrintInfo(derr_con);
 			derr_con<<"Peer "<<peer_id<<" sending from different address."
 					" Ignoring."<<std::endl;
-			continue;
+			return;
 		}
 		
 		peer->timeout_counter = 0.0;
@@ -857,14 +1120,27 @@ void Connection::receive()
 			ConnectionEvent e;
 			e.dataReceived(peer_id, resultdata);
 			putEvent(e);
-			continue;
 		}catch(ProcessedSilentlyException &e){
 		}
 	}catch(InvalidIncomingDataException &e){
 	}
 	catch(ProcessedSilentlyException &e){
 	}
-	} // for
+}
+
+void Connection::receiveFromBuffers()
+{
+	for(;;)
+	{
+		u16 peer_id;
+		SharedBuffer<u8> resultdata;
+		bool got = getFromBuffers(peer_id, resultdata);
+		if(!got)
+			break;
+		ConnectionEvent e;
+		e.dataReceived(peer_id, resultdata);
+		putEvent(e);
+	}
 }
 
 void Connection::runTimeouts(float dtime)
@@ -880,6 +1156,7 @@ void Connection::runTimeouts(float dtime)
 			Check peer timeout
 		*/
 		peer->timeout_counter += dtime;
+		peer->time_from_loss += dtime;
 		if(peer->timeout_counter > m_timeout)
 		{
 			PrintInfo(derr_con);
@@ -952,6 +1229,9 @@ void Connection::runTimeouts(float dtime)
 				// checked channel because it was cached.
 				peer->reportRTT(resend_timeout);
 			}
+
+			if(timed_outs.size() != 0)
+				peer->reportLoss(timed_outs.size());
 		}
 		
 		/*
@@ -1001,7 +1281,10 @@ void Connection::connect(Address address)
 	}
 
 	Peer *peer = new Peer(PEER_ID_SERVER, address);
-	m_peers.insert(peer->id, peer);
+	{
+		JMutexAutoLock peerlock(m_peers_mutex);
+		m_peers.insert(peer->id, peer);
+	}
 
 	// Create event
 	ConnectionEvent e;
@@ -1033,6 +1316,7 @@ void Connection::disconnect()
 		Peer *peer = j.getNode()->getValue();
 		rawSendAsPacket(peer->id, 0, data, false);
 	}
+	flushSends();
 }
 
 void Connection::sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
@@ -1093,6 +1377,14 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 
 	if(reliable)
 	{
+		// Wait for ACKs; send() will try again
+		if(channel->outgoingWindowFull())
+		{
+			m_outgoing_queue.push_back(OutgoingPacket(peer_id, channelnum,
+					data, true));
+			return;
+		}
+
 		u16 seqnum = channel->next_outgoing_seqnum;
 		channel->next_outgoing_seqnum++;
 
@@ -1131,12 +1423,36 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 
 void Connection::rawSend(const BufferedPacket &packet)
 {
-	try{
-		m_socket.Send(packet.address, *packet.data, packet.data.getSize());
-	} catch(SendFailedException &e){
-		derr_con<<"Connection::rawSend(): SendFailedException: "
-				<<packet.address.serializeString()<<std::endl;
+	m_send_batch.push_back(packet);
+	if(m_send_batch.size() >= CONNECTION_BATCH_SIZE)
+		flushSends();
+}
+
+void Connection::flushSends()
+{
+	if(m_send_batch.empty())
+		return;
+
+	UDPDatagram datagrams[CONNECTION_BATCH_SIZE];
+	u32 count = 0;
+	for(std::vector<BufferedPacket>::iterator
+			i = m_send_batch.begin();
+			i != m_send_batch.end(); i++)
+	{
+		UDPDatagram &d = datagrams[count++];
+		d.address = i->address;
+		d.data = *i->data;
+		d.size = i->data.getSize();
+		if(count == CONNECTION_BATCH_SIZE)
+		{
+			m_socket.SendBatch(datagrams, count);
+			count = 0;
+		}
 	}
+	if(count != 0)
+		m_socket.SendBatch(datagrams, count);
+
+	m_send_batch.clear();
 }
 
 Peer* Connection::getPeer(u16 peer_id)
@@ -1288,6 +1604,7 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 				// (avg_rtt and resend_timeout)
 				Peer *peer = getPeer(peer_id);
 				peer->reportRTT(rtt);
+				peer->reportAck();
 
 				//PrintInfo(dout_con);
 				//dout_con<<"RTT = "<<rtt<<std::endl;
@@ -1408,6 +1725,15 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		bool is_future_packet = seqnum_higher(seqnum, channel->next_incoming_seqnum);
 		bool is_old_packet = seqnum_higher(channel->next_incoming_seqnum, seqnum);
 		
+		// Don't let a single packet make the buffer huge. It is not
+		// ACKed, so it will be resent.
+		if(is_future_packet && (u16)(seqnum - channel->next_incoming_seqnum)
+				>= RELIABLE_BUFFER_MAX_SIZE)
+		{
+			throw InvalidIncomingDataException
+					("Reliable packet too far ahead");
+		}
+
 		PrintInfo();
 		if(is_future_packet)
 			dout_con<<"BUFFERING";
@@ -1502,6 +1828,8 @@ bool Connection::deletePeer(u16 peer_id, bool timeout)
 	e.peerRemoved(peer_id, timeout, peer->address);
 	putEvent(e);
 
+	// The interface functions may be reading the peer
+	JMutexAutoLock peerlock(m_peers_mutex);
 	delete m_peers[peer_id];
 	m_peers.remove(peer_id);
 	return true;
@@ -1638,6 +1966,14 @@ float Connection::GetPeerAvgRTT(u16 peer_id)
 	return getPeer(peer_id)->avg_rtt;
 }
 
+void Connection::PrintPeerInfo(u16 peer_id, std::ostream &out)
+{
+	JMutexAutoLock peerlock(m_peers_mutex);
+	Peer *peer = getPeerNoEx(peer_id);
+	if(peer)
+		peer->PrintInfo(out);
+}
+
 void Connection::DeletePeer(u16 peer_id)
 {
 	ConnectionCommand c;
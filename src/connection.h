@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <iostream>
 #include <fstream>
+#include <vector>
 #include "debug.h"
 #include "common_irrlicht.h"
 #include "socket.h"
@@ -119,6 +120,9 @@ inline bool seqnum_higher(u16 higher, u16 lower)
 
 struct BufferedPacket
 {
+	BufferedPacket():
+		time(0.0), totaltime(0.0)
+	{}
 	BufferedPacket(u8 *a_data, u32 a_size):
 		data(a_data, a_size), time(0.0), totaltime(0.0)
 	{}
@@ -161,15 +165,20 @@ SharedBuffer<u8> makeReliablePacket(
 
 struct IncomingSplitPacket
 {
-	IncomingSplitPacket()
-	{
-		time = 0.0;
-		reliable = false;
-	}
-	// Key is chunk number, value is data without headers
+	IncomingSplitPacket(u16 a_seqnum, u32 a_chunk_count, bool a_reliable,
+			double a_added):
+		seqnum(a_seqnum),
+		chunk_count(a_chunk_count),
+		added(a_added),
+		reliable(a_reliable)
+	{}
+	u16 seqnum;
+	// Key is chunk number, value is data without headers.
+	// Only the received chunks take memory; chunk_count comes from
+	// the network.
 	core::map<u16, SharedBuffer<u8> > chunks;
 	u32 chunk_count;
-	float time; // Seconds from adding
+	double added; // Time of adding on the clock of the buffer
 	bool reliable; // If true, isn't deleted on timeout
 
 	bool allReceived()
@@ -199,6 +208,8 @@ TODO: Should we have a receiver_peer_id also?
 #define PEER_ID_INEXISTENT 0
 #define PEER_ID_SERVER 1
 #define CHANNEL_COUNT 3
+// Maximum number of datagrams passed to the socket at once
+#define CONNECTION_BATCH_SIZE UDP_BATCH_MAX
 /*
 Packet types:
 
@@ -263,22 +274,91 @@ with a buffer in the receiving and transmitting end.
 //#define SEQNUM_INITIAL 0x10
 #define SEQNUM_INITIAL 65500
 
+// Initial numbers of slots in the buffers below; must be powers of two
+#define RELIABLE_BUFFER_INITIAL_SIZE 64
+#define SPLIT_BUFFER_INITIAL_SIZE 16
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
+	Largest range of seqnums a reliable buffer holds. Incoming reliables
+	further ahead are dropped without an ACK; the sender resends them.
+	Must be a power of two and above CONGESTION_WINDOW_MAX.
 */
+#define RELIABLE_BUFFER_MAX_SIZE 4096
+/*
+	Largest number of split packets being reconstructed at once on a
+	channel. When it is reached, unreliable ones are dropped to make
+	room. Must be a power of two.
+*/
+#define SPLIT_BUFFER_MAX_SIZE 256
+// Split packets with more chunks are invalid (2 MB at 512 byte packets)
+#define SPLIT_CHUNK_COUNT_MAX 4096
+
+/*
+	Min-heap of packet times, used for finding timed out packets
+	without walking through all of them.
+
+	Entries are not removed together with their packets; the users
+	skip the stale entries when they come up.
+*/
+class PacketTimeHeap
+{
+public:
+	struct Entry
+	{
+		double time;
+		u16 seqnum;
+	};
+
+	void push(double time, u16 seqnum);
+	void pop();
+	Entry & top()
+	{
+		return m_heap[0];
+	}
+	// Entries in heap order: children of i are 2*i+1 and 2*i+2
+	Entry & at(u32 i)
+	{
+		return m_heap[i];
+	}
+	bool empty()
+	{
+		return m_heap.size() == 0;
+	}
+	u32 size()
+	{
+		return m_heap.size();
+	}
+	void clear()
+	{
+		m_heap.clear();
+	}
+
+private:
+	core::array<Entry> m_heap;
+};
+
+/*
+	A buffer which stores reliable packets for fast access by seqnum
+	and to the smallest one.
 
-typedef core::list<BufferedPacket>::Iterator RPBSearchResult;
+	The packets are kept in a ring indexed by seqnum. The ring is grown
+	when the range of buffered seqnums does not fit in it, up to
+	RELIABLE_BUFFER_MAX_SIZE; insert() throws ContainerFullException
+	for packets that would need more.
+
+	Packet times are counted on a clock of the buffer, so advancing
+	them is a single addition. Send and buffering times are kept in
+	heaps for finding the timed out packets.
+*/
 
 class ReliablePacketBuffer
 {
 public:
+	ReliablePacketBuffer();
+	~ReliablePacketBuffer();
 	
 	void print();
 	bool empty();
 	u32 size();
-	RPBSearchResult findPacket(u16 seqnum);
-	RPBSearchResult notFound();
 	u16 getFirstSeqnum();
 	BufferedPacket popFirst();
 	BufferedPacket popSeqnum(u16 seqnum);
@@ -289,16 +369,62 @@ class ReliablePacketBuffer
 	core::list<BufferedPacket> getTimedOuts(float timeout);
 
 private:
-	core::list<BufferedPacket> m_list;
+	// Not copyable
+	ReliablePacketBuffer(const ReliablePacketBuffer &);
+	ReliablePacketBuffer & operator=(const ReliablePacketBuffer &);
+
+	struct Slot
+	{
+		Slot():
+			seqnum(0),
+			used(false),
+			sent_at(0.0),
+			buffered_at(0.0)
+		{}
+		BufferedPacket packet;
+		u16 seqnum;
+		bool used;
+		// Times on m_time
+		double sent_at;
+		double buffered_at;
+	};
+
+	Slot & slot(u16 seqnum)
+	{
+		return m_slots[seqnum & (m_capacity - 1)];
+	}
+	// Removes a packet and returns it with its times set
+	BufferedPacket take(u16 seqnum);
+	// Grows the ring to hold span consecutive seqnums
+	void grow(u32 span);
+	void rebuildHeaps();
+
+	Slot *m_slots;
+	u32 m_capacity;
+	u32 m_count;
+	// Smallest and largest buffered seqnum, if m_count != 0
+	u16 m_first;
+	u16 m_last;
+	// Sum of the times passed to incrementTimeouts()
+	double m_time;
+	// Entries are current if they match sent_at or buffered_at
+	PacketTimeHeap m_sent_heap;
+	PacketTimeHeap m_buffered_heap;
 };
 
 /*
-	A buffer for reconstructing split packets
+	A buffer for reconstructing split packets.
+
+	The packets are kept in a ring indexed by seqnum that is grown if
+	two of them fall in the same slot, up to SPLIT_BUFFER_MAX_SIZE.
+	Unreliable packets are timed out through a heap of their adding
+	times.
 */
 
 class IncomingSplitBuffer
 {
 public:
+	IncomingSplitBuffer();
 	~IncomingSplitBuffer();
 	/*
 		Returns a reference counted buffer of length != 0 when a full split
@@ -309,8 +435,26 @@ class IncomingSplitBuffer
 	void removeUnreliableTimedOuts(float dtime, float timeout);
 	
 private:
-	// Key is seqnum
-	core::map<u16, IncomingSplitPacket*> m_buf;
+	// Not copyable
+	IncomingSplitBuffer(const IncomingSplitBuffer &);
+	IncomingSplitBuffer & operator=(const IncomingSplitBuffer &);
+
+	IncomingSplitPacket * & slot(u16 seqnum)
+	{
+		return m_slots[seqnum & (m_capacity - 1)];
+	}
+	// Returns NULL if not found
+	IncomingSplitPacket * find(u16 seqnum);
+	// Removes and deletes a packet
+	void remove(u16 seqnum);
+	void grow();
+
+	IncomingSplitPacket **m_slots;
+	u32 m_capacity;
+	// Sum of the times passed to removeUnreliableTimedOuts()
+	double m_time;
+	// Adding times of the unreliable packets
+	PacketTimeHeap m_timeout_heap;
 };
 
 class Connection;
@@ -332,6 +476,15 @@ struct Channel
 	ReliablePacketBuffer outgoing_reliables;
 
 	IncomingSplitBuffer incoming_splits;
+
+	// True if outgoing_reliables can't take the next reliable packet
+	bool outgoingWindowFull()
+	{
+		return (outgoing_reliables.empty() == false
+				&& (u16)(next_outgoing_seqnum
+				- outgoing_reliables.getFirstSeqnum())
+				>= RELIABLE_BUFFER_MAX_SIZE);
+	}
 };
 
 class Peer;
@@ -372,6 +525,19 @@ class Peer
 	*/
 	void reportRTT(float rtt);
 
+	/*
+		Congestion control (AIMD). The window is the number of reliable
+		packets allowed in flight. It grows by one for each acked
+		packet until the slow start threshold and by one per window
+		after that, and is halved when packets have to be resent.
+	*/
+	void reportAck();
+	// Called when timed out reliables are resent
+	void reportLoss(u32 resent_count);
+	u32 getReliablesInFlight();
+
+	void PrintInfo(std::ostream &out);
+
 	Channel channels[CHANNEL_COUNT];
 
 	// Address of the peer
@@ -390,12 +556,24 @@ class Peer
 	// with the id we have given to it
 	bool has_sent_with_id;
 	
+	float congestion_window;
+	float slow_start_threshold;
+	// Seconds from the last decrease of the window
+	float time_from_loss;
+	
+	// Statistics
+	u32 acked_count;
+	u32 resent_count;
+	u32 loss_count;
+
+	// Pacing; m_max_packets_per_second follows the window
 	float m_sendtime_accu;
 	float m_max_packets_per_second;
 	int m_num_sent;
 	int m_max_num_sent;
 	
 private:
+	void updatePacingRate();
 };
 
 /*
@@ -558,6 +736,8 @@ class Connection: public SimpleThread
 	u16 GetPeerID(){ return m_peer_id; }
 	Address GetPeerAddress(u16 peer_id);
 	float GetPeerAvgRTT(u16 peer_id);
+	// Prints the congestion control state and statistics of a peer
+	void PrintPeerInfo(u16 peer_id, std::ostream &out);
 	void DeletePeer(u16 peer_id);
 	
 private:
@@ -565,6 +745,11 @@ class Connection: public SimpleThread
 	void processCommand(ConnectionCommand &c);
 	void send(float dtime);
 	void receive();
+	// Processes one datagram received from the socket
+	void receiveDatagram(Address sender, u8 *packetdata,
+			s32 received_size);
+	// Passes on the data that has become available in the buffers
+	void receiveFromBuffers();
 	void runTimeouts(float dtime);
 	void serve(u16 port);
 	void connect(Address address);
@@ -575,7 +760,10 @@ class Connection: public SimpleThread
 			SharedBuffer<u8> data, bool reliable);
 	void rawSendAsPacket(u16 peer_id, u8 channelnum,
 			SharedBuffer<u8> data, bool reliable);
+	// Queues the packet to be sent by the next flushSends()
 	void rawSend(const BufferedPacket &packet);
+	// Sends the queued packets to the socket in one batch
+	void flushSends();
 	Peer* getPeer(u16 peer_id);
 	Peer* getPeerNoEx(u16 peer_id);
 	core::list<Peer*> getPeers();
@@ -607,6 +795,14 @@ class Connection: public SimpleThread
 	float m_timeout;
 	UDPSocket m_socket;
 	u16 m_peer_id;
+
+	// Packets waiting for flushSends(); the capacity is kept between
+	// batches
+	std::vector<BufferedPacket> m_send_batch;
+	// CONNECTION_BATCH_SIZE buffers for receiving datagrams,
+	// allocated once for the lifetime of the connection
+	u32 m_receive_buffer_size;
+	u8 *m_receive_buffers;
 	
 	core::map<u16, Peer*> m_peers;
 	JMutex m_peers_mutex;
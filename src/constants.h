@@ -42,6 +42,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // resend_timeout = avg_rtt * this
 #define RESEND_TIMEOUT_FACTOR 4
 
+// Congestion window of a peer, in reliable packets in flight
+#define CONGESTION_WINDOW_INITIAL 16
+#define CONGESTION_WINDOW_MIN 4
+#define CONGESTION_WINDOW_MAX 1024
+// Packets are paced at congestion_window / avg_rtt * this
+#define PACING_GAIN 1.5
+
 #define PI 3.14159
 
 // The absolute working limit is (2^15 - viewing_range).
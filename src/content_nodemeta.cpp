@@ -125,6 +125,7 @@ class FurnaceNodeMetadata : public NodeMetadata
 	virtual Inventory* getInventory() {return m_inventory;}
 	virtual void inventoryModified();
 	virtual bool step(float dtime);
+	virtual float getStepInterval();
 	virtual bool nodeRemovalDisabled();
 	virtual std::string getInventoryDrawSpecString();
 	
@@ -140,6 +141,9 @@ class FurnaceNodeMetadata : public NodeMetadata
 	float m_fuel_time;
 	float m_src_totaltime;
 	float m_src_time;
+	// false when the last step did nothing; set again when the
+	// inventory is modified
+	bool m_active;
 };
 
 /*
@@ -342,6 +346,7 @@ FurnaceNodeMetadata::FurnaceNodeMetadata(IGameDef *gamedef):
 	m_fuel_time = 0;
 	m_src_totaltime = 0;
 	m_src_time = 0;
+	m_active = true;
 }
 FurnaceNodeMetadata::~FurnaceNodeMetadata()
 {
@@ -436,6 +441,7 @@ bool FurnaceNodeMetadata::nodeRemovalDisabled()
 void FurnaceNodeMetadata::inventoryModified()
 {
 	infostream<<"Furnace inventory modification callback"<<std::endl;
+	m_active = true;
 }
 bool FurnaceNodeMetadata::step(float dtime)
 {
@@ -556,15 +562,24 @@ bool FurnaceNodeMetadata::step(float dtime)
 		if(changed_this_loop)
 		{
 			changed = true;
+			m_active = true;
 		}
 		else
 		{
 			m_step_accumulator = 0;
+			m_active = false;
 			break;
 		}
 	}
 	return changed;
 }
+float FurnaceNodeMetadata::getStepInterval()
+{
+	// Nothing happens until the inventory is modified
+	if(!m_active)
+		return 0;
+	return 2.0;
+}
 std::string FurnaceNodeMetadata::getInventoryDrawSpecString()
 {
 	return
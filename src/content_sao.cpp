@@ -78,9 +78,11 @@ void TestSAO::step(float dtime, bool send_recommended)
 		return;
 	}
 
-	m_base_position.Y += dtime * BS * 2;
-	if(m_base_position.Y > 8*BS)
-		m_base_position.Y = 2*BS;
+	v3f pos = m_base_position;
+	pos.Y += dtime * BS * 2;
+	if(pos.Y > 8*BS)
+		pos.Y = 2*BS;
+	setBasePosition(pos);
 
 	if(send_recommended == false)
 		return;
@@ -1293,7 +1295,7 @@ void MobV2SAO::step(float dtime, bool send_recommended)
 				arrived = true;
 			}
 			pos_f += dir;
-			m_base_position = pos_f;
+			setBasePosition(pos_f);
 
 			if((pos_f - next_pos_f).getLength() < 0.1 || arrived){
 				m_next_pos_exists = false;
@@ -1352,7 +1354,7 @@ void MobV2SAO::step(float dtime, bool send_recommended)
 	}
 	else if(m_move_type == "constant_speed")
 	{
-		m_base_position += m_speed * dtime;
+		setBasePosition(m_base_position + m_speed * dtime);
 		
 		v3s16 pos_i = floatToInt(m_base_position, BS);
 		v3s16 size_blocks = v3s16(m_size.X+0.5,m_size.Y+0.5,m_size.X+0.5);
@@ -1414,7 +1416,7 @@ void MobV2SAO::punch(ServerActiveObject *puncher, float time_from_last_punch)
 		}
 		bool free = checkFreePosition(map, pos_i + pos_size_off, size_blocks);
 		if(free)
-			m_base_position = new_base_position;
+			setBasePosition(new_base_position);
 	}
 	sendPosition();
 	
@@ -1483,7 +1485,7 @@ void MobV2SAO::readProperties()
 	m_speed = m_properties->getV3F("speed");
 	m_age = m_properties->getFloat("age");
 	m_yaw = m_properties->getFloat("yaw");
-	m_base_position = m_properties->getV3F("pos");
+	setBasePosition(m_properties->getV3F("pos"));
 	m_hp = m_properties->getS32("hp");
 	m_die_age = m_properties->getFloat("die_age");
 	m_size = m_properties->getV2F("size");
@@ -1629,8 +1631,8 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 
 		m_velocity += dtime * m_acceleration;
 	} else {
-		m_base_position += dtime * m_velocity + 0.5 * dtime
-				* dtime * m_acceleration;
+		setBasePosition(m_base_position + dtime * m_velocity + 0.5 * dtime
+				* dtime * m_acceleration);
 		m_velocity += dtime * m_acceleration;
 	}
 
@@ -1715,13 +1717,13 @@ void LuaEntitySAO::rightClick(ServerActiveObject *clicker)
 
 void LuaEntitySAO::setPos(v3f pos)
 {
-	m_base_position = pos;
+	setBasePosition(pos);
 	sendPosition(false, true);
 }
 
 void LuaEntitySAO::moveTo(v3f pos, bool continuous)
 {
-	m_base_position = pos;
+	setBasePosition(pos);
 	if(!continuous)
 		sendPosition(true, true);
 }
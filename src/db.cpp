@@ -258,13 +258,20 @@ bool ITable::exec(const std::string& query)
 /* Database */
 
 
-Database::Database(const std::string& file)
+//how long a connection waits for another one holding a lock
+#define DB_BUSY_TIMEOUT_MS 5000
+
+Database::Database(const std::string& file, bool read_only)
 {
 	m_is_new = false;
+	m_read_only = read_only;
+
+	m_mutex.Init();
 
-	int d = sqlite3_open_v2(file.c_str(), &m_database, SQLITE_OPEN_READWRITE, NULL);
+	int flags = read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+	int d = sqlite3_open_v2(file.c_str(), &m_database, flags, NULL);
 	
-	if(d != SQLITE_OK) {
+	if(d != SQLITE_OK && !read_only) {
 		//can't open a file. try to create it.
 		m_is_new = true;
 		d = sqlite3_open_v2(file.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
@@ -275,15 +282,16 @@ Database::Database(const std::string& file)
 		throw FileNotGoodException("Cannot create/open database file");
 	}
 
-	//begin first transaction
-	begin();
+	//other connections to the same file may be writing
+	sqlite3_busy_timeout(m_database, DB_BUSY_TIMEOUT_MS);
 }
 
 Database::~Database()
 {
 	tables.clear(); //finalize all queries to tables
 	
-	commit(); //commit changes
+	if(!m_read_only && !sqlite3_get_autocommit(m_database))
+		commit(); //commit a transaction left open
 
 	if(m_database)
 		sqlite3_close(m_database);
@@ -331,7 +331,9 @@ class Table<Key,void> : protected ITable {
 //database interface
 class Database {
 public:
-	Database(const std::string& file);
+	//if read_only=true, the file must exist and tables can't be created
+	//(used for additional connections reading concurrently with a writer)
+	Database(const std::string& file, bool read_only = false);
 
 	~Database();
 
@@ -379,15 +381,17 @@ class Database {
 	}*/
 
 	//commits a transaction
-	void commit()
+	//returns false on failure
+	bool commit()
 	{
-		sqlite3_exec(m_database,"COMMIT;", NULL, NULL, NULL);
+		return sqlite3_exec(m_database,"COMMIT;", NULL, NULL, NULL) == SQLITE_OK;
 	}
 
-	//begins a transaction
-	void begin()
+	//begins a transaction; without one every statement is committed by itself
+	//returns false on failure (e.g. if a transaction is already open)
+	bool begin()
 	{
-		sqlite3_exec(m_database,"BEGIN;", NULL, NULL, NULL);
+		return sqlite3_exec(m_database,"BEGIN;", NULL, NULL, NULL) == SQLITE_OK;
 	}
 
 	//returns true if database was created from scratch (i.e. no database file existed before)
@@ -396,10 +400,23 @@ class Database {
 		return m_is_new;
 	}
 
+	inline bool isReadOnly() const
+	{
+		return m_read_only;
+	}
+
+	//mutex for serializing access if database is used by more than one thread
+	inline JMutex& getMutex()
+	{
+		return m_mutex;
+	}
+
 private:
 	sqlite3* m_database;
 	std::map<std::string,SharedPtr<ITable> > tables;
 	bool m_is_new;
+	bool m_read_only;
+	JMutex m_mutex;
 };
 
 
@@ -120,7 +120,11 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("time_send_interval", "20");
 	settings->setDefault("time_speed", "96");
 	settings->setDefault("server_unload_unused_data_timeout", "29");
+	settings->setDefault("server_map_memory_budget", "0");
 	settings->setDefault("server_map_save_interval", "5.3");
+	settings->setDefault("server_map_save_queue_size", "1024");
+	settings->setDefault("num_emerge_threads", "2");
+	settings->setDefault("num_abm_threads", "2");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("enable_experimental", "false");
 }
@@ -20,6 +20,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <list>
 #include <map>
+#include <vector>
+#include <jsemaphore.h>
 #include "environment.h"
 #include "filesys.h"
 #include "porting.h"
@@ -39,9 +41,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gamedef.h"
 #include "serverremoteplayer.h"
 #include "db.h"
+#include "noise.h" // PseudoRandom
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+// Number of blocks an ABM scanning thread takes at a time
+#define ABM_SCAN_CHUNK_SIZE 16
+// Time per step for running ABMs in newly activated blocks
+#define ABM_ACTIVATION_TIME_BUDGET_MS 10
+
 Environment::Environment():
 	m_time_of_day(9000)
 {
@@ -224,70 +232,789 @@ ABMWithState::ABMWithState(ActiveBlockModifier *abm_):
 	ActiveBlockList
 */
 
-void fillRadiusBlock(v3s16 p0, s16 r, core::map<v3s16, bool> &list)
+static bool isInRadiusBlock(v3s16 p, v3s16 p0, s16 r)
 {
-	v3s16 p;
-	for(p.X=p0.X-r; p.X<=p0.X+r; p.X++)
-	for(p.Y=p0.Y-r; p.Y<=p0.Y+r; p.Y++)
-	for(p.Z=p0.Z-r; p.Z<=p0.Z+r; p.Z++)
-	{
-		// Set in list
-		list[p] = true;
-	}
+	return (p.X >= p0.X-r && p.X <= p0.X+r
+			&& p.Y >= p0.Y-r && p.Y <= p0.Y+r
+			&& p.Z >= p0.Z-r && p.Z <= p0.Z+r);
 }
 
-void ActiveBlockList::update(core::list<v3s16> &active_positions,
+// A player whose area has changed
+struct ActiveAreaChange
+{
+	bool has_old;
+	v3s16 old_center;
+	bool has_new;
+	v3s16 new_center;
+};
+
+void ActiveBlockList::update(core::map<u16, v3s16> &active_positions,
 		s16 radius,
 		core::map<v3s16, bool> &blocks_removed,
 		core::map<v3s16, bool> &blocks_added)
 {
 	/*
-		Create the new list
+		Find out whose areas have changed
+	*/
+	core::list<ActiveAreaChange> changes;
+	for(core::map<u16, v3s16>::Iterator i = active_positions.getIterator();
+			i.atEnd()==false; i++)
+	{
+		ActiveAreaChange c;
+		c.has_new = true;
+		c.new_center = i.getNode()->getValue();
+		core::map<u16, v3s16>::Node *n = m_centers.find(i.getNode()->getKey());
+		c.has_old = (n != NULL);
+		if(c.has_old)
+		{
+			c.old_center = n->getValue();
+			if(c.old_center == c.new_center && radius == m_radius)
+				continue;
+		}
+		changes.push_back(c);
+	}
+	for(core::map<u16, v3s16>::Iterator i = m_centers.getIterator();
+			i.atEnd()==false; i++)
+	{
+		if(active_positions.find(i.getNode()->getKey()) != NULL)
+			continue;
+		ActiveAreaChange c;
+		c.has_old = true;
+		c.old_center = i.getNode()->getValue();
+		c.has_new = false;
+		changes.push_back(c);
+	}
+
+	/*
+		Add the blocks that came into the areas first, so that blocks
+		that move from one player to another stay active
 	*/
-	core::map<v3s16, bool> newlist;
-	for(core::list<v3s16>::Iterator i = active_positions.begin();
-			i != active_positions.end(); i++)
+	for(core::list<ActiveAreaChange>::Iterator i = changes.begin();
+			i != changes.end(); i++)
 	{
-		fillRadiusBlock(*i, radius, newlist);
+		if(i->has_new == false)
+			continue;
+		v3s16 p0 = i->new_center;
+		v3s16 p;
+		for(p.X=p0.X-radius; p.X<=p0.X+radius; p.X++)
+		for(p.Y=p0.Y-radius; p.Y<=p0.Y+radius; p.Y++)
+		for(p.Z=p0.Z-radius; p.Z<=p0.Z+radius; p.Z++)
+		{
+			if(i->has_old && isInRadiusBlock(p, i->old_center, m_radius))
+				continue;
+			addRef(p, blocks_added);
+		}
 	}
 
 	/*
-		Find out which blocks on the old list are not on the new list
+		Remove the blocks that left the areas
 	*/
-	// Go through old list
-	for(core::map<v3s16, bool>::Iterator i = m_list.getIterator();
+	for(core::list<ActiveAreaChange>::Iterator i = changes.begin();
+			i != changes.end(); i++)
+	{
+		if(i->has_old == false)
+			continue;
+		v3s16 p0 = i->old_center;
+		v3s16 p;
+		for(p.X=p0.X-m_radius; p.X<=p0.X+m_radius; p.X++)
+		for(p.Y=p0.Y-m_radius; p.Y<=p0.Y+m_radius; p.Y++)
+		for(p.Z=p0.Z-m_radius; p.Z<=p0.Z+m_radius; p.Z++)
+		{
+			if(i->has_new && isInRadiusBlock(p, i->new_center, radius))
+				continue;
+			removeRef(p, blocks_removed);
+		}
+	}
+
+	/*
+		Retry the blocks that were not loaded last time
+	*/
+	for(core::list<v3s16>::Iterator i = m_not_loaded.begin();
+			i != m_not_loaded.end(); i++)
+	{
+		v3s16 p = *i;
+		if(m_refs.find(p) == NULL || m_list.find(p) != NULL)
+			continue;
+		m_list.insert(p, true);
+		blocks_added.insert(p, true);
+	}
+	m_not_loaded.clear();
+
+	/*
+		Remember the positions
+	*/
+	m_centers.clear();
+	for(core::map<u16, v3s16>::Iterator i = active_positions.getIterator();
 			i.atEnd()==false; i++)
 	{
-		v3s16 p = i.getNode()->getKey();
-		// If not on new list, it's been removed
-		if(newlist.find(p) == NULL)
-			blocks_removed.insert(p, true);
+		m_centers.insert(i.getNode()->getKey(), i.getNode()->getValue());
+	}
+	m_radius = radius;
+}
+
+void ActiveBlockList::setNotLoaded(v3s16 p)
+{
+	if(m_list.remove(p))
+		m_not_loaded.push_back(p);
+}
+
+void ActiveBlockList::addRef(v3s16 p, core::map<v3s16, bool> &blocks_added)
+{
+	u16 *refs = m_refs.find(p);
+	if(refs != NULL)
+	{
+		(*refs)++;
+		return;
+	}
+	m_refs.set(p, 1);
+	m_list.insert(p, true);
+	blocks_added.insert(p, true);
+}
+
+void ActiveBlockList::removeRef(v3s16 p,
+		core::map<v3s16, bool> &blocks_removed)
+{
+	u16 *refs = m_refs.find(p);
+	assert(refs);
+	(*refs)--;
+	if(*refs != 0)
+		return;
+	m_refs.remove(p);
+	if(m_list.remove(p))
+		blocks_removed.insert(p, true);
+}
+
+/*
+	ActiveObjectIndex
+*/
+
+/*
+	Block position of a point. The point is limited to the map first, so
+	far away positions don't overflow s16.
+*/
+static v3s16 getLimitedBlockPos(v3f pos)
+{
+	const f32 limit = MAP_GENERATION_LIMIT * BS;
+	pos.X = rangelim(pos.X, -limit, limit);
+	pos.Y = rangelim(pos.Y, -limit, limit);
+	pos.Z = rangelim(pos.Z, -limit, limit);
+	return getNodeBlockPos(floatToInt(pos, BS));
+}
+
+static v3s16 getObjectBlockPos(ServerActiveObject *obj)
+{
+	return getLimitedBlockPos(obj->getBasePosition());
+}
+
+ActiveObjectIndex::ActiveObjectIndex()
+{
+}
+
+ActiveObjectIndex::~ActiveObjectIndex()
+{
+	for(u32 i=0; i<m_buckets.capacity(); i++)
+	{
+		if(m_buckets.used(i))
+			delete m_buckets.valueAt(i);
+	}
+}
+
+void ActiveObjectIndex::insert(ServerActiveObject *obj)
+{
+	assert(obj->m_indexed == false);
+	v3s16 blockpos = getObjectBlockPos(obj);
+	addToBucket(obj, blockpos);
+	obj->m_indexed = true;
+	obj->m_index_block = blockpos;
+	obj->m_index_unlimited = obj->unlimitedTransferDistance();
+	if(obj->m_index_unlimited)
+		m_unlimited.push_back(obj);
+}
+
+void ActiveObjectIndex::remove(ServerActiveObject *obj)
+{
+	if(obj->m_indexed == false)
+		return;
+	removeFromBucket(obj, obj->m_index_block);
+	if(obj->m_index_unlimited)
+	{
+		s32 i = m_unlimited.linear_search(obj);
+		if(i != -1)
+			m_unlimited.erase(i);
+	}
+	obj->m_indexed = false;
+	obj->m_index_unlimited = false;
+}
+
+void ActiveObjectIndex::update(ServerActiveObject *obj)
+{
+	if(obj->m_indexed == false)
+		return;
+	v3s16 blockpos = getObjectBlockPos(obj);
+	if(blockpos == obj->m_index_block)
+		return;
+	removeFromBucket(obj, obj->m_index_block);
+	addToBucket(obj, blockpos);
+	obj->m_index_block = blockpos;
+}
+
+void ActiveObjectIndex::getInArea(v3s16 minp, v3s16 maxp,
+		core::array<ServerActiveObject*> &dst)
+{
+	if(minp.X > maxp.X || minp.Y > maxp.Y || minp.Z > maxp.Z)
+		return;
+	// Doesn't fit in 32 bits for areas as large as the map
+	u64 volume = (u64)(maxp.X - minp.X + 1) * (maxp.Y - minp.Y + 1)
+			* (maxp.Z - minp.Z + 1);
+	/*
+		If the area is large compared to the number of occupied blocks,
+		go through the occupied blocks instead
+	*/
+	if(volume > m_buckets.size())
+	{
+		for(u32 i=0; i<m_buckets.capacity(); i++)
+		{
+			if(m_buckets.used(i) == false)
+				continue;
+			v3s16 p = m_buckets.posAt(i);
+			if(p.X < minp.X || p.X > maxp.X
+					|| p.Y < minp.Y || p.Y > maxp.Y
+					|| p.Z < minp.Z || p.Z > maxp.Z)
+				continue;
+			Bucket *bucket = m_buckets.valueAt(i);
+			for(u32 j=0; j<bucket->size(); j++)
+				dst.push_back((*bucket)[j]);
+		}
+		return;
+	}
+
+	v3s16 p;
+	for(p.X=minp.X; p.X<=maxp.X; p.X++)
+	for(p.Y=minp.Y; p.Y<=maxp.Y; p.Y++)
+	for(p.Z=minp.Z; p.Z<=maxp.Z; p.Z++)
+	{
+		Bucket **bucket = m_buckets.find(p);
+		if(bucket == NULL)
+			continue;
+		for(u32 j=0; j<(*bucket)->size(); j++)
+			dst.push_back((**bucket)[j]);
+	}
+}
+
+void ActiveObjectIndex::addToBucket(ServerActiveObject *obj, v3s16 blockpos)
+{
+	Bucket **bucket = m_buckets.find(blockpos);
+	if(bucket == NULL)
+	{
+		Bucket *b = new Bucket;
+		b->push_back(obj);
+		m_buckets.set(blockpos, b);
+		return;
+	}
+	(*bucket)->push_back(obj);
+}
+
+void ActiveObjectIndex::removeFromBucket(ServerActiveObject *obj,
+		v3s16 blockpos)
+{
+	Bucket **bucket = m_buckets.find(blockpos);
+	assert(bucket);
+	Bucket *b = *bucket;
+	s32 i = b->linear_search(obj);
+	assert(i != -1);
+	// Order doesn't matter; move the last one in its place
+	(*b)[i] = (*b)[b->size()-1];
+	b->erase(b->size()-1);
+	if(b->size() == 0)
+	{
+		delete b;
+		m_buckets.remove(blockpos);
+	}
+}
+
+/*
+	ActiveObjectIdPool
+*/
+
+ActiveObjectIdPool::ActiveObjectIdPool():
+	m_used_count(0),
+	m_next(1)
+{
+	memset(m_used, 0, sizeof(m_used));
+	// 0 is not a valid id
+	use(0);
+}
+
+u16 ActiveObjectIdPool::allocate()
+{
+	if(m_used_count == 65536)
+		return 0;
+	// There is a free id, so this ends
+	u16 id = m_next;
+	for(;;)
+	{
+		u32 word = m_used[id >> 5];
+		// Skip full words at once
+		if(word == 0xffffffff)
+		{
+			id = ((id >> 5) + 1) << 5;
+			continue;
+		}
+		if((word & ((u32)1 << (id & 31))) == 0)
+			break;
+		id++;
+	}
+	use(id);
+	m_next = id + 1;
+	return id;
+}
+
+void ActiveObjectIdPool::use(u16 id)
+{
+	assert(isFree(id));
+	m_used[id >> 5] |= (u32)1 << (id & 31);
+	m_used_count++;
+}
+
+void ActiveObjectIdPool::release(u16 id)
+{
+	if(id == 0 || isFree(id))
+		return;
+	m_used[id >> 5] &= ~((u32)1 << (id & 31));
+	m_used_count--;
+}
+
+struct ActiveABM
+{
+	ActiveBlockModifier *abm;
+	int chance;
+	std::set<content_t> required_neighbors;
+};
+
+/*
+	A node that triggers an ABM, found by ABMHandler::scan()
+*/
+struct ABMTrigger
+{
+	ActiveABM *aabm;
+	v3s16 p;
+	// Content when scanned
+	content_t content;
+};
+
+// Per-thread state of ABMHandler::scan()
+struct ABMScanner
+{
+	PseudoRandom random;
+	// Node indices found by MapBlock::findNodesWithContent()
+	u16 candidates[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	std::vector<ABMTrigger> triggers;
+};
+
+/*
+	A block and the 26 blocks around it, looked up once so that the
+	nodes and objects next to a block can be read without going through
+	the map for each of them.
+*/
+class BlockNeighborhood
+{
+public:
+	BlockNeighborhood(Map *map, MapBlock *block):
+		m_map(map),
+		m_blockpos(block->getPos()),
+		m_object_count_wider(0),
+		m_object_count_valid(false)
+	{
+		for(s16 z=-1; z<=1; z++)
+		for(s16 y=-1; y<=1; y++)
+		for(s16 x=-1; x<=1; x++)
+			m_blocks[slot(x,y,z)] = map->getBlockNoCreateNoEx(
+					m_blockpos + v3s16(x,y,z));
+	}
+
+	/*
+		p is relative to the center block and may be one node outside
+		of it in each direction
+	*/
+	MapNode getNode(v3s16 p)
+	{
+		s16 x = (p.X < 0) ? -1 : (p.X >= MAP_BLOCKSIZE ? 1 : 0);
+		s16 y = (p.Y < 0) ? -1 : (p.Y >= MAP_BLOCKSIZE ? 1 : 0);
+		s16 z = (p.Z < 0) ? -1 : (p.Z >= MAP_BLOCKSIZE ? 1 : 0);
+		MapBlock *block = getBlock(x, y, z);
+		if(block == NULL)
+			return MapNode(CONTENT_IGNORE);
+		return block->getNodeNoEx(p - v3s16(x,y,z) * MAP_BLOCKSIZE);
+	}
+
+	// Number of objects in the 27 blocks
+	u32 getObjectCountWider()
+	{
+		if(m_object_count_valid)
+			return m_object_count_wider;
+		m_object_count_wider = 0;
+		for(s16 z=-1; z<=1; z++)
+		for(s16 y=-1; y<=1; y++)
+		for(s16 x=-1; x<=1; x++)
+		{
+			MapBlock *block = getBlock(x, y, z);
+			if(block == NULL)
+				continue;
+			m_object_count_wider +=
+					block->m_static_objects.m_active.size()
+					+ block->m_static_objects.m_stored.size();
+		}
+		m_object_count_valid = true;
+		return m_object_count_wider;
+	}
+
+	// Call when objects may have been added or removed
+	void invalidateObjectCount()
+	{
+		m_object_count_valid = false;
+	}
+
+private:
+	static u32 slot(s16 x, s16 y, s16 z)
+	{
+		return (z+1)*9 + (y+1)*3 + (x+1);
+	}
+
+	MapBlock * getBlock(s16 x, s16 y, s16 z)
+	{
+		MapBlock *&block = m_blocks[slot(x,y,z)];
+		// Missing blocks may have been loaded by a trigger
+		if(block == NULL)
+			block = m_map->getBlockNoCreateNoEx(m_blockpos + v3s16(x,y,z));
+		return block;
+	}
+
+	Map *m_map;
+	v3s16 m_blockpos;
+	MapBlock *m_blocks[27];
+	u32 m_object_count_wider;
+	bool m_object_count_valid;
+};
+
+class ABMHandler
+{
+private:
+	ServerEnvironment *m_env;
+	std::map<content_t, std::list<ActiveABM> > m_aabms;
+	// Contents that have ABMs in m_aabms
+	u32 m_trigger_bits[CONTENT_BITMAP_WORDS];
+	// Used by apply()
+	ABMScanner m_scanner;
+public:
+	ABMHandler(core::list<ABMWithState> &abms,
+			float dtime_s, ServerEnvironment *env,
+			bool use_timers):
+		m_env(env)
+	{
+		memset(m_trigger_bits, 0, sizeof(m_trigger_bits));
+		m_scanner.random.seed(myrand());
+		if(dtime_s < 0.001)
+			return;
+		INodeDefManager *ndef = env->getGameDef()->ndef();
+		for(core::list<ABMWithState>::Iterator
+				i = abms.begin(); i != abms.end(); i++){
+			ActiveBlockModifier *abm = i->abm;
+			float trigger_interval = abm->getTriggerInterval();
+			if(trigger_interval < 0.001)
+				trigger_interval = 0.001;
+			float actual_interval = dtime_s;
+			if(use_timers){
+				i->timer += dtime_s;
+				if(i->timer < trigger_interval)
+					continue;
+				i->timer -= trigger_interval;
+				actual_interval = trigger_interval;
+			}
+			ActiveABM aabm;
+			aabm.abm = abm;
+			float intervals = actual_interval / trigger_interval;
+			float chance = abm->getTriggerChance();
+			if(chance == 0)
+				chance = 1;
+			aabm.chance = 1.0 / pow((float)1.0/chance, (float)intervals);
+			if(aabm.chance == 0)
+				aabm.chance = 1;
+			// Trigger neighbors
+			std::set<std::string> required_neighbors_s
+					= abm->getRequiredNeighbors();
+			for(std::set<std::string>::iterator
+					i = required_neighbors_s.begin();
+					i != required_neighbors_s.end(); i++){
+				content_t c = ndef->getId(*i);
+				if(c == CONTENT_IGNORE)
+					continue;
+				aabm.required_neighbors.insert(c);
+			}
+			// Trigger contents
+			std::set<std::string> contents_s = abm->getTriggerContents();
+			for(std::set<std::string>::iterator
+					i = contents_s.begin(); i != contents_s.end(); i++){
+				content_t c = ndef->getId(*i);
+				if(c == CONTENT_IGNORE)
+					continue;
+				std::map<content_t, std::list<ActiveABM> >::iterator j;
+				j = m_aabms.find(c);
+				if(j == m_aabms.end()){
+					std::list<ActiveABM> aabmlist;
+					m_aabms[c] = aabmlist;
+					j = m_aabms.find(c);
+				}
+				j->second.push_back(aabm);
+				contentBitmapSet(m_trigger_bits, c);
+			}
+		}
+	}
+
+	bool empty()
+	{
+		return m_aabms.empty();
+	}
+
+	/*
+		Finds the nodes of the block that trigger an ABM this time:
+		matching content, won the chance roll and have a required
+		neighbor. Appends them to scanner.triggers.
+
+		This only reads the map, so several threads can scan different
+		blocks at the same time, as long as nothing modifies the map.
+	*/
+	void scan(MapBlock *block, ABMScanner &scanner)
+	{
+		if(m_aabms.empty())
+			return;
+
+		// Most blocks contain none of the trigger contents
+		u32 candidate_count = block->findNodesWithContent(
+				m_trigger_bits, scanner.candidates);
+		if(candidate_count == 0)
+			return;
+
+		BlockNeighborhood neighborhood(&m_env->getServerMap(), block);
+
+		for(u32 ci=0; ci<candidate_count; ci++)
+		{
+			u32 index = scanner.candidates[ci];
+			v3s16 p0(index % MAP_BLOCKSIZE,
+					(index / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+					index / (MAP_BLOCKSIZE*MAP_BLOCKSIZE));
+			MapNode n = block->getNodeNoEx(p0);
+			content_t c = n.getContent();
+
+			std::map<content_t, std::list<ActiveABM> >::iterator j;
+			j = m_aabms.find(c);
+			if(j == m_aabms.end())
+				continue;
+
+			for(std::list<ActiveABM>::iterator
+					i = j->second.begin(); i != j->second.end(); i++)
+			{
+				if(scanner.random.next() % i->chance != 0)
+					continue;
+
+				// Check neighbors
+				if(!i->required_neighbors.empty())
+				{
+					v3s16 p1;
+					for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
+					for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
+					for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
+					{
+						if(p1 == p0)
+							continue;
+						MapNode n = neighborhood.getNode(p1);
+						content_t c = n.getContent();
+						std::set<content_t>::const_iterator k;
+						k = i->required_neighbors.find(c);
+						if(k != i->required_neighbors.end()){
+							goto neighbor_found;
+						}
+					}
+					// No required neighbor found
+					continue;
+				}
+neighbor_found:
+
+				ABMTrigger t;
+				t.aabm = &(*i);
+				t.p = p0 + block->getPosRelative();
+				t.content = c;
+				scanner.triggers.push_back(t);
+			}
+		}
+	}
+
+	/*
+		Runs the triggers found by scan(), in the server thread.
+		Triggers of the same block must be consecutive.
+	*/
+	void applyTriggers(const std::vector<ABMTrigger> &triggers)
+	{
+		ServerMap *map = &m_env->getServerMap();
+		MapBlock *block = NULL;
+		BlockNeighborhood *neighborhood = NULL;
+
+		for(std::vector<ABMTrigger>::const_iterator
+				i = triggers.begin(); i != triggers.end(); i++)
+		{
+			v3s16 blockpos = getNodeBlockPos(i->p);
+			if(block == NULL || block->getPos() != blockpos)
+			{
+				delete neighborhood;
+				neighborhood = NULL;
+				block = map->getBlockNoCreateNoEx(blockpos);
+				if(block == NULL)
+					continue;
+				neighborhood = new BlockNeighborhood(map, block);
+			}
+
+			// An earlier trigger may have changed the node
+			MapNode n = block->getNodeNoEx(i->p - block->getPosRelative());
+			if(n.getContent() != i->content)
+				continue;
+
+			// Find out how many objects the block contains
+			u32 active_object_count = block->m_static_objects.m_active.size();
+			// Find out how many objects this and all the neighbors contain
+			u32 active_object_count_wider =
+					neighborhood->getObjectCountWider();
+
+			// Call all the trigger variations
+			ActiveBlockModifier *abm = i->aabm->abm;
+			abm->trigger(m_env, i->p, n);
+			abm->trigger(m_env, i->p, n,
+					active_object_count, active_object_count_wider);
+
+			// The trigger may have added objects
+			neighborhood->invalidateObjectCount();
+		}
+
+		delete neighborhood;
+	}
+
+	// Scans and applies a single block in the calling thread
+	void apply(MapBlock *block)
+	{
+		m_scanner.triggers.clear();
+		scan(block, m_scanner);
+		applyTriggers(m_scanner.triggers);
+	}
+};
+
+/*
+	Shares the active blocks of one ABM step between the scanning threads
+*/
+class ABMScanJob
+{
+public:
+	ABMScanJob(ABMHandler *handler, core::array<MapBlock*> &blocks):
+		m_handler(handler),
+		m_blocks(blocks),
+		m_next(0)
+	{
+		m_mutex.Init();
+	}
+
+	// Scans blocks until there are none left
+	void run(ABMScanner &scanner)
+	{
+		for(;;)
+		{
+			u32 first;
+			{
+				JMutexAutoLock lock(m_mutex);
+				first = m_next;
+				m_next += ABM_SCAN_CHUNK_SIZE;
+			}
+			if(first >= m_blocks.size())
+				break;
+			u32 last = first + ABM_SCAN_CHUNK_SIZE;
+			if(last > m_blocks.size())
+				last = m_blocks.size();
+			for(u32 i=first; i<last; i++)
+				m_handler->scan(m_blocks[i], scanner);
+		}
+	}
+
+private:
+	ABMHandler *m_handler;
+	core::array<MapBlock*> &m_blocks;
+	JMutex m_mutex;
+	u32 m_next;
+};
+
+/*
+	Helps the server thread in scanning blocks for ABM triggers.
+	Sleeps until it is given a job by startJob().
+*/
+class ABMScanThread : public SimpleThread
+{
+public:
+	ABMScanThread():
+		SimpleThread(),
+		m_job(NULL)
+	{
+	}
+
+	~ABMScanThread()
+	{
+		setRun(false);
+		m_job_available.Post();
+		stop();
+	}
+
+	// Call waitJob() before giving the next job
+	void startJob(ABMScanJob *job)
+	{
+		m_job = job;
+		scanner.triggers.clear();
+		scanner.random.seed(myrand());
+		m_job_available.Post();
+	}
+
+	// Waits until the job has been finished
+	void waitJob()
+	{
+		m_job_done.Wait();
+	}
+
+	void * Thread()
+	{
+		ThreadStarted();
+
+		log_register_thread("ABMScanThread");
+
+		DSTACK(__FUNCTION_NAME);
+
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		for(;;)
+		{
+			m_job_available.Wait();
+			if(getRun() == false)
+				break;
+			m_job->run(scanner);
+			m_job_done.Post();
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+		log_deregister_thread();
+
+		return NULL;
 	}
 
-	/*
-		Find out which blocks on the new list are not on the old list
-	*/
-	// Go through new list
-	for(core::map<v3s16, bool>::Iterator i = newlist.getIterator();
-			i.atEnd()==false; i++)
-	{
-		v3s16 p = i.getNode()->getKey();
-		// If not on old list, it's been added
-		if(m_list.find(p) == NULL)
-			blocks_added.insert(p, true);
-	}
+	ABMScanner scanner;
 
-	/*
-		Update m_list
-	*/
-	m_list.clear();
-	for(core::map<v3s16, bool>::Iterator i = newlist.getIterator();
-			i.atEnd()==false; i++)
-	{
-		v3s16 p = i.getNode()->getKey();
-		m_list.insert(p, true);
-	}
-}
+private:
+	ABMScanJob *m_job;
+	JSemaphore m_job_available;
+	JSemaphore m_job_done;
+};
 
 /*
 	ServerEnvironment
@@ -308,6 +1035,14 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, lua_State *L,
 	m_meta_db( m_database->getTable<std::string>("meta") ),
 	m_players_meta( m_database->getTable<std::string>("players_meta") )
 {
+	// Threads helping in scanning for ABMs; they wait for jobs
+	u16 thread_count = g_settings->getU16("num_abm_threads");
+	for(u16 i=0; i<thread_count; i++)
+	{
+		ABMScanThread *thread = new ABMScanThread();
+		thread->Start();
+		m_abm_scan_threads.push_back(thread);
+	}
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -328,6 +1063,10 @@ ServerEnvironment::~ServerEnvironment()
 		delete i->abm;
 	}
 
+	// Stop the idle scanning threads
+	for(u32 i=0; i<m_abm_scan_threads.size(); i++)
+		delete m_abm_scan_threads[i];
+
 	delete m_database;
 }
 
@@ -568,155 +1307,6 @@ void ServerEnvironment::loadMeta(const std::string& savedir)
 	}
 }
 
-struct ActiveABM
-{
-	ActiveBlockModifier *abm;
-	int chance;
-	std::set<content_t> required_neighbors;
-};
-
-class ABMHandler
-{
-private:
-	ServerEnvironment *m_env;
-	std::map<content_t, std::list<ActiveABM> > m_aabms;
-public:
-	ABMHandler(core::list<ABMWithState> &abms,
-			float dtime_s, ServerEnvironment *env,
-			bool use_timers):
-		m_env(env)
-	{
-		if(dtime_s < 0.001)
-			return;
-		INodeDefManager *ndef = env->getGameDef()->ndef();
-		for(core::list<ABMWithState>::Iterator
-				i = abms.begin(); i != abms.end(); i++){
-			ActiveBlockModifier *abm = i->abm;
-			float trigger_interval = abm->getTriggerInterval();
-			if(trigger_interval < 0.001)
-				trigger_interval = 0.001;
-			float actual_interval = dtime_s;
-			if(use_timers){
-				i->timer += dtime_s;
-				if(i->timer < trigger_interval)
-					continue;
-				i->timer -= trigger_interval;
-				actual_interval = trigger_interval;
-			}
-			ActiveABM aabm;
-			aabm.abm = abm;
-			float intervals = actual_interval / trigger_interval;
-			float chance = abm->getTriggerChance();
-			if(chance == 0)
-				chance = 1;
-			aabm.chance = 1.0 / pow((float)1.0/chance, (float)intervals);
-			if(aabm.chance == 0)
-				aabm.chance = 1;
-			// Trigger neighbors
-			std::set<std::string> required_neighbors_s
-					= abm->getRequiredNeighbors();
-			for(std::set<std::string>::iterator
-					i = required_neighbors_s.begin();
-					i != required_neighbors_s.end(); i++){
-				content_t c = ndef->getId(*i);
-				if(c == CONTENT_IGNORE)
-					continue;
-				aabm.required_neighbors.insert(c);
-			}
-			// Trigger contents
-			std::set<std::string> contents_s = abm->getTriggerContents();
-			for(std::set<std::string>::iterator
-					i = contents_s.begin(); i != contents_s.end(); i++){
-				content_t c = ndef->getId(*i);
-				if(c == CONTENT_IGNORE)
-					continue;
-				std::map<content_t, std::list<ActiveABM> >::iterator j;
-				j = m_aabms.find(c);
-				if(j == m_aabms.end()){
-					std::list<ActiveABM> aabmlist;
-					m_aabms[c] = aabmlist;
-					j = m_aabms.find(c);
-				}
-				j->second.push_back(aabm);
-			}
-		}
-	}
-	void apply(MapBlock *block)
-	{
-		if(m_aabms.empty())
-			return;
-
-		ServerMap *map = &m_env->getServerMap();
-
-		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-		{
-			MapNode n = block->getNodeNoEx(p0);
-			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
-
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
-				continue;
-
-			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
-			{
-				if(myrand() % i->chance != 0)
-					continue;
-
-				// Check neighbors
-				if(!i->required_neighbors.empty())
-				{
-					v3s16 p1;
-					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
-					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
-					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
-					{
-						if(p1 == p)
-							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
-							goto neighbor_found;
-						}
-					}
-					// No required neighbor found
-					continue;
-				}
-neighbor_found:
-
-				// Find out how many objects the block contains
-				u32 active_object_count = block->m_static_objects.m_active.size();
-				// Find out how many objects this and all the neighbors contain
-				u32 active_object_count_wider = 0;
-				for(s16 x=-1; x<=1; x++)
-				for(s16 y=-1; y<=1; y++)
-				for(s16 z=-1; z<=1; z++)
-				{
-					MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block->getPos() + v3s16(x,y,z));
-					if(block2==NULL)
-						continue;
-					active_object_count_wider +=
-							block2->m_static_objects.m_active.size()
-							+ block2->m_static_objects.m_stored.size();
-				}
-
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
-			}
-		}
-	}
-};
-
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
 	// Get time difference
@@ -738,22 +1328,31 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	// Activate stored objects
 	activateObjects(block);
 
-	// Run node metadata
-	bool changed = block->m_node_metadata->step((float)dtime_s);
-	if(changed)
-	{
-		MapEditEvent event;
-		event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
-		event.p = block->getPos();
-		m_map->dispatchEvent(&event);
+	// Run node timers
+	runNodeTimers(block, (float)dtime_s);
 
-		block->raiseModified(MOD_STATE_WRITE_NEEDED,
-				"node metadata modified in activateBlock");
+	/*
+		Queue handling ActiveBlockModifiers; scanning the whole block
+		here would make ticks long when many blocks are activated at
+		once, like when a player teleports
+	*/
+	if(dtime_s != 0)
+	{
+		v3s16 p = block->getPos();
+		core::map<v3s16, u32>::Node *n =
+				m_pending_activation_dtimes.find(p);
+		if(n != NULL)
+		{
+			// Activated again before being handled; handle the
+			// inactive times of both activations at once
+			n->setValue(n->getValue() + dtime_s);
+		}
+		else
+		{
+			m_pending_activation_dtimes.insert(p, dtime_s);
+			m_pending_activations.push_back(p);
+		}
 	}
-
-	/* Handle ActiveBlockModifiers */
-	ABMHandler abmhandler(m_abms, dtime_s, this, false);
-	abmhandler.apply(block);
 }
 
 void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
@@ -764,16 +1363,19 @@ void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
 std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 {
 	std::set<u16> objects;
-	for(core::map<u16, ServerActiveObject*>::Iterator
-			i = m_active_objects.getIterator();
-			i.atEnd()==false; i++)
+	v3f radius_v(radius, radius, radius);
+	core::array<ServerActiveObject*> nearby;
+	m_object_index.getInArea(
+			getLimitedBlockPos(pos - radius_v),
+			getLimitedBlockPos(pos + radius_v),
+			nearby);
+	for(u32 i=0; i<nearby.size(); i++)
 	{
-		ServerActiveObject* obj = i.getNode()->getValue();
-		u16 id = i.getNode()->getKey();
+		ServerActiveObject* obj = nearby[i];
 		v3f objectpos = obj->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
-		objects.insert(id);
+		objects.insert(obj->getId());
 	}
 	return objects;
 }
@@ -813,6 +1415,8 @@ void ServerEnvironment::clearAllObjects()
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
 		scriptapi_rm_object_reference(m_lua, obj);
+		// Remove from the object index
+		m_object_index.remove(obj);
 
 		// Delete active object
 		if(obj->environmentDeletes())
@@ -825,6 +1429,7 @@ void ServerEnvironment::clearAllObjects()
 			i != objects_to_remove.end(); i++)
 	{
 		m_active_objects.remove(*i);
+		m_object_ids.release(*i);
 	}
 
 	core::list<v3s16> loadable_blocks;
@@ -944,7 +1549,7 @@ void ServerEnvironment::step(float dtime)
 		/*
 			Get player block positions
 		*/
-		core::list<v3s16> players_blockpos;
+		core::map<u16, v3s16> players_blockpos;
 		for(core::list<Player*>::Iterator
 				i = m_players.begin();
 				i != m_players.end(); i++)
@@ -955,7 +1560,7 @@ void ServerEnvironment::step(float dtime)
 				continue;
 			v3s16 blockpos = getNodeBlockPos(
 					floatToInt(player->getPosition(), BS));
-			players_blockpos.push_back(blockpos);
+			players_blockpos.insert(player->peer_id, blockpos);
 		}
 		
 		/*
@@ -989,6 +1594,9 @@ void ServerEnvironment::step(float dtime)
 			
 			// Set current time as timestamp (and let it set ChangedFlag)
 			block->setTimestamp(m_game_time);
+
+			// Nobody is likely to need the serialized block soon
+			block->clearNetworkCache();
 		}
 
 		/*
@@ -1008,7 +1616,7 @@ void ServerEnvironment::step(float dtime)
 			if(block==NULL){
 				// Block needs to be fetched first
 				m_emerger->queueBlockEmerge(p, false);
-				m_active_blocks.m_list.remove(p);
+				m_active_blocks.setNotLoaded(p);
 				continue;
 			}
 
@@ -1049,18 +1657,8 @@ void ServerEnvironment::step(float dtime)
 				block->raiseModified(MOD_STATE_WRITE_AT_UNLOAD,
 						"Timestamp older than 60s (step)");
 
-			// Run node metadata
-			bool changed = block->m_node_metadata->step(dtime);
-			if(changed)
-			{
-				MapEditEvent event;
-				event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
-				event.p = p;
-				m_map->dispatchEvent(&event);
-
-				block->raiseModified(MOD_STATE_WRITE_NEEDED,
-						"node metadata modified in step");
-			}
+			// Run node timers
+			runNodeTimers(block, dtime);
 		}
 	}
 	
@@ -1073,6 +1671,7 @@ void ServerEnvironment::step(float dtime)
 		// Initialize handling of ActiveBlockModifiers
 		ABMHandler abmhandler(m_abms, abm_interval, this, true);
 
+		core::array<MapBlock*> blocks;
 		for(core::map<v3s16, bool>::Iterator
 				i = m_active_blocks.m_list.getIterator();
 				i.atEnd()==false; i++)
@@ -1089,8 +1688,44 @@ void ServerEnvironment::step(float dtime)
 			// Set current time as timestamp
 			block->setTimestampNoChangedFlag(m_game_time);
 
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
+			blocks.push_back(block);
+		}
+
+		/*
+			Handle ActiveBlockModifiers.
+			The blocks are scanned for triggering nodes in parallel,
+			then the triggers are run in this thread.
+		*/
+		if(abmhandler.empty() == false && blocks.size() != 0)
+		{
+			ABMScanJob job(&abmhandler, blocks);
+			// Don't bother starting threads for a few blocks
+			u32 thread_count = m_abm_scan_threads.size();
+			if(thread_count > blocks.size() / ABM_SCAN_CHUNK_SIZE)
+				thread_count = blocks.size() / ABM_SCAN_CHUNK_SIZE;
+
+			// Scanned by this thread
+			ABMScanner scanner;
+			scanner.random.seed(myrand());
+
+			{
+				ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg", SPT_AVG);
+
+				for(u32 i=0; i<thread_count; i++)
+					m_abm_scan_threads[i]->startJob(&job);
+				job.run(scanner);
+				for(u32 i=0; i<thread_count; i++)
+					m_abm_scan_threads[i]->waitJob();
+			}
+
+			abmhandler.applyTriggers(scanner.triggers);
+			for(u32 i=0; i<thread_count; i++)
+			{
+				std::vector<ABMTrigger> &triggers =
+						m_abm_scan_threads[i]->scanner.triggers;
+				abmhandler.applyTriggers(triggers);
+				triggers.clear();
+			}
 		}
 
 		u32 time_ms = timer.stop(true);
@@ -1102,6 +1737,40 @@ void ServerEnvironment::step(float dtime)
 		}
 	}
 	
+	/*
+		Handle ActiveBlockModifiers of activated blocks, as many as
+		fit in the time budget
+	*/
+	{
+		g_profiler->avg("SEnv: pending block activations",
+				m_pending_activations.size());
+
+		u32 time_start = porting::getTimeMs();
+		while(m_pending_activations.size() != 0)
+		{
+			core::list<v3s16>::Iterator i = m_pending_activations.begin();
+			v3s16 p = *i;
+			m_pending_activations.erase(i);
+			core::map<v3s16, u32>::Node *n =
+					m_pending_activation_dtimes.find(p);
+			assert(n);
+			u32 dtime_s = n->getValue();
+			m_pending_activation_dtimes.remove(p);
+
+			// The block may have been unloaded in the meantime
+			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+			if(block != NULL)
+			{
+				ABMHandler abmhandler(m_abms, dtime_s, this, false);
+				abmhandler.apply(block);
+			}
+
+			if(porting::getTimeMs() - time_start
+					>= ABM_ACTIVATION_TIME_BUDGET_MS)
+				break;
+		}
+	}
+
 	/*
 		Step script environment (run global on_step())
 	*/
@@ -1171,38 +1840,6 @@ ServerActiveObject* ServerEnvironment::getActiveObject(u16 id)
 	return n->getValue();
 }
 
-bool isFreeServerActiveObjectId(u16 id,
-		core::map<u16, ServerActiveObject*> &objects)
-{
-	if(id == 0)
-		return false;
-	
-	for(core::map<u16, ServerActiveObject*>::Iterator
-			i = objects.getIterator();
-			i.atEnd()==false; i++)
-	{
-		if(i.getNode()->getKey() == id)
-			return false;
-	}
-	return true;
-}
-
-u16 getFreeServerActiveObjectId(
-		core::map<u16, ServerActiveObject*> &objects)
-{
-	u16 new_id = 1;
-	for(;;)
-	{
-		if(isFreeServerActiveObjectId(new_id, objects))
-			return new_id;
-		
-		if(new_id == 65535)
-			return 0;
-
-		new_id++;
-	}
-}
-
 u16 ServerEnvironment::addActiveObject(ServerActiveObject *object)
 {
 	assert(object);
@@ -1263,6 +1900,19 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 {
 	v3f pos_f = intToFloat(pos, BS);
 	f32 radius_f = radius * BS;
+	/*
+		Get the objects in the blocks around the position and the
+		objects that may have unlimited transfer distance
+	*/
+	core::array<ServerActiveObject*> nearby;
+	v3s16 radius_blocks = getNodeBlockPos(v3s16(radius, radius, radius))
+			+ v3s16(1,1,1);
+	v3s16 blockpos = getNodeBlockPos(pos);
+	m_object_index.getInArea(blockpos - radius_blocks,
+			blockpos + radius_blocks, nearby);
+	core::array<ServerActiveObject*> &unlimited = m_object_index.getUnlimited();
+	for(u32 i=0; i<unlimited.size(); i++)
+		nearby.push_back(unlimited[i]);
 	/*
 		Go through the object list,
 		- discard m_removed objects,
@@ -1270,15 +1920,11 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(core::map<u16, ServerActiveObject*>::Iterator
-			i = m_active_objects.getIterator();
-			i.atEnd()==false; i++)
+	for(u32 i=0; i<nearby.size(); i++)
 	{
-		u16 id = i.getNode()->getKey();
 		// Get object
-		ServerActiveObject *object = i.getNode()->getValue();
-		if(object == NULL)
-			continue;
+		ServerActiveObject *object = nearby[i];
+		u16 id = object->getId();
 		// Discard if removed
 		if(object->m_removed)
 			continue;
@@ -1369,9 +2015,10 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 {
 	assert(object);
 	if(object->getId() == 0){
-		u16 new_id = getFreeServerActiveObjectId(m_active_objects);
+		u16 new_id = m_object_ids.allocate();
 		if(new_id == 0)
 		{
+			g_profiler->add("SEnv: object id space exhausted", 1);
 			errorstream<<"ServerEnvironment::addActiveObjectRaw(): "
 					<<"no free ids available"<<std::endl;
 			if(object->environmentDeletes())
@@ -1383,19 +2030,21 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 	else{
 		verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 				<<"supplied with id "<<object->getId()<<std::endl;
-	}
-	if(isFreeServerActiveObjectId(object->getId(), m_active_objects) == false)
-	{
-		errorstream<<"ServerEnvironment::addActiveObjectRaw(): "
-				<<"id is not free ("<<object->getId()<<")"<<std::endl;
-		if(object->environmentDeletes())
-			delete object;
-		return 0;
+		if(m_object_ids.isFree(object->getId()) == false)
+		{
+			errorstream<<"ServerEnvironment::addActiveObjectRaw(): "
+					<<"id is not free ("<<object->getId()<<")"<<std::endl;
+			if(object->environmentDeletes())
+				delete object;
+			return 0;
+		}
+		m_object_ids.use(object->getId());
 	}
 	/*infostream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 			
 	m_active_objects.insert(object->getId(), object);
+	m_object_index.insert(object);
   
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1489,6 +2138,8 @@ void ServerEnvironment::removeRemovedObjects()
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
 		scriptapi_rm_object_reference(m_lua, obj);
+		// Remove from the object index
+		m_object_index.remove(obj);
 
 		// Delete
 		if(obj->environmentDeletes())
@@ -1501,6 +2152,7 @@ void ServerEnvironment::removeRemovedObjects()
 			i != objects_to_remove.end(); i++)
 	{
 		m_active_objects.remove(*i);
+		m_object_ids.release(*i);
 	}
 }
 
@@ -1538,6 +2190,53 @@ static void print_hexdump(std::ostream &o, const std::string &data)
 	}
 }
 
+void ServerEnvironment::runNodeTimers(MapBlock *block, float dtime)
+{
+	core::list<NodeTimerExpired> expired;
+	block->m_node_timers.step(dtime, expired);
+	if(expired.size() == 0)
+		return;
+
+	v3s16 p0 = block->getPosRelative();
+	bool changed = false;
+	for(core::list<NodeTimerExpired>::Iterator i = expired.begin();
+			i != expired.end(); i++)
+	{
+		// Step the metadata and keep it ticking while it needs it
+		NodeMetadata *meta = block->m_node_metadata->get(i->p);
+		if(meta)
+		{
+			if(meta->step(i->elapsed))
+				changed = true;
+			float interval = meta->getStepInterval();
+			if(interval > 0)
+				block->m_node_timers.set(i->p, interval);
+		}
+
+		MapNode n = block->getNodeNoEx(i->p);
+		if(scriptapi_node_on_timer(m_lua, p0 + i->p, n, i->elapsed))
+			block->m_node_timers.set(i->p, i->timeout);
+	}
+
+	if(changed)
+	{
+		block->noteMetadataChanged();
+		MapEditEvent event;
+		event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
+		event.p = block->getPos();
+		m_map->dispatchEvent(&event);
+	}
+
+	// The timers are saved with the block, but losing their state
+	// alone in a crash is not worth an immediate write
+	if(changed)
+		block->raiseModified(MOD_STATE_WRITE_NEEDED,
+				"node metadata modified by node timer");
+	else
+		block->raiseModified(MOD_STATE_WRITE_AT_UNLOAD,
+				"node timer expired");
+}
+
 /*
 	Convert stored objects from blocks near the players to active.
 */
@@ -1778,6 +2477,8 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
 		scriptapi_rm_object_reference(m_lua, obj);
+		// Remove from the object index
+		m_object_index.remove(obj);
 
 		// Delete active object
 		if(obj->environmentDeletes())
@@ -1791,6 +2492,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 			i != objects_to_remove.end(); i++)
 	{
 		m_active_objects.remove(*i);
+		m_object_ids.release(*i);
 	}
 }
 
@@ -43,6 +43,7 @@ class Server;
 class ServerEnvironment;
 class ActiveBlockModifier;
 class ServerActiveObject;
+class ABMScanThread;
 typedef struct lua_State lua_State;
 class ITextureSource;
 class IGameDef;
@@ -136,12 +137,24 @@ struct ABMWithState
 
 /*
 	List of active blocks, used by ServerEnvironment
+
+	The blocks within the radius of each player are reference counted,
+	so that only the blocks entering or leaving the area of a player
+	that has moved need to be processed.
 */
 
 class ActiveBlockList
 {
 public:
-	void update(core::list<v3s16> &active_positions,
+	ActiveBlockList():
+		m_radius(0)
+	{}
+
+	/*
+		active_positions contains the block position of each player,
+		by peer id
+	*/
+	void update(core::map<u16, v3s16> &active_positions,
 			s16 radius,
 			core::map<v3s16, bool> &blocks_removed,
 			core::map<v3s16, bool> &blocks_added);
@@ -150,13 +163,109 @@ class ActiveBlockList
 		return (m_list.find(p) != NULL);
 	}
 
+	/*
+		Removes a block that could not be activated because it is not
+		loaded. It is added again by the next update() if it is still
+		within the radius of a player.
+	*/
+	void setNotLoaded(v3s16 p);
+
 	void clear(){
 		m_list.clear();
+		m_centers.clear();
+		m_refs.clear();
+		m_not_loaded.clear();
 	}
 
 	core::map<v3s16, bool> m_list;
 
 private:
+	void addRef(v3s16 p, core::map<v3s16, bool> &blocks_added);
+	void removeRef(v3s16 p, core::map<v3s16, bool> &blocks_removed);
+
+	// Player positions and radius of the previous update
+	core::map<u16, v3s16> m_centers;
+	s16 m_radius;
+	// Number of players having each block within their radius
+	BlockPosMap<u16> m_refs;
+	core::list<v3s16> m_not_loaded;
+};
+
+/*
+	Active objects of ServerEnvironment by the block they are in, so that
+	objects near a position can be found without going through all of
+	them.
+
+	The objects keep the block they are indexed in
+	(ServerActiveObject::m_index_block), which is updated when they
+	are moved.
+*/
+
+class ActiveObjectIndex
+{
+public:
+	ActiveObjectIndex();
+	~ActiveObjectIndex();
+
+	void insert(ServerActiveObject *obj);
+	void remove(ServerActiveObject *obj);
+	// Call when the position of an indexed object has changed
+	void update(ServerActiveObject *obj);
+
+	/*
+		Appends the objects in the blocks that have any part of them
+		within the box of blocks from minp to maxp
+	*/
+	void getInArea(v3s16 minp, v3s16 maxp,
+			core::array<ServerActiveObject*> &dst);
+
+	/*
+		Objects that had an unlimited transfer distance when inserted;
+		these have to be checked regardless of position
+	*/
+	core::array<ServerActiveObject*> & getUnlimited()
+	{
+		return m_unlimited;
+	}
+
+private:
+	typedef core::array<ServerActiveObject*> Bucket;
+
+	void addToBucket(ServerActiveObject *obj, v3s16 blockpos);
+	void removeFromBucket(ServerActiveObject *obj, v3s16 blockpos);
+
+	BlockPosMap<Bucket*> m_buckets;
+	Bucket m_unlimited;
+};
+
+/*
+	Keeps track of the active object ids in use, in a bitmap.
+
+	Ids are handed out in a round-robin fashion starting after the
+	previously allocated one, so that a released id is not reused
+	right away.
+*/
+
+class ActiveObjectIdPool
+{
+public:
+	ActiveObjectIdPool();
+
+	bool isFree(u16 id)
+	{
+		return (m_used[id >> 5] & ((u32)1 << (id & 31))) == 0;
+	}
+	// Returns 0 if all ids are in use
+	u16 allocate();
+	// Marks an id as used; id must be free
+	void use(u16 id);
+	void release(u16 id);
+
+private:
+	u32 m_used[65536/32];
+	// Number of ids in use, including the invalid id 0
+	u32 m_used_count;
+	u16 m_next;
 };
 
 class IBackgroundBlockEmerger
@@ -229,6 +338,12 @@ class ServerEnvironment : public Environment
 
 	ServerActiveObject* getActiveObject(u16 id);
 
+	// Called by ServerActiveObject when its position has been changed
+	void activeObjectMoved(ServerActiveObject *object)
+	{
+		m_object_index.update(object);
+	}
+
 	/*
 		Add an active object to the environment.
 		Environment handles deletion of object.
@@ -271,7 +386,8 @@ class ServerEnvironment : public Environment
 
 	/*
 		Activate objects and dynamically modify for the dtime determined
-		from timestamp and additional_dtime
+		from timestamp and additional_dtime.
+		The ABMs for the dtime are queued and run later by step().
 	*/
 	void activateBlock(MapBlock *block, u32 additional_dtime=0);
 
@@ -324,6 +440,12 @@ class ServerEnvironment : public Environment
 		Convert stored objects from block to active
 	*/
 	void activateObjects(MapBlock *block);
+
+	/*
+		Step the node timers of a block and handle the expired ones:
+		step node metadata and call the on_timer callbacks
+	*/
+	void runNodeTimers(MapBlock *block, float dtime);
 	
 	/*
 		Convert objects that are not in active blocks to static.
@@ -350,6 +472,10 @@ class ServerEnvironment : public Environment
 	IBackgroundBlockEmerger *m_emerger;
 	// Active object list
 	core::map<u16, ServerActiveObject*> m_active_objects;
+	// The active objects by position
+	ActiveObjectIndex m_object_index;
+	// Ids of the active objects
+	ActiveObjectIdPool m_object_ids;
 	// Outgoing network message buffer for active objects
 	Queue<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -367,6 +493,13 @@ class ServerEnvironment : public Environment
 	// A helper variable for incrementing the latter
 	float m_game_time_fraction_counter;
 	core::list<ABMWithState> m_abms;
+	// Threads helping the server thread in finding ABM triggers
+	core::array<ABMScanThread*> m_abm_scan_threads;
+	// Blocks waiting for the ABMs of the time they were inactive,
+	// in activation order
+	core::list<v3s16> m_pending_activations;
+	// The inactive time of each block in m_pending_activations
+	core::map<v3s16, u32> m_pending_activation_dtimes;
 
 	//env database object
 	Database* m_database;
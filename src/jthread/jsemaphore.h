@@ -0,0 +1,55 @@
+/*
+
+    This file is a part of the JThread package, which contains some object-
+    oriented thread wrappers for different thread implementations.
+
+    Copyright (c) 2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef JSEMAPHORE_H
+
+#define JSEMAPHORE_H
+
+#include "jmutex.h" // For the platform headers
+
+/*
+	A counting semaphore. Wait() blocks until the count is positive and
+	then decrements it; Post() increments it.
+*/
+class JSemaphore
+{
+public:
+	JSemaphore(int initial_count = 0);
+	~JSemaphore();
+	void Post();
+	void Wait();
+private:
+#if (defined(WIN32) || defined(_WIN32_WCE))
+	HANDLE semaphore;
+#else // pthread semaphore
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int count;
+#endif // WIN32
+};
+
+#endif // JSEMAPHORE_H
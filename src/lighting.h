@@ -0,0 +1,196 @@
+/*
+Minetest-c55
+Copyright (C) 2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef LIGHTING_HEADER
+#define LIGHTING_HEADER
+
+#include <string.h>
+#include "common_irrlicht.h"
+#include "mapnode.h"
+#include "nodedef.h"
+
+/*
+	Helpers shared by the light spreading code of Map and
+	VoxelManipulator
+*/
+
+#define LIGHTTABLE_KNOWN (1<<0)
+#define LIGHTTABLE_PROPAGATES (1<<1)
+#define LIGHTTABLE_SUNLIGHT_PROPAGATES (1<<2)
+// param1 holds the light (param_type == CPT_LIGHT)
+#define LIGHTTABLE_PARAM_LIGHT (1<<3)
+
+/*
+	Lighting properties of node contents.
+
+	The properties are fetched from the node definition manager on the
+	first use of each content and then read from flat arrays, so that
+	spreading light does not look up ContentFeatures for every node.
+
+	Meant to live for the duration of one lighting operation.
+*/
+class NodeLightTable
+{
+public:
+	NodeLightTable(INodeDefManager *ndef):
+		m_ndef(ndef)
+	{
+		memset(m_flags, 0, sizeof(m_flags));
+	}
+
+	bool lightPropagates(const MapNode &n)
+	{
+		return (get(n.getContent()) & LIGHTTABLE_PROPAGATES) != 0;
+	}
+
+	bool sunlightPropagates(const MapNode &n)
+	{
+		return (get(n.getContent()) & LIGHTTABLE_SUNLIGHT_PROPAGATES) != 0;
+	}
+
+	// Same as MapNode::getLight()
+	u8 getLight(const MapNode &n, enum LightBank bank)
+	{
+		content_t c = n.getContent();
+		u8 light = 0;
+		if(get(c) & LIGHTTABLE_PARAM_LIGHT)
+		{
+			if(bank == LIGHTBANK_DAY)
+				light = n.param1 & 0x0f;
+			else
+				light = (n.param1 >> 4) & 0x0f;
+		}
+		if(m_light_source[c] > light)
+			light = m_light_source[c];
+		return light;
+	}
+
+	// Same as MapNode::setLight()
+	void setLight(MapNode &n, enum LightBank bank, u8 light)
+	{
+		if((get(n.getContent()) & LIGHTTABLE_PARAM_LIGHT) == 0)
+			return;
+		if(bank == LIGHTBANK_DAY)
+			n.param1 = (n.param1 & 0xf0) | (light & 0x0f);
+		else
+			n.param1 = (n.param1 & 0x0f) | ((light & 0x0f) << 4);
+	}
+
+private:
+	u8 get(content_t c)
+	{
+		u8 flags = m_flags[c];
+		if(flags != 0)
+			return flags;
+
+		const ContentFeatures &f = m_ndef->get(c);
+		flags = LIGHTTABLE_KNOWN;
+		if(f.light_propagates)
+			flags |= LIGHTTABLE_PROPAGATES;
+		if(f.sunlight_propagates)
+			flags |= LIGHTTABLE_SUNLIGHT_PROPAGATES;
+		if(f.param_type == CPT_LIGHT)
+			flags |= LIGHTTABLE_PARAM_LIGHT;
+		m_light_source[c] = f.light_source;
+		m_flags[c] = flags;
+		return flags;
+	}
+
+	INodeDefManager *m_ndef;
+	u8 m_flags[MAX_CONTENT+1];
+	u8 m_light_source[MAX_CONTENT+1];
+};
+
+struct LightQueueItem
+{
+	v3s16 p;
+	u8 light;
+};
+
+/*
+	FIFO of nodes to visit, in a ring buffer that grows as needed.
+	Replaces the per-round core::maps of the old recursive code.
+*/
+class LightQueue
+{
+public:
+	LightQueue():
+		m_items(NULL),
+		m_capacity(0),
+		m_head(0),
+		m_size(0)
+	{
+		grow();
+	}
+
+	~LightQueue()
+	{
+		delete[] m_items;
+	}
+
+	void push(v3s16 p, u8 light=0)
+	{
+		if(m_size == m_capacity)
+			grow();
+		LightQueueItem &item = m_items[(m_head + m_size) & (m_capacity - 1)];
+		item.p = p;
+		item.light = light;
+		m_size++;
+	}
+
+	LightQueueItem pop()
+	{
+		assert(m_size != 0);
+		LightQueueItem item = m_items[m_head];
+		m_head = (m_head + 1) & (m_capacity - 1);
+		m_size--;
+		return item;
+	}
+
+	bool empty()
+	{
+		return m_size == 0;
+	}
+
+private:
+	// Not copyable
+	LightQueue(const LightQueue &);
+	LightQueue & operator=(const LightQueue &);
+
+	void grow()
+	{
+		// Capacity is kept a power of two
+		u32 capacity = (m_capacity == 0) ? 256 : m_capacity * 2;
+		LightQueueItem *items = new LightQueueItem[capacity];
+		for(u32 i=0; i<m_size; i++)
+			items[i] = m_items[(m_head + i) & (m_capacity - 1)];
+		delete[] m_items;
+		m_items = items;
+		m_capacity = capacity;
+		m_head = 0;
+	}
+
+	LightQueueItem *m_items;
+	u32 m_capacity;
+	u32 m_head;
+	u32 m_size;
+};
+
+#endif
+
@@ -36,9 +36,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "log.h"
 #include "profiler.h"
+#include "lighting.h"
 #include "nodedef.h"
 #include "gamedef.h"
 #include "db.h"
+#include "blocksaver.h"
+#include "nameidmapping.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -132,14 +135,14 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 	return sector;
 }
 
-MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
+void Map::indexBlock(MapBlock *block)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
-	return block;
+	m_block_index.set(block->getPos(), block);
+}
+
+void Map::unindexBlock(v3s16 p)
+{
+	m_block_index.remove(p);
 }
 
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
@@ -212,7 +215,7 @@ void Map::setNode(v3s16 p, MapNode & n)
 
 
 /*
-	Goes recursively through the neighbours of the node.
+	Goes through the neighbours of the nodes, breadth-first.
 
 	Alters only transparent nodes.
 
@@ -233,9 +236,7 @@ void Map::unspreadLight(enum LightBank bank,
 		core::map<v3s16, bool> & light_sources,
 		core::map<v3s16, MapBlock*>  & modified_blocks)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	v3s16 dirs[6] = {
+	const v3s16 dirs[6] = {
 		v3s16(0,0,1), // back
 		v3s16(0,1,0), // top
 		v3s16(1,0,0), // right
@@ -246,52 +247,41 @@ void Map::unspreadLight(enum LightBank bank,
 	
 	if(from_nodes.size() == 0)
 		return;
-	
-	u32 blockchangecount = 0;
 
-	core::map<v3s16, u8> unlighted_nodes;
-	core::map<v3s16, u8>::Iterator j;
-	j = from_nodes.getIterator();
+	NodeLightTable lighttable(m_gamedef->ndef());
 
 	/*
-		Initialize block cache
+		The nodes are visited breadth-first from a queue; every node
+		that is set dark is added to the end with its old light value.
 	*/
+	LightQueue queue;
+	for(core::map<v3s16, u8>::Iterator j = from_nodes.getIterator();
+			j.atEnd() == false; j++)
+	{
+		queue.push(j.getNode()->getKey(), j.getNode()->getValue());
+	}
+
+	// Last used block, and the last one added to modified_blocks
 	v3s16 blockpos_last;
 	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-	
-	for(; j.atEnd() == false; j++)
+	MapBlock *block_last_modified = NULL;
+
+	while(queue.empty() == false)
 	{
-		v3s16 pos = j.getNode()->getKey();
-		v3s16 blockpos = getNodeBlockPos(pos);
-		
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		LightQueueItem item = queue.pop();
+		v3s16 pos = item.p;
+		u8 oldlight = item.light;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
+		// Skip nodes whose block is not there
+		v3s16 blockpos = getNodeBlockPos(pos);
+		if(block == NULL || blockpos != blockpos_last)
 		{
-			continue;
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
 		}
-
-		if(block->isDummy())
+		if(block == NULL || block->isDummy())
 			continue;
 
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
-
-		u8 oldlight = j.getNode()->getValue();
-
 		// Loop through 6 neighbors
 		for(u16 i=0; i<6; i++)
 		{
@@ -300,100 +290,52 @@ void Map::unspreadLight(enum LightBank bank,
 
 			// Get the block where the node is located
 			v3s16 blockpos = getNodeBlockPos(n2pos);
-
-			try
+			if(block == NULL || blockpos != blockpos_last)
 			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
-
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
-
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
-
-				bool changed = false;
+				block = getBlockNoCreateNoEx(blockpos);
+				blockpos_last = blockpos;
+			}
+			if(block == NULL || block->isDummy())
+				continue;
 
-				//TODO: Optimize output by optimizing light_sources?
+			// Calculate relative position in block
+			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
+			// Get node straight from the block
+			MapNode n2 = block->getNodeNoCheck(relpos);
+			u8 light2 = lighttable.getLight(n2, bank);
 
+			/*
+				If the neighbor is dimmer than what was specified
+				as oldlight (the light of the previous node)
+			*/
+			if(light2 < oldlight)
+			{
 				/*
-					If the neighbor is dimmer than what was specified
-					as oldlight (the light of the previous node)
+					And the neighbor is transparent and it has some light
 				*/
-				if(n2.getLight(bank, nodemgr) < oldlight)
+				if(lighttable.lightPropagates(n2) && light2 != 0)
 				{
 					/*
-						And the neighbor is transparent and it has some light
+						Set light to 0 and add to queue
 					*/
-					if(nodemgr->get(n2).light_propagates
-							&& n2.getLight(bank, nodemgr) != 0)
-					{
-						/*
-							Set light to 0 and add to queue
-						*/
-
-						u8 current_light = n2.getLight(bank, nodemgr);
-						n2.setLight(bank, 0, nodemgr);
-						block->setNode(relpos, n2);
-
-						unlighted_nodes.insert(n2pos, current_light);
-						changed = true;
-
-						/*
-							Remove from light_sources if it is there
-							NOTE: This doesn't happen nearly at all
-						*/
-						/*if(light_sources.find(n2pos))
-						{
-							infostream<<"Removed from light_sources"<<std::endl;
-							light_sources.remove(n2pos);
-						}*/
-					}
+					lighttable.setLight(n2, bank, 0);
+					block->setNodeNoCheck(relpos, n2);
 
-					/*// DEBUG
-					if(light_sources.find(n2pos) != NULL)
-						light_sources.remove(n2pos);*/
-				}
-				else{
-					light_sources.insert(n2pos, true);
-				}
+					queue.push(n2pos, light2);
 
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == NULL)
+					// Add to modified_blocks
+					if(block != block_last_modified)
 					{
 						modified_blocks.insert(blockpos, block);
+						block_last_modified = block;
 					}
-					block_checked_in_modified = true;
 				}
 			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
+			else{
+				light_sources.insert(n2pos, true);
 			}
 		}
 	}
-
-	/*infostream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
 }
 
 /*
@@ -411,15 +353,13 @@ void Map::unLightNeighbors(enum LightBank bank,
 }
 
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	Lights neighbors of from_nodes and goes on through the nodes that
+	got lighted.
 */
 void Map::spreadLight(enum LightBank bank,
 		core::map<v3s16, bool> & from_nodes,
 		core::map<v3s16, MapBlock*> & modified_blocks)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
 	const v3s16 dirs[6] = {
 		v3s16(0,0,1), // back
 		v3s16(0,1,0), // top
@@ -432,53 +372,40 @@ void Map::spreadLight(enum LightBank bank,
 	if(from_nodes.size() == 0)
 		return;
 
-	u32 blockchangecount = 0;
+	NodeLightTable lighttable(m_gamedef->ndef());
 
-	core::map<v3s16, bool> lighted_nodes;
-	core::map<v3s16, bool>::Iterator j;
-	j = from_nodes.getIterator();
+	LightQueue queue;
+	for(core::map<v3s16, bool>::Iterator j = from_nodes.getIterator();
+			j.atEnd() == false; j++)
+	{
+		queue.push(j.getNode()->getKey());
+	}
 
-	/*
-		Initialize block cache
-	*/
+	// Last used block, and the last one added to modified_blocks
 	v3s16 blockpos_last;
 	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
+	MapBlock *block_last_modified = NULL;
 
-	for(; j.atEnd() == false; j++)
-	//for(; j != from_nodes.end(); j++)
+	while(queue.empty() == false)
 	{
-		v3s16 pos = j.getNode()->getKey();
-		//v3s16 pos = *j;
-		//infostream<<"pos=("<<pos.X<<","<<pos.Y<<","<<pos.Z<<")"<<std::endl;
-		v3s16 blockpos = getNodeBlockPos(pos);
-
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		v3s16 pos = queue.pop().p;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
+		v3s16 blockpos = getNodeBlockPos(pos);
+		if(block == NULL || blockpos != blockpos_last)
 		{
-			continue;
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
 		}
-
-		if(block->isDummy())
+		if(block == NULL || block->isDummy())
 			continue;
 
 		// Calculate relative position in block
 		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
 
 		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
+		MapNode n = block->getNodeNoCheck(relpos);
 
-		u8 oldlight = n.getLight(bank, nodemgr);
+		u8 oldlight = lighttable.getLight(n, bank);
 		u8 newlight = diminish_light(oldlight);
 
 		// Loop through 6 neighbors
@@ -488,81 +415,53 @@ void Map::spreadLight(enum LightBank bank,
 
 			// Get the block where the node is located
 			v3s16 blockpos = getNodeBlockPos(n2pos);
-
-			try
+			if(block == NULL || blockpos != blockpos_last)
 			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
-
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
+				block = getBlockNoCreateNoEx(blockpos);
+				blockpos_last = blockpos;
+			}
+			if(block == NULL || block->isDummy())
+				continue;
 
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
+			// Calculate relative position in block
+			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
+			// Get node straight from the block
+			MapNode n2 = block->getNodeNoCheck(relpos);
+			u8 light2 = lighttable.getLight(n2, bank);
 
-				bool changed = false;
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
+			bool changed = false;
+			/*
+				If the neighbor is brighter than the current node,
+				add to queue (it will light up this node on its turn)
+			*/
+			if(light2 > undiminish_light(oldlight))
+			{
+				queue.push(n2pos);
+				changed = true;
+			}
+			/*
+				If the neighbor is dimmer than how much light this node
+				would spread on it, add to queue
+			*/
+			if(light2 < newlight)
+			{
+				if(lighttable.lightPropagates(n2))
 				{
-					lighted_nodes.insert(n2pos, true);
-					//lighted_nodes.push_back(n2pos);
+					lighttable.setLight(n2, bank, newlight);
+					block->setNodeNoCheck(relpos, n2);
+					queue.push(n2pos);
 					changed = true;
 				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(n2.getLight(bank, nodemgr) < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						block->setNode(relpos, n2);
-						lighted_nodes.insert(n2pos, true);
-						//lighted_nodes.push_back(n2pos);
-						changed = true;
-					}
-				}
-
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == NULL)
-					{
-						modified_blocks.insert(blockpos, block);
-					}
-					block_checked_in_modified = true;
-				}
 			}
-			catch(InvalidPositionException &e)
+
+			// Add to modified_blocks
+			if(changed == true && block != block_last_modified)
 			{
-				continue;
+				modified_blocks.insert(blockpos, block);
+				block_last_modified = block;
 			}
 		}
 	}
-
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, modified_blocks);
 }
 
 /*
@@ -990,6 +889,12 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 
 	setNode(p, n);
 
+	/*
+		The timer of the old node does not apply to the new one
+	*/
+
+	removeNodeTimer(p);
+
 	/*
 		Add intial metadata
 	*/
@@ -1151,6 +1056,12 @@ void Map::removeNodeAndUpdate(v3s16 p,
 
 	removeNodeMetadata(p);
 
+	/*
+		Remove node timer
+	*/
+
+	removeNodeTimer(p);
+
 	/*
 		Remove the node.
 		This also clears the lighting.
@@ -1399,6 +1310,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	u32 deleted_blocks_count = 0;
 	u32 saved_blocks_count = 0;
 	u32 block_count_all = 0;
+	u32 node_memory = 0;
 
 	core::map<v2s16, MapSector*>::Iterator si;
 
@@ -1445,6 +1357,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 			{
 				all_blocks_deleted = false;
 				block_count_all++;
+				node_memory += block->getNodeMemoryUsage();
 			}
 		}
 
@@ -1457,6 +1370,10 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	
 	// Finally delete the empty sectors
 	deleteSectors(sector_deletion_queue);
+
+	std::string prefix = (mapType() == MAPTYPE_SERVER) ? "SM: " : "CM: ";
+	g_profiler->avg(prefix+"loaded blocks", block_count_all);
+	g_profiler->avg(prefix+"node memory (kB)", node_memory / 1024);
 	
 	if(deleted_blocks_count != 0)
 	{
@@ -1475,6 +1392,121 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	}
 }
 
+struct BlockUsage
+{
+	MapBlock *block;
+	MapSector *sector;
+	float usage_timer;
+	u32 memory;
+
+	// Sorts the least recently used first
+	bool operator<(const BlockUsage &other) const
+	{
+		return usage_timer > other.usage_timer;
+	}
+};
+
+u32 Map::unloadToMemoryBudget(u64 memory_budget, float min_unused_time,
+		core::list<v3s16> *unloaded_blocks)
+{
+	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
+
+	core::array<BlockUsage> blocks;
+	u64 memory = 0;
+
+	for(core::map<v2s16, MapSector*>::Iterator si = m_sectors.getIterator();
+			si.atEnd() == false; si++)
+	{
+		MapSector *sector = si.getNode()->getValue();
+		core::list<MapBlock*> sectorblocks;
+		sector->getBlocks(sectorblocks);
+		for(core::list<MapBlock*>::Iterator i = sectorblocks.begin();
+				i != sectorblocks.end(); i++)
+		{
+			BlockUsage u;
+			u.block = *i;
+			u.sector = sector;
+			u.usage_timer = (*i)->getUsageTimer();
+			u.memory = (*i)->getMemoryUsage();
+			memory += u.memory;
+			blocks.push_back(u);
+		}
+	}
+
+	if(memory <= memory_budget)
+		return 0;
+
+	blocks.sort();
+
+	u32 deleted_blocks_count = 0;
+	u32 saved_blocks_count = 0;
+	core::map<v2s16, bool> touched_sectors;
+
+	beginSave();
+	for(u32 i=0; i<blocks.size() && memory > memory_budget; i++)
+	{
+		MapBlock *block = blocks[i].block;
+
+		// Still in use; so are all the rest
+		if(blocks[i].usage_timer < min_unused_time)
+			break;
+
+		v3s16 p = block->getPos();
+
+		// Save if modified
+		if(block->getModified() != MOD_STATE_CLEAN
+				&& save_before_unloading)
+		{
+			saveBlock(block);
+			saved_blocks_count++;
+		}
+
+		// Delete from memory
+		blocks[i].sector->deleteBlock(block);
+		touched_sectors[v2s16(p.X, p.Z)] = true;
+
+		if(unloaded_blocks)
+			unloaded_blocks->push_back(p);
+
+		memory -= blocks[i].memory;
+		deleted_blocks_count++;
+	}
+	endSave();
+
+	// Delete the sectors that were left empty
+	core::list<v2s16> sector_deletion_queue;
+	for(core::map<v2s16, bool>::Iterator i = touched_sectors.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v2s16 p2d = i.getNode()->getKey();
+		core::list<MapBlock*> sectorblocks;
+		m_sectors.find(p2d)->getValue()->getBlocks(sectorblocks);
+		if(sectorblocks.size() == 0)
+			sector_deletion_queue.push_back(p2d);
+	}
+	deleteSectors(sector_deletion_queue);
+
+	if(memory > memory_budget)
+	{
+		PrintInfo(infostream); // ServerMap/ClientMap:
+		infostream<<"Blocks in use take "<<(memory / 1024 / 1024)
+				<<" MB, over memory budget of "
+				<<(memory_budget / 1024 / 1024)<<" MB"<<std::endl;
+	}
+
+	if(deleted_blocks_count != 0)
+	{
+		PrintInfo(infostream); // ServerMap/ClientMap:
+		infostream<<"Unloaded "<<deleted_blocks_count
+				<<" least recently used blocks from memory";
+		if(save_before_unloading)
+			infostream<<", of which "<<saved_blocks_count<<" were written";
+		infostream<<"."<<std::endl;
+	}
+
+	return deleted_blocks_count;
+}
+
 void Map::deleteSectors(core::list<v2s16> &list)
 {
 	core::list<v2s16>::Iterator j;
@@ -1849,6 +1881,12 @@ void Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return;
 	}
 	block->m_node_metadata->set(p_rel, meta);
+	block->noteMetadataChanged();
+
+	// Start stepping the metadata if it needs it
+	float interval = meta->getStepInterval();
+	if(interval > 0)
+		block->m_node_timers.set(p_rel, interval);
 }
 
 void Map::removeNodeMetadata(v3s16 p)
@@ -1863,6 +1901,47 @@ void Map::removeNodeMetadata(v3s16 p)
 		return;
 	}
 	block->m_node_metadata->remove(p_rel);
+	block->noteMetadataChanged();
+}
+
+void Map::setNodeTimer(v3s16 p, float timeout)
+{
+	if(timeout <= 0)
+	{
+		removeNodeTimer(p);
+		return;
+	}
+	v3s16 blockpos = getNodeBlockPos(p);
+	v3s16 p_rel = p - blockpos*MAP_BLOCKSIZE;
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block == NULL)
+	{
+		infostream<<"WARNING: Map::setNodeTimer(): Block not found"
+				<<std::endl;
+		return;
+	}
+	block->m_node_timers.set(p_rel, timeout);
+	block->raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeTimer");
+}
+
+void Map::removeNodeTimer(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	v3s16 p_rel = p - blockpos*MAP_BLOCKSIZE;
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block == NULL)
+		return;
+	block->m_node_timers.remove(p_rel);
+}
+
+float Map::getNodeTimer(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	v3s16 p_rel = p - blockpos*MAP_BLOCKSIZE;
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block == NULL)
+		return -1;
+	return block->m_node_timers.getRemaining(p_rel);
 }
 
 void Map::nodeMetadataStep(float dtime,
@@ -1889,7 +1968,10 @@ void Map::nodeMetadataStep(float dtime,
 			MapBlock *block = *i;
 			bool changed = block->m_node_metadata->step(dtime);
 			if(changed)
+			{
+				block->noteMetadataChanged();
 				changed_blocks[block->getPos()] = block;
+			}
 		}
 	}
 }
@@ -1906,10 +1988,18 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef):
 	m_database( new Database(savedir + DIR_DELIM "map.sqlite") ),
 	m_blocks( m_database->getTable<v3s16,binary_t>("blocks",true) ),
 	m_map_meta( m_database->getTable<std::string>("map_meta") ),
-	m_sectors_meta( m_database->getTable<v2s16,binary_t>("sectors_meta") )
+	m_sectors_meta( m_database->getTable<v2s16,binary_t>("sectors_meta") ),
+	m_block_saver( new BlockSaver(m_database, m_blocks,
+			g_settings->getU16("server_map_save_queue_size")) ),
+	m_block_save_counter(0)
 {
 	infostream<<__FUNCTION_NAME<<std::endl;
 
+	m_readers_mutex.Init();
+
+	for(u32 i=0; i<BLOCKMAKE_STRIPE_COUNT; i++)
+		m_blockmake_stripes[i].Init();
+
 	//m_chunksize = 8; // Takes a few seconds
 
 	if (g_settings->get("fixed_map_seed").empty())
@@ -1937,6 +2027,8 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef):
 
 	loadMapMeta();
 	m_map_saving_enabled = true;
+
+	m_block_saver->Start();
 }
 
 ServerMap::~ServerMap()
@@ -1962,6 +2054,20 @@ ServerMap::~ServerMap()
 				<<", exception: "<<e.what()<<std::endl;
 	}
 
+	/*
+		Write the queued blocks and stop the saver thread
+	*/
+	delete m_block_saver;
+
+	/*
+		Close read-only connections
+	*/
+	for(core::list<Database*>::Iterator i = m_readers.begin();
+			i != m_readers.end(); i++)
+	{
+		delete *i;
+	}
+
 	/*
 		Close database
 	*/
@@ -2065,6 +2171,53 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 	// Data is ready now.
 }
 
+u32 ServerMap::getBlockMakeStripes(v3s16 blockpos, u32 *stripes)
+{
+	v3s16 rmin = getContainerPos(blockpos - v3s16(1,1,1),
+			BLOCKMAKE_REGION_SIZE);
+	v3s16 rmax = getContainerPos(blockpos + v3s16(1,1,1),
+			BLOCKMAKE_REGION_SIZE);
+	
+	// At most 2*2*2 regions
+	u32 count = 0;
+	for(s16 z=rmin.Z; z<=rmax.Z; z++)
+	for(s16 y=rmin.Y; y<=rmax.Y; y++)
+	for(s16 x=rmin.X; x<=rmax.X; x++)
+	{
+		u32 h = ((u32)x * 73856093) ^ ((u32)y * 19349663)
+				^ ((u32)z * 83492791);
+		u32 stripe = h % BLOCKMAKE_STRIPE_COUNT;
+		
+		// Insert sorted, skipping duplicates
+		u32 i = 0;
+		while(i < count && stripes[i] < stripe)
+			i++;
+		if(i < count && stripes[i] == stripe)
+			continue;
+		for(u32 j=count; j>i; j--)
+			stripes[j] = stripes[j-1];
+		stripes[i] = stripe;
+		count++;
+	}
+	return count;
+}
+
+void ServerMap::lockBlockMakeArea(v3s16 blockpos)
+{
+	u32 stripes[8];
+	u32 count = getBlockMakeStripes(blockpos, stripes);
+	for(u32 i=0; i<count; i++)
+		m_blockmake_stripes[stripes[i]].Lock();
+}
+
+void ServerMap::unlockBlockMakeArea(v3s16 blockpos)
+{
+	u32 stripes[8];
+	u32 count = getBlockMakeStripes(blockpos, stripes);
+	for(u32 i=0; i<count; i++)
+		m_blockmake_stripes[stripes[i]].Unlock();
+}
+
 MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 		core::map<v3s16, MapBlock*> &changed_blocks)
 {
@@ -2620,6 +2773,7 @@ void ServerMap::save(ModifiedState save_level)
 	u32 sector_meta_count = 0;
 	u32 block_count = 0;
 	u32 block_count_all = 0; // Number of blocks in memory
+	u32 block_count_deferred = 0; // Not fitting in the save queue
 	
 	// Don't do anything with sqlite unless something is really saved
 	bool save_started = false;
@@ -2647,6 +2801,17 @@ void ServerMap::save(ModifiedState save_level)
 
 			if(block->getModified() >= save_level)
 			{
+				/*
+					Don't wait for the saver thread on periodic saves.
+					The block stays modified and is saved next time.
+				*/
+				if(save_level == MOD_STATE_WRITE_NEEDED
+						&& m_block_saver->isFull())
+				{
+					block_count_deferred++;
+					continue;
+				}
+
 				// Lazy beginSave()
 				if(!save_started){
 					beginSave();
@@ -2673,13 +2838,15 @@ void ServerMap::save(ModifiedState save_level)
 		Only print if something happened or saved whole map
 	*/
 	if(save_level == MOD_STATE_CLEAN || sector_meta_count != 0
-			|| block_count != 0)
+			|| block_count != 0 || block_count_deferred != 0)
 	{
 		infostream<<"ServerMap: Written: "
 				<<sector_meta_count<<" sector metadata files, "
 				<<block_count<<" block files"
-				<<", "<<block_count_all<<" blocks in memory."
-				<<std::endl;
+				<<", "<<block_count_all<<" blocks in memory";
+		if(block_count_deferred != 0)
+			infostream<<", "<<block_count_deferred<<" deferred (save queue full)";
+		infostream<<"."<<std::endl;
 		PrintInfo(infostream); // ServerMap/ClientMap:
 		infostream<<"Blocks modified by: "<<std::endl;
 		modprofiler.print(infostream);
@@ -2693,6 +2860,10 @@ void ServerMap::save(ModifiedState save_level)
 
 void ServerMap::listAllLoadableBlocks(core::list<v3s16> &dst)
 {
+	// Make sure every queued block is in the database
+	m_block_saver->flush();
+
+	JMutexAutoLock dblock(m_database->getMutex());
 	m_blocks.getKeys(dst);
 }
 
@@ -2704,6 +2875,8 @@ void ServerMap::saveMapMeta()
 			<<"seed="<<m_seed
 			<<std::endl;
 
+	JMutexAutoLock dblock(m_database->getMutex());
+
 	bool success = true;
 	if(!m_map_meta.put("seed",m_seed)) success = false;
 		
@@ -2773,7 +2946,10 @@ void ServerMap::saveSectorMeta(ServerMapSector *sector)
 
 	sector->serialize(o, version);
 
-	m_sectors_meta.put(pos,o.str());
+	{
+		JMutexAutoLock dblock(m_database->getMutex());
+		m_sectors_meta.put(pos,o.str());
+	}
 	
 	sector->differs_from_disk = false;
 }
@@ -2787,8 +2963,13 @@ bool ServerMap::loadSectorMeta(v2s16 p2d)
 		ServerMapSector *sector = NULL;
 
 		std::string data;
+		bool found;
+		{
+			JMutexAutoLock dblock(m_database->getMutex());
+			found = m_sectors_meta.getNoEx(p2d,data);
+		}
 
-		if(!m_sectors_meta.getNoEx(p2d,data))
+		if(!found)
 		{
 			sector = new ServerMapSector(this, p2d, m_gamedef);
 			m_sectors.insert(p2d, sector);
@@ -2813,13 +2994,11 @@ bool ServerMap::loadSectorMeta(v2s16 p2d)
 
 
 void ServerMap::beginSave() {
-	m_database->begin();
-	//m_database->sync();
+	// Transactions are handled by the block saver
 }
 
 void ServerMap::endSave() {
-	m_database->commit();
-	//m_database->sync();
+	// Transactions are handled by the block saver
 }
 
 void ServerMap::saveBlock(MapBlock *block)
@@ -2866,11 +3045,15 @@ void ServerMap::saveBlock(MapBlock *block)
 	
 	// Write basic data
 	block->serialize(o, version, true);
+
+	// Blocks are usually not modified much after being saved
+	block->compact();
 	
-	// Write block to database	
-	m_blocks.put(p3d,o.str());
+	// Queue block for writing to database
+	m_block_saver->queueBlock(p3d, o.str());
+	m_block_save_counter++;
 	
-	// We just wrote it to the disk so clear modified flag
+	// The data is snapshotted now so clear modified flag
 	block->resetModified();
 }
 
@@ -2907,6 +3090,7 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 		
 		// Read basic data
 		block->deSerialize(is, version, true);
+		block->compact();
 		
 		// If it's a new block, insert it to the map
 		if(created_new)
@@ -2943,7 +3127,12 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	DSTACK(__FUNCTION_NAME);
 
 	std::string data;
-	if(!m_blocks.getNoEx(blockpos,data)) return NULL;
+	// A block waiting in the save queue is newer than the database
+	if(!m_block_saver->getQueuedBlock(blockpos, data))
+	{
+		JMutexAutoLock dblock(m_database->getMutex());
+		if(!m_blocks.getNoEx(blockpos,data)) return NULL;
+	}
 
 	v2s16 p2d(blockpos.X, blockpos.Z);
 	MapSector *sector = createSector(p2d);
@@ -2953,6 +3142,130 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	return getBlockNoCreateNoEx(blockpos);
 }
 
+MapBlock* ServerMap::loadBlockNoInsert(v3s16 blockpos, NameIdMapping *nimap,
+		bool *not_found)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::string data;
+	if(!m_block_saver->getQueuedBlock(blockpos, data))
+	{
+		/*
+			Get a free read-only connection or open a new one
+		*/
+		Database *reader = NULL;
+		{
+			JMutexAutoLock lock(m_readers_mutex);
+			if(m_readers.size() != 0)
+			{
+				core::list<Database*>::Iterator i = m_readers.begin();
+				reader = *i;
+				m_readers.erase(i);
+			}
+		}
+		if(reader == NULL)
+		{
+			try{
+				reader = new Database(m_savedir + DIR_DELIM "map.sqlite",
+						true);
+			}
+			catch(BaseException &e)
+			{
+				errorstream<<"ServerMap::loadBlockNoInsert(): Cannot open "
+						<<"read-only database connection"<<std::endl;
+				return NULL;
+			}
+		}
+
+		bool found = false;
+		bool failed = false;
+		try{
+			found = reader->getTable<v3s16,binary_t>("blocks",true)
+					.getNoEx(blockpos, data);
+		}
+		catch(BaseException &e)
+		{
+			errorstream<<"ServerMap::loadBlockNoInsert(): Failed to read "
+					<<"block: "<<e.what()<<std::endl;
+			failed = true;
+		}
+
+		{
+			JMutexAutoLock lock(m_readers_mutex);
+			m_readers.push_back(reader);
+		}
+
+		// The caller falls back to loadBlock()
+		if(failed)
+			return NULL;
+
+		if(!found)
+		{
+			if(not_found)
+				*not_found = true;
+			return NULL;
+		}
+	}
+
+	MapBlock *block = new MapBlock(this, blockpos, m_gamedef);
+	try{
+		std::istringstream is(data, std::ios_base::binary);
+
+		u8 version = SER_FMT_VER_INVALID;
+		is.read((char*)&version, 1);
+		if(is.fail())
+			throw SerializationError("ServerMap::loadBlockNoInsert(): Failed"
+					" to read MapBlock version");
+
+		// Legacy formats are converted using ndef; leave them to
+		// loadBlock()
+		if(version < 22)
+		{
+			delete block;
+			return NULL;
+		}
+
+		// Node names are resolved in insertLoadedBlock(), as unknown
+		// names are added to ndef
+		block->deSerialize(is, version, true, nimap);
+	}
+	catch(SerializationError &e)
+	{
+		// loadBlock() handles this
+		delete block;
+		return NULL;
+	}
+
+	// We just loaded it, so it's up-to-date.
+	block->resetModified();
+
+	return block;
+}
+
+MapBlock* ServerMap::insertLoadedBlock(MapBlock *block,
+		const NameIdMapping &nimap, u32 save_counter)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v3s16 p = block->getPos();
+
+	if(save_counter != m_block_save_counter
+			|| getBlockNoCreateNoEx(p) != NULL)
+	{
+		delete block;
+		return NULL;
+	}
+
+	block->correctNodeIds(nimap);
+	block->compact();
+
+	v2s16 p2d(p.X, p.Z);
+	MapSector *sector = createSector(p2d);
+	sector->insertBlock(block);
+
+	return block;
+}
+
 void ServerMap::PrintInfo(std::ostream &out)
 {
 	out<<"ServerMap: ";
@@ -35,6 +35,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "modifiedstate.h"
 
 #include "db.h"
+#include "blockposmap.h"
 
 class MapSector;
 class ServerMapSector;
@@ -42,6 +43,8 @@ class ClientMapSector;
 class MapBlock;
 class NodeMetadata;
 class IGameDef;
+class BlockSaver;
+class NameIdMapping;
 
 namespace mapgen{
 	struct BlockMakeData;
@@ -55,6 +58,15 @@ namespace mapgen{
 #define MAPTYPE_SERVER 1
 #define MAPTYPE_CLIENT 2
 
+/*
+	Lock striping of block generation areas; see
+	ServerMap::lockBlockMakeArea().
+	Blocks are grouped into regions of BLOCKMAKE_REGION_SIZE^3 blocks and
+	each region is hashed to one of BLOCKMAKE_STRIPE_COUNT mutexes.
+*/
+#define BLOCKMAKE_REGION_SIZE 4
+#define BLOCKMAKE_STRIPE_COUNT 1024
+
 enum MapEditEventType{
 	// Node added (changed from air or something else to something)
 	MEET_ADDNODE,
@@ -156,7 +168,20 @@ class Map /*: public NodeContainer*/
 	// Returns InvalidPositionException if not found
 	MapBlock * getBlockNoCreate(v3s16 p);
 	// Returns NULL if not found
-	MapBlock * getBlockNoCreateNoEx(v3s16 p);
+	MapBlock * getBlockNoCreateNoEx(v3s16 p)
+	{
+		MapBlock **block = m_block_index.find(p);
+		if(block == NULL)
+			return NULL;
+		return *block;
+	}
+
+	/*
+		Called by MapSector when a block is added to or removed from it,
+		to keep the block index up to date
+	*/
+	void indexBlock(MapBlock *block);
+	void unindexBlock(v3s16 p);
 	
 	/* Server overrides */
 	virtual MapBlock * emergeBlock(v3s16 p, bool allow_generate=true)
@@ -247,6 +272,16 @@ class Map /*: public NodeContainer*/
 	*/
 	void timerUpdate(float dtime, float unload_timeout,
 			core::list<v3s16> *unloaded_blocks=NULL);
+
+	/*
+		Unloads the least recently used blocks until the loaded blocks
+		use at most memory_budget bytes. Blocks used within the last
+		min_unused_time seconds are kept even if over budget.
+		Saves modified blocks before unloading on MAPTYPE_SERVER.
+		Returns the number of unloaded blocks.
+	*/
+	u32 unloadToMemoryBudget(u64 memory_budget, float min_unused_time,
+			core::list<v3s16> *unloaded_blocks=NULL);
 		
 	// Deletes sectors and their blocks from memory
 	// Takes cache into account
@@ -278,6 +313,17 @@ class Map /*: public NodeContainer*/
 	void removeNodeMetadata(v3s16 p);
 	void nodeMetadataStep(float dtime,
 			core::map<v3s16, MapBlock*> &changed_blocks);
+
+	/*
+		Node timers
+		Coordinate wrappers to MapBlock, like the metadata ones
+	*/
+
+	// timeout <= 0 removes the timer
+	void setNodeTimer(v3s16 p, float timeout);
+	void removeNodeTimer(v3s16 p);
+	// Returns the time left, or -1 if there is no timer
+	float getNodeTimer(v3s16 p);
 	
 	/*
 		Misc.
@@ -302,6 +348,12 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
+	/*
+		All blocks in m_sectors by position. This is what block lookups
+		use; the sectors are kept for iterating and saving.
+	*/
+	BlockPosMap<MapBlock*> m_block_index;
+
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
 };
@@ -340,6 +392,19 @@ class ServerMap : public Map
 	void initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos);
 	MapBlock* finishBlockMake(mapgen::BlockMakeData *data,
 			core::map<v3s16, MapBlock*> &changed_blocks);
+
+	/*
+		The generation areas (the block and its neighbors) of blocks near
+		each other overlap, so they must not be generated at the same
+		time. Several threads can generate distant blocks in parallel by
+		locking the area with lockBlockMakeArea() before initBlockMake()
+		and unlocking it after finishBlockMake().
+
+		Call without envlock; the finishing thread needs it while holding
+		the area.
+	*/
+	void lockBlockMakeArea(v3s16 blockpos);
+	void unlockBlockMakeArea(v3s16 blockpos);
 	
 	// A non-threaded wrapper to the above
 	MapBlock * generateBlock(
@@ -366,9 +431,15 @@ class ServerMap : public Map
 	s16 findGroundLevel(v2s16 p2d);
 
 	// Call these before and after saving of blocks
+	// (no-ops; blocks are written in batches by the block saver)
 	void beginSave();
 	void endSave();
 
+	/*
+		Queues modified blocks for writing.
+		With MOD_STATE_WRITE_NEEDED, blocks that don't fit in the
+		save queue are left modified and saved at a later call.
+	*/
 	void save(ModifiedState save_level);
 	//void loadAll();
 	
@@ -408,6 +479,7 @@ class ServerMap : public Map
 	// Returns true if sector now resides in memory
 	//bool deFlushSector(v2s16 p2d);
 	
+	// Serializes the block and queues it to the block saver
 	void saveBlock(MapBlock *block);
 	// This will generate a sector with getSector if not found.
 	//void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
@@ -415,6 +487,31 @@ class ServerMap : public Map
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
+	/*
+		Loading of blocks without holding the environment lock.
+
+		loadBlockNoInsert() can be called without envlock. It reads the
+		block using a read-only database connection and deserializes it
+		into a new MapBlock that is not inserted into the map. The node
+		ids are left as they are on disk; their names are stored in
+		*nimap. Returns NULL if the block was not found or if it can't
+		be read or deserialized without envlock. In the former case
+		*not_found is set to true; otherwise fall back to loadBlock().
+
+		insertLoadedBlock() resolves the node names of the result and
+		inserts it into the map. Call with envlock. Returns NULL (and
+		deletes the block) if the loaded data may be outdated, ie. if
+		blocks have been saved since getBlockSaveCounter() was read
+		before loading, or if the block has appeared in memory. Fall
+		back to loadBlock() then.
+	*/
+	MapBlock* loadBlockNoInsert(v3s16 p, NameIdMapping *nimap,
+			bool *not_found=NULL);
+	MapBlock* insertLoadedBlock(MapBlock *block, const NameIdMapping &nimap,
+			u32 save_counter);
+	// Incremented on every saveBlock(); call with envlock
+	u32 getBlockSaveCounter(){ return m_block_save_counter; }
+
 	//block metadata
 	/*template<class Data> Data getBlockMeta(const v3s16& blockpos, const std::string& name)
 	{
@@ -469,6 +566,23 @@ class ServerMap : public Map
 	Table<std::string>& m_map_meta;
 	Table<v2s16,binary_t>& m_sectors_meta;
 	//Table<v3s16,binary_t>& m_blocks_meta;
+
+	// Writes the blocks to m_blocks in a background thread
+	BlockSaver *m_block_saver;
+	// See getBlockSaveCounter()
+	u32 m_block_save_counter;
+
+	/*
+		Read-only connections to the database for loadBlockNoInsert().
+		Connections not in use are stored here.
+	*/
+	core::list<Database*> m_readers;
+	JMutex m_readers_mutex;
+
+	// Returns the stripes covering the generation area of blockpos
+	// in ascending order; locking in this order prevents deadlocks
+	u32 getBlockMakeStripes(v3s16 blockpos, u32 *stripes);
+	JMutex m_blockmake_stripes[BLOCKMAKE_STRIPE_COUNT];
 };
 
 /*
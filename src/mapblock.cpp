@@ -46,6 +46,9 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_modified(MOD_STATE_WRITE_NEEDED),
 		m_modified_reason("initial"),
 		m_modified_reason_too_long(false),
+		m_network_cache_version(SER_FMT_VER_INVALID),
+		m_changes_unknown(true),
+		m_metadata_changed(false),
 		is_underground(false),
 		m_lighting_expired(true),
 		m_day_night_differs(false),
@@ -55,6 +58,11 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_usage_timer(0)
 {
 	data = NULL;
+	m_palette = NULL;
+	m_palette_size = 0;
+	m_indices = NULL;
+	m_index_bits = 0;
+	m_content_bits = NULL;
 	if(dummy == false)
 		reallocate();
 	
@@ -82,8 +90,253 @@ MapBlock::~MapBlock()
 
 	delete m_node_metadata;
 
-	if(data)
-		delete[] data;
+	freeNodes();
+}
+
+void MapBlock::freeNodes()
+{
+	delete[] data;
+	data = NULL;
+	delete[] m_palette;
+	m_palette = NULL;
+	m_palette_size = 0;
+	delete[] m_indices;
+	m_indices = NULL;
+	m_index_bits = 0;
+	delete[] m_content_bits;
+	m_content_bits = NULL;
+}
+
+void MapBlock::updateContentBits()
+{
+	assert(data != NULL && m_content_bits != NULL);
+	memset(m_content_bits, 0, CONTENT_BITMAP_WORDS * sizeof(u32));
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	content_t last = CONTENT_IGNORE;
+	contentBitmapSet(m_content_bits, last);
+	for(u32 i=0; i<nodecount; i++)
+	{
+		content_t c = data[i].getContent();
+		// Runs of the same content are common
+		if(c == last)
+			continue;
+		contentBitmapSet(m_content_bits, c);
+		last = c;
+	}
+}
+
+bool MapBlock::mayContainAny(const u32 *content_bits)
+{
+	if(data != NULL)
+	{
+		for(u32 j=0; j<CONTENT_BITMAP_WORDS; j++)
+			if(m_content_bits[j] & content_bits[j])
+				return true;
+		return false;
+	}
+	for(u32 j=0; j<m_palette_size; j++)
+		if(contentBitmapGet(content_bits, m_palette[j].getContent()))
+			return true;
+	return false;
+}
+
+u32 MapBlock::findNodesWithContent(const u32 *content_bits, u16 *dst)
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	u32 count = 0;
+	if(mayContainAny(content_bits) == false)
+		return 0;
+	if(data != NULL)
+	{
+		for(u32 i=0; i<nodecount; i++)
+			if(contentBitmapGet(content_bits, data[i].getContent()))
+				dst[count++] = i;
+		return count;
+	}
+	// Check the palette once, then only compare indices
+	bool wanted[MAPBLOCK_PALETTE_MAX];
+	for(u32 j=0; j<m_palette_size; j++)
+		wanted[j] = contentBitmapGet(content_bits, m_palette[j].getContent());
+	for(u32 i=0; i<nodecount; i++)
+		if(wanted[readIndex(i)])
+			dst[count++] = i;
+	return count;
+}
+
+void MapBlock::copyNodes(MapNode *dst)
+{
+	assert(isDummy() == false);
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(data != NULL)
+	{
+		for(u32 i=0; i<nodecount; i++)
+			dst[i] = data[i];
+	}
+	else if(m_index_bits == 0)
+	{
+		for(u32 i=0; i<nodecount; i++)
+			dst[i] = m_palette[0];
+	}
+	else
+	{
+		for(u32 i=0; i<nodecount; i++)
+			dst[i] = m_palette[readIndex(i)];
+	}
+}
+
+void MapBlock::expand()
+{
+	if(isCompact() == false)
+		return;
+	MapNode *nodes = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	copyNodes(nodes);
+	freeNodes();
+	data = nodes;
+	m_content_bits = new u32[CONTENT_BITMAP_WORDS];
+	updateContentBits();
+}
+
+void MapBlock::compact()
+{
+	// Dummy or already compact
+	if(data == NULL)
+		return;
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	/*
+		Find the distinct nodes and the index of each node
+	*/
+	MapNode palette[MAPBLOCK_PALETTE_MAX];
+	u32 palette_size = 0;
+	u8 *indices = new u8[nodecount];
+	u32 last = 0;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		const MapNode &n = data[i];
+		// Runs of the same node are common
+		if(palette_size != 0 && palette[last] == n)
+		{
+			indices[i] = last;
+			continue;
+		}
+		u32 j = 0;
+		while(j < palette_size && !(palette[j] == n))
+			j++;
+		if(j == palette_size)
+		{
+			// Too many different nodes
+			if(palette_size == MAPBLOCK_PALETTE_MAX)
+			{
+				delete[] indices;
+				return;
+			}
+			palette[palette_size++] = n;
+		}
+		indices[i] = j;
+		last = j;
+	}
+
+	u8 index_bits = 0;
+	while((1U << index_bits) < palette_size)
+		index_bits = (index_bits == 0) ? 1 : index_bits * 2;
+
+	freeNodes();
+
+	m_palette = new MapNode[1 << index_bits];
+	for(u32 j=0; j<palette_size; j++)
+		m_palette[j] = palette[j];
+	m_palette_size = palette_size;
+	m_index_bits = index_bits;
+	if(index_bits != 0)
+	{
+		m_indices = new u8[nodecount * index_bits / 8];
+		memset(m_indices, 0, nodecount * index_bits / 8);
+		for(u32 i=0; i<nodecount; i++)
+			writeIndex(i, indices[i]);
+	}
+
+	delete[] indices;
+}
+
+u32 MapBlock::getNodeMemoryUsage()
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(data != NULL)
+		return nodecount * sizeof(MapNode);
+	if(m_palette == NULL)
+		return 0;
+	return (1 << m_index_bits) * sizeof(MapNode)
+			+ nodecount * m_index_bits / 8;
+}
+
+void MapBlock::writeIndex(u32 i, u32 index)
+{
+	u32 bit = i * m_index_bits;
+	u32 shift = bit & 7;
+	u8 mask = ((1 << m_index_bits) - 1) << shift;
+	u8 &b = m_indices[bit >> 3];
+	b = (b & ~mask) | ((index << shift) & mask);
+}
+
+void MapBlock::repack(u8 index_bits)
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	MapNode *palette = new MapNode[1 << index_bits];
+	for(u32 j=0; j<m_palette_size; j++)
+		palette[j] = m_palette[j];
+
+	u8 *indices = new u8[nodecount * index_bits / 8];
+	memset(indices, 0, nodecount * index_bits / 8);
+
+	u8 *old_indices = m_indices;
+	u8 old_bits = m_index_bits;
+	m_indices = indices;
+	m_index_bits = index_bits;
+	if(old_bits != 0)
+	{
+		for(u32 i=0; i<nodecount; i++)
+		{
+			u32 bit = i * old_bits;
+			writeIndex(i, (old_indices[bit >> 3] >> (bit & 7))
+					& ((1 << old_bits) - 1));
+		}
+	}
+
+	delete[] old_indices;
+	delete[] m_palette;
+	m_palette = palette;
+}
+
+void MapBlock::writeNodeCompact(u32 i, const MapNode &n)
+{
+	u32 j = readIndex(i);
+	if(m_palette[j] == n)
+		return;
+
+	j = 0;
+	while(j < m_palette_size && !(m_palette[j] == n))
+		j++;
+
+	if(j == m_palette_size)
+	{
+		// Add to the palette, widening the indices if there is no room
+		if(m_palette_size == (1U << m_index_bits))
+		{
+			if(m_palette_size >= MAPBLOCK_PALETTE_WRITE_MAX)
+			{
+				expand();
+				data[i] = n;
+				return;
+			}
+			repack(m_index_bits == 0 ? 1 : m_index_bits * 2);
+		}
+		m_palette[j] = n;
+		m_palette_size++;
+	}
+
+	writeIndex(i, j);
 }
 
 bool MapBlock::isValidPositionParent(v3s16 p)
@@ -105,9 +358,9 @@ MapNode MapBlock::getNodeParent(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return readNode(nodeIndex(p.X, p.Y, p.Z));
 	}
 }
 
@@ -119,9 +372,9 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	}
 	else
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		writeNode(nodeIndex(p.X, p.Y, p.Z), n);
 	}
 }
 
@@ -139,11 +392,11 @@ MapNode MapBlock::getNodeParentNoEx(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
+		if(isDummy())
 		{
 			return MapNode(CONTENT_IGNORE);
 		}
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return readNode(nodeIndex(p.X, p.Y, p.Z));
 	}
 }
 
@@ -324,7 +577,8 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 			for(; y >= 0; y--)
 			{
 				v3s16 pos(x, y, z);
-				MapNode &n = getNodeRef(pos);
+				u32 i = nodeIndex(x, y, z);
+				MapNode n = readNode(i);
 				
 				if(current_light == 0)
 				{
@@ -353,6 +607,7 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 				if(current_light > old_light || remove_light)
 				{
 					n.setLight(LIGHTBANK_DAY, current_light, nodemgr);
+					writeNode(i, n);
 				}
 				
 				if(diminish_light(current_light) != 0)
@@ -415,8 +670,18 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
 	// Copy from data to VoxelManipulator
-	dst.copyFrom(data, data_area, v3s16(0,0,0),
+	if(data != NULL)
+	{
+		dst.copyFrom(data, data_area, v3s16(0,0,0),
+				getPosRelative(), data_size);
+		return;
+	}
+	// Compact; unpack to a temporary buffer
+	MapNode *nodes = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	copyNodes(nodes);
+	dst.copyFrom(nodes, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+	delete[] nodes;
 }
 
 void MapBlock::copyFrom(VoxelManipulator &dst)
@@ -424,29 +689,48 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
+	expand();
+
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+	updateContentBits();
+	clearNetworkCache();
+	// Everything may have changed
+	m_changed_nodes.clear();
+	m_changes_unknown = true;
 }
 
 void MapBlock::updateDayNightDiff()
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL)
+	if(isDummy())
 	{
 		m_day_night_differs = false;
 		return;
 	}
 
+	/*
+		A compact block only needs its palette checked. Unused palette
+		entries can only make this report differing lighting needlessly.
+	*/
+	MapNode *nodes = data;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(nodes == NULL)
+	{
+		nodes = m_palette;
+		nodecount = m_palette_size;
+	}
+
 	bool differs = false;
 
 	/*
 		Check if any lighting value differs
 	*/
-	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	for(u32 i=0; i<nodecount; i++)
 	{
-		MapNode &n = data[i];
+		MapNode &n = nodes[i];
 		if(n.getLight(LIGHTBANK_DAY, nodemgr) != n.getLight(LIGHTBANK_NIGHT, nodemgr))
 		{
 			differs = true;
@@ -461,9 +745,9 @@ void MapBlock::updateDayNightDiff()
 	if(differs)
 	{
 		bool only_air = true;
-		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+		for(u32 i=0; i<nodecount; i++)
 		{
-			MapNode &n = data[i];
+			MapNode &n = nodes[i];
 			if(n.getContent() != CONTENT_AIR)
 			{
 				only_air = false;
@@ -475,6 +759,8 @@ void MapBlock::updateDayNightDiff()
 	}
 
 	// Set member variable
+	if(differs != m_day_night_differs)
+		clearNetworkCache();
 	m_day_night_differs = differs;
 }
 
@@ -487,7 +773,7 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNodeNoCheck(p2d.X, y, p2d.Y);
 			if(m_gamedef->ndef()->get(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -504,9 +790,61 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 	}
 }
 
+void MapBlock::startNodeMetadataTimers()
+{
+	core::list<v3s16> positions;
+	m_node_metadata->getPositions(positions);
+	for(core::list<v3s16>::Iterator i = positions.begin();
+			i != positions.end(); i++)
+	{
+		float interval = m_node_metadata->get(*i)->getStepInterval();
+		if(interval > 0)
+			m_node_timers.set(*i, interval);
+	}
+}
+
+bool MapBlock::takeChangedNodes(core::array<u16> &dst,
+		bool *metadata_changed)
+{
+	*metadata_changed = m_metadata_changed;
+	m_metadata_changed = false;
+	bool known = !m_changes_unknown;
+	if(known)
+	{
+		for(u32 i=0; i<m_changed_nodes.size(); i++)
+			dst.push_back(m_changed_nodes[i]);
+	}
+	m_changed_nodes.clear();
+	m_changes_unknown = false;
+	return known;
+}
+
 /*
 	Serialization
 */
+
+u8 MapBlock::serializeFlags()
+{
+	u8 flags = 0;
+	if(is_underground)
+		flags |= 0x01;
+	if(m_day_night_differs)
+		flags |= 0x02;
+	if(m_lighting_expired)
+		flags |= 0x04;
+	if(m_generated == false)
+		flags |= 0x08;
+	return flags;
+}
+
+void MapBlock::deSerializeFlags(u8 flags)
+{
+	is_underground = (flags & 0x01) ? true : false;
+	m_day_night_differs = (flags & 0x02) ? true : false;
+	m_lighting_expired = (flags & 0x04) ? true : false;
+	m_generated = (flags & 0x08) ? false : true;
+}
+
 // List relevant id-name pairs for ids in the block using nodedef
 // Renumbers the content IDs (starting at 0 and incrementing
 static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
@@ -604,7 +942,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -616,16 +954,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	}
 
 	// First byte
-	u8 flags = 0;
-	if(is_underground)
-		flags |= 0x01;
-	if(m_day_night_differs)
-		flags |= 0x02;
-	if(m_lighting_expired)
-		flags |= 0x04;
-	if(m_generated == false)
-		flags |= 0x08;
-	writeU8(os, flags);
+	writeU8(os, serializeFlags());
 	
 	/*
 		Bulk node data
@@ -635,8 +964,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	if(disk)
 	{
 		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
+		copyNodes(tmp_nodes);
 		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
 
 		u8 content_width = 1;
@@ -655,8 +983,16 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		u8 params_width = 2;
 		writeU8(os, content_width);
 		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
+		MapNode *nodes = data;
+		if(nodes == NULL)
+		{
+			nodes = new MapNode[nodecount];
+			copyNodes(nodes);
+		}
+		MapNode::serializeBulk(os, version, nodes, nodecount,
 				content_width, params_width, true);
+		if(nodes != data)
+			delete[] nodes;
 	}
 	
 	/*
@@ -679,26 +1015,30 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 
 		// Write block-specific node definition id mapping
 		nimap.serialize(os);
+
+		// Node timers
+		if(version >= 23)
+			m_node_timers.serialize(os);
 	}
 }
 
 
-void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
+void MapBlock::deSerialize(std::istream &is, u8 version, bool disk,
+		NameIdMapping *nimap)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
 	if(version <= 21)
 	{
+		// The legacy conversions need ndef
+		assert(nimap == NULL);
 		deSerialize_pre22(is, version, disk);
+		forgetChangedNodes();
 		return;
 	}
 
-	u8 flags = readU8(is);
-	is_underground = (flags & 0x01) ? true : false;
-	m_day_night_differs = (flags & 0x02) ? true : false;
-	m_lighting_expired = (flags & 0x04) ? true : false;
-	m_generated = (flags & 0x08) ? false : true;
+	deSerializeFlags(readU8(is));
 
 	/*
 		Bulk node data
@@ -710,6 +1050,7 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		throw SerializationError("MapBlock::deSerialize(): invalid content_width");
 	if(params_width != 2)
 		throw SerializationError("MapBlock::deSerialize(): invalid params_width");
+	expand();
 	MapNode::deSerializeBulk(is, version, data, nodecount,
 			content_width, params_width, true);
 
@@ -741,11 +1082,31 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		setTimestamp(readU32(is));
 		m_disk_timestamp = m_timestamp;
 		
-		// Dynamically re-set ids based on node names
-		NameIdMapping nimap;
-		nimap.deSerialize(is);
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		// Dynamically re-set ids based on node names,
+		// or leave it to the caller
+		NameIdMapping block_nimap;
+		block_nimap.deSerialize(is);
+		if(nimap)
+			*nimap = block_nimap;
+		else
+			correctBlockNodeIds(&block_nimap, data, m_gamedef);
+
+		// Node timers
+		if(version >= 23)
+			m_node_timers.deSerialize(is);
+		else
+			startNodeMetadataTimers();
 	}
+
+	updateContentBits();
+	forgetChangedNodes();
+}
+
+void MapBlock::correctNodeIds(const NameIdMapping &nimap)
+{
+	expand();
+	correctBlockNodeIds(&nimap, data, m_gamedef);
+	updateContentBits();
 }
 
 /*
@@ -780,6 +1141,7 @@ void MapBlock::serialize_pre22(std::ostream &os, u8 version, bool disk)
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 
 	MapNode *tmp_data = new MapNode[nodecount];
+	copyNodes(tmp_data);
 	
 	// Legacy data changes
 	// This code has to change from post-22 to pre-22 format.
@@ -959,7 +1321,10 @@ void MapBlock::serialize_pre22(std::ostream &os, u8 version, bool disk)
 		if(version >= 21)
 		{
 			NameIdMapping nimap;
-			getBlockNodeIdMapping_pre22(&nimap, data, m_gamedef->ndef());
+			MapNode *nodes = new MapNode[nodecount];
+			copyNodes(nodes);
+			getBlockNodeIdMapping_pre22(&nimap, nodes, m_gamedef->ndef());
+			delete[] nodes;
 			nimap.serialize(os);
 		}
 	}
@@ -975,6 +1340,8 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 	m_lighting_expired = false;
 	m_generated = true;
 
+	expand();
+
 	// Make a temporary buffer
 	u32 ser_length = MapNode::serializedLength(version);
 	SharedBuffer<u8> databuf_nodelist(nodecount * ser_length);
@@ -1116,6 +1483,7 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 			if(count != 0){
 				errorstream<<"WARNING: MapBlock::deSerialize_pre22(): "
 						<<"Ignoring stuff coming at and after MBOs"<<std::endl;
+				updateContentBits();
 				return;
 			}
 		}
@@ -1144,6 +1512,8 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 			content_mapnode_get_name_id_mapping(&nimap);
 		}
 		correctBlockNodeIds(&nimap, data, m_gamedef);
+
+		startNodeMetadataTimers();
 	}
 
 
@@ -1190,6 +1560,7 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 		}
 	}
 
+	updateContentBits();
 }
 
 /*
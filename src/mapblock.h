@@ -31,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "constants.h"
 #include "voxel.h"
 #include "staticobject.h"
+#include "nodetimer.h"
 #include "mapblock_nodemod.h"
 #include "modifiedstate.h"
 
@@ -38,9 +39,29 @@ class Map;
 class NodeMetadataList;
 class IGameDef;
 class IWritableNodeDefManager;
+class NameIdMapping;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
+// Maximum number of distinct nodes in a compacted block
+#define MAPBLOCK_PALETTE_MAX 256
+// Setting nodes grows the palette up to this, then the block is expanded
+#define MAPBLOCK_PALETTE_WRITE_MAX 16
+// Changed nodes tracked for sending deltas; more make the block sent whole
+#define MAPBLOCK_CHANGES_MAX 256
+// Number of u32 words in a content bitmap (one bit per content id)
+#define CONTENT_BITMAP_WORDS ((MAX_CONTENT+1)/32)
+
+inline void contentBitmapSet(u32 *bits, content_t c)
+{
+	bits[c >> 5] |= (u32)1 << (c & 31);
+}
+
+inline bool contentBitmapGet(const u32 *bits, content_t c)
+{
+	return (bits[c >> 5] & ((u32)1 << (c & 31))) != 0;
+}
+
 /*// Named by looking towards z+
 enum{
 	FACE_BACK=0,
@@ -118,26 +139,67 @@ class MapBlock /*: public NodeContainer*/
 		return m_parent;
 	}
 
+	// Fills the block with CONTENT_IGNORE
 	void reallocate()
 	{
-		if(data != NULL)
-			delete[] data;
-		u32 l = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
-		data = new MapNode[l];
-		for(u32 i=0; i<l; i++){
-			//data[i] = MapNode();
-			data[i] = MapNode(CONTENT_IGNORE);
-		}
+		freeNodes();
+		// Stored compactly as a single node until something else is set
+		m_palette = new MapNode[1];
+		m_palette[0] = MapNode(CONTENT_IGNORE);
+		m_palette_size = 1;
+		m_index_bits = 0;
+		clearNetworkCache();
 		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
 	}
 
+	/*
+		Node storage (see the member variables)
+	*/
+
+	// Converts the nodes to the smallest storage they fit in
+	void compact();
+	// Converts the nodes to the full array
+	void expand();
+	bool isCompact()
+	{
+		return (data == NULL && m_palette != NULL);
+	}
+	// Memory used for storing the nodes, in bytes
+	u32 getNodeMemoryUsage();
+	// Approximate memory used by the whole block, in bytes
+	u32 getMemoryUsage()
+	{
+		return sizeof(MapBlock) + getNodeMemoryUsage()
+				+ m_network_cache.capacity();
+	}
+	// Copies all nodes to dst, which has room for MAP_BLOCKSIZE^3 nodes
+	void copyNodes(MapNode *dst);
+
+	/*
+		Content lookup.
+		content_bits is a bitmap of CONTENT_BITMAP_WORDS words.
+		These may give false positives for contents that have been
+		replaced since the block was loaded or compacted, but never
+		miss a content that is present.
+	*/
+
+	// Returns false if none of the contents can be in the block
+	bool mayContainAny(const u32 *content_bits);
+	/*
+		Stores the indices (z*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+		+ y*MAP_BLOCKSIZE + x) of the nodes having one of the contents
+		to dst, which has room for MAP_BLOCKSIZE^3 indices.
+		Returns the number of indices stored.
+	*/
+	u32 findNodesWithContent(const u32 *content_bits, u16 *dst);
+
 	/*
 		Flags
 	*/
 
 	bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && m_palette == NULL);
 	}
 	void unDummify()
 	{
@@ -146,6 +208,7 @@ class MapBlock /*: public NodeContainer*/
 	}
 	
 	// m_modified methods
+	// Changes of the data sent to clients also call clearNetworkCache()
 	void raiseModified(u32 mod, const std::string &reason="unknown")
 	{
 		if(mod > m_modified){
@@ -181,6 +244,59 @@ class MapBlock /*: public NodeContainer*/
 		m_modified_reason = "none";
 		m_modified_reason_too_long = false;
 	}
+
+	/*
+		Network serialization cache.
+		The server sends the same data to every client that uses the
+		same serialization version, so it is serialized only once.
+		Dropped whenever the data sent to clients changes (nodes, flags,
+		node metadata) and when the block becomes inactive; not for
+		changes that only go to disk (timestamps, timers, objects).
+		Counted in getMemoryUsage().
+	*/
+	// Returns NULL if nothing is cached for the version
+	const std::string * getNetworkCache(u8 version)
+	{
+		if(m_network_cache_version != version)
+			return NULL;
+		return &m_network_cache;
+	}
+	void setNetworkCache(u8 version, const std::string &data)
+	{
+		m_network_cache = data;
+		m_network_cache_version = version;
+	}
+	void clearNetworkCache()
+	{
+		if(m_network_cache_version == SER_FMT_VER_INVALID)
+			return;
+		m_network_cache_version = SER_FMT_VER_INVALID;
+		// Free the memory
+		std::string().swap(m_network_cache);
+	}
+
+	/*
+		Tracking of changed nodes, for sending only the changes to the
+		clients that already have the block.
+
+		Gets the indices of the nodes changed since the last call and
+		forgets them. Returns false if the changes are not known (too
+		many changes or the whole data has been replaced); the whole
+		block has to be sent then.
+		*metadata_changed is set if node metadata has been set or
+		removed since the last call.
+	*/
+	bool takeChangedNodes(core::array<u16> &dst, bool *metadata_changed);
+	// Called when node metadata is set or removed
+	void noteMetadataChanged()
+	{
+		clearNetworkCache();
+		m_metadata_changed = true;
+	}
+
+	// The first byte of the serialized block (version >= 22)
+	u8 serializeFlags();
+	void deSerializeFlags(u8 flags);
 	
 	// is_underground getter/setter
 	bool getIsUnderground()
@@ -190,6 +306,7 @@ class MapBlock /*: public NodeContainer*/
 	void setIsUnderground(bool a_is_underground)
 	{
 		is_underground = a_is_underground;
+		clearNetworkCache();
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setIsUnderground");
 	}
 
@@ -209,6 +326,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(expired != m_lighting_expired){
 			m_lighting_expired = expired;
+			clearNetworkCache();
 			raiseModified(MOD_STATE_WRITE_NEEDED, "setLightingExpired");
 		}
 	}
@@ -226,6 +344,7 @@ class MapBlock /*: public NodeContainer*/
 		if(b != m_generated){
 			raiseModified(MOD_STATE_WRITE_NEEDED, "setGenerated");
 			m_generated = b;
+			clearNetworkCache();
 		}
 	}
 
@@ -233,7 +352,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -266,7 +385,7 @@ class MapBlock /*: public NodeContainer*/
 	
 	bool isValidPosition(v3s16 p)
 	{
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return (p.X >= 0 && p.X < MAP_BLOCKSIZE
 				&& p.Y >= 0 && p.Y < MAP_BLOCKSIZE
@@ -275,12 +394,12 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNode(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return readNode(nodeIndex(x, y, z));
 	}
 	
 	MapNode getNode(v3s16 p)
@@ -299,12 +418,12 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		writeNode(nodeIndex(x, y, z), n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -319,9 +438,9 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNodeNoCheck(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return readNode(nodeIndex(x, y, z));
 	}
 	
 	MapNode getNodeNoCheck(v3s16 p)
@@ -331,9 +450,9 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		writeNode(nodeIndex(x, y, z), n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -470,6 +589,12 @@ class MapBlock /*: public NodeContainer*/
 	*/
 	s16 getGroundLevel(v2s16 p2d);
 
+	/*
+		Starts node timers for the node metadata that needs stepping.
+		Used for blocks saved before node timers existed.
+	*/
+	void startNodeMetadataTimers();
+
 	/*
 		Timestamp (see m_timestamp)
 		NOTE: BLOCK_TIMESTAMP_UNDEFINED=0xffffffff means there is no timestamp.
@@ -503,7 +628,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		m_usage_timer += dtime;
 	}
-	u32 getUsageTimer()
+	float getUsageTimer()
 	{
 		return m_usage_timer;
 	}
@@ -517,7 +642,14 @@ class MapBlock /*: public NodeContainer*/
 	void serialize(std::ostream &os, u8 version, bool disk);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
-	void deSerialize(std::istream &is, u8 version, bool disk);
+	// If nimap != NULL (only for disk == true and version >= 22), the
+	// node ids are left as they are on disk and their id-name mapping
+	// is stored in *nimap instead. correctNodeIds() must then be called
+	// with envlock before the block is used; ndef is not touched here.
+	void deSerialize(std::istream &is, u8 version, bool disk,
+			NameIdMapping *nimap=NULL);
+	// Sets the node ids to match ndef; see deSerialize()
+	void correctNodeIds(const NameIdMapping &nimap);
 
 private:
 	/*
@@ -528,22 +660,81 @@ class MapBlock /*: public NodeContainer*/
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
 
 	/*
-		Used only internally, because changes can't be tracked
+		Node storage access; used only internally, because changes
+		can't be tracked. The block must not be a dummy.
 	*/
 
-	MapNode & getNodeRef(s16 x, s16 y, s16 z)
+	static u32 nodeIndex(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x;
+	}
+
+	u32 readIndex(u32 i)
+	{
+		if(m_index_bits == 0)
+			return 0;
+		u32 bit = i * m_index_bits;
+		return (m_indices[bit >> 3] >> (bit & 7))
+				& ((1 << m_index_bits) - 1);
+	}
+
+	MapNode readNode(u32 i)
+	{
+		if(data != NULL)
+			return data[i];
+		return m_palette[readIndex(i)];
+	}
+
+	void writeNode(u32 i, const MapNode &n)
+	{
+		clearNetworkCache();
+		noteNodeChanged(i);
+
+		if(data != NULL)
+		{
+			data[i] = n;
+			contentBitmapSet(m_content_bits, n.getContent());
+		}
+		else
+		{
+			writeNodeCompact(i, n);
+		}
+	}
+
+	void writeNodeCompact(u32 i, const MapNode &n);
+	void writeIndex(u32 i, u32 index);
+
+	/*
+		Called when the block has been loaded; the clients that have
+		the block have the same data as was saved.
+	*/
+	void forgetChangedNodes()
+	{
+		m_changed_nodes.clear();
+		m_changes_unknown = false;
 	}
-	MapNode & getNodeRef(v3s16 &p)
+
+	void noteNodeChanged(u32 i)
 	{
-		return getNodeRef(p.X, p.Y, p.Z);
+		if(m_changes_unknown)
+			return;
+		u32 count = m_changed_nodes.size();
+		// Cheap check for setting the same node repeatedly
+		if(count != 0 && m_changed_nodes[count-1] == i)
+			return;
+		if(count >= MAPBLOCK_CHANGES_MAX)
+		{
+			m_changes_unknown = true;
+			m_changed_nodes.clear();
+			return;
+		}
+		m_changed_nodes.push_back(i);
 	}
+	// Changes the index width, keeping the contents
+	void repack(u8 index_bits);
+	void freeNodes();
+	// Rebuilds m_content_bits from data
+	void updateContentBits();
 
 public:
 	/*
@@ -557,6 +748,7 @@ class MapBlock /*: public NodeContainer*/
 	
 	NodeMetadataList *m_node_metadata;
 	StaticObjectList m_static_objects;
+	NodeTimerList m_node_timers;
 	
 private:
 	/*
@@ -571,10 +763,33 @@ class MapBlock /*: public NodeContainer*/
 	IGameDef *m_gamedef;
 	
 	/*
-		If NULL, block is a dummy block.
+		The nodes are stored in one of these ways:
+		- Full: data holds all MAP_BLOCKSIZE^3 nodes.
+		- Palette: data is NULL, m_palette holds the distinct nodes and
+		  m_indices the palette index of each node, packed to
+		  m_index_bits (1, 2, 4 or 8) bits.
+		- Uniform: like palette, but m_index_bits is 0 and the only
+		  node is m_palette[0]. New blocks start like this.
+		Setting a node that is not in the palette grows the palette
+		up to MAPBLOCK_PALETTE_WRITE_MAX nodes and then expands the block
+		to full. compact() converts back.
+
+		If both data and m_palette are NULL, block is a dummy block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode * data;
+	MapNode * m_palette;
+	// Number of used entries; the palette has room for 1<<m_index_bits
+	u16 m_palette_size;
+	u8 * m_indices;
+	u8 m_index_bits;
+	/*
+		Bitmap of the contents in data; allocated together with data.
+		Bits are only set when writing, so removed contents may
+		remain set until the next updateContentBits().
+		Compact blocks use the palette instead.
+	*/
+	u32 * m_content_bits;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -585,6 +800,18 @@ class MapBlock /*: public NodeContainer*/
 	std::string m_modified_reason;
 	bool m_modified_reason_too_long;
 
+	// See getNetworkCache()
+	std::string m_network_cache;
+	u8 m_network_cache_version;
+
+	/*
+		Indices of the nodes changed since the last takeChangedNodes().
+		If m_changes_unknown is true, the list is not used.
+	*/
+	core::array<u16> m_changed_nodes;
+	bool m_changes_unknown;
+	bool m_metadata_changed;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
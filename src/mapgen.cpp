@@ -26,6 +26,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_sao.h"
 #include "nodedef.h"
 #include "content_mapnode.h" // For content_mapnode_get_new_name
+#include "main.h" // For g_profiler
+#include "profiler.h"
+#include <jmutex.h>
+#include <jmutexautolock.h>
 
 namespace mapgen
 {
@@ -81,13 +85,15 @@ static s16 find_ground_level_clever(VoxelManipulator &vmanip, v2s16 p2d)
 #endif
 
 void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
-		bool is_apple_tree, INodeDefManager *ndef)
+		bool is_apple_tree, INodeDefManager *ndef, int seed)
 {
 	MapNode treenode(LEGN(ndef, "CONTENT_TREE"));
 	MapNode leavesnode(LEGN(ndef, "CONTENT_LEAVES"));
 	MapNode applenode(LEGN(ndef, "CONTENT_APPLE"));
 	
-	s16 trunk_h = myrand_range(4, 5);
+	PseudoRandom random(seed);
+
+	s16 trunk_h = random.range(4, 5);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -122,9 +128,9 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -150,7 +156,7 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
 			continue;
 		u32 i = leaves_a.index(x,y,z);
 		if(leaves_d[i] == 1) {
-			bool is_apple = myrand_range(0,99) < 10;
+			bool is_apple = random.range(0,99) < 10;
 			if(is_apple_tree && is_apple) {
 				vmanip.m_data[vi] = applenode;
 			} else {
@@ -161,15 +167,17 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
 }
 
 static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0,
-		INodeDefManager *ndef)
+		INodeDefManager *ndef, int seed)
 {
 	MapNode treenode(LEGN(ndef, "CONTENT_JUNGLETREE"));
 	MapNode leavesnode(LEGN(ndef, "CONTENT_LEAVES"));
 
+	PseudoRandom random(seed);
+
 	for(s16 x=-1; x<=1; x++)
 	for(s16 z=-1; z<=1; z++)
 	{
-		if(myrand_range(0, 2) == 0)
+		if(random.range(0, 2) == 0)
 			continue;
 		v3s16 p1 = p0 + v3s16(x,0,z);
 		v3s16 p2 = p0 + v3s16(x,-1,z);
@@ -180,7 +188,7 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0,
 			vmanip.m_data[vmanip.m_area.index(p1)] = treenode;
 	}
 
-	s16 trunk_h = myrand_range(8, 12);
+	s16 trunk_h = random.range(8, 12);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -215,9 +223,9 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0,
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -248,11 +256,13 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0,
 }
 
 void make_papyrus(VoxelManipulator &vmanip, v3s16 p0,
-		INodeDefManager *ndef)
+		INodeDefManager *ndef, int seed)
 {
 	MapNode papyrusnode(LEGN(ndef, "CONTENT_PAPYRUS"));
 
-	s16 trunk_h = myrand_range(2, 3);
+	PseudoRandom random(seed);
+
+	s16 trunk_h = random.range(2, 3);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -1106,23 +1116,49 @@ bool is_cave(u64 seed, v3s16 p)
 	      and buffered
 		  NOTE: The speed of these actually isn't terrible
 */
-bool val_is_ground(double ground_noise1_val, v3s16 p, u64 seed)
-{
-	//return ((double)p.Y < ground_noise1_val);
 
-	double f = 0.55 + noise2d_perlin(
-			0.5+(float)p.X/250, 0.5+(float)p.Z/250,
-			seed+920381, 3, 0.45);
+// Ground density scale and height of a column; see val_is_ground()
+static double ground_factor_from_noise(double noise)
+{
+	double f = 0.55 + noise;
 	if(f < 0.01)
 		f = 0.01;
 	else if(f >= 1.0)
 		f *= 1.6;
-	double h = WATER_LEVEL + 10 * noise2d_perlin(
-			0.5+(float)p.X/250, 0.5+(float)p.Z/250,
-			seed+84174, 4, 0.5);
+	return f;
+}
+static double ground_height_from_noise(double noise)
+{
+	return WATER_LEVEL + 10 * noise;
+}
+
+static void get_column_ground_params(u64 seed, v2s16 p2d,
+		double &factor, double &height)
+{
+	factor = ground_factor_from_noise(noise2d_perlin(
+			0.5+(float)p2d.X/250, 0.5+(float)p2d.Y/250,
+			seed+920381, 3, 0.45));
+	height = ground_height_from_noise(noise2d_perlin(
+			0.5+(float)p2d.X/250, 0.5+(float)p2d.Y/250,
+			seed+84174, 4, 0.5));
+}
+
+// val_is_ground() with the 2D values of the column already known
+static bool val_is_ground_column(double ground_noise1_val, s16 y,
+		double factor, double height)
+{
+	return ((double)y - height < ground_noise1_val * factor);
+}
+
+bool val_is_ground(double ground_noise1_val, v3s16 p, u64 seed)
+{
+	//return ((double)p.Y < ground_noise1_val);
+
+	double f, h;
+	get_column_ground_params(seed, v2s16(p.X, p.Z), f, h);
 	/*double f = 1;
 	double h = 0;*/
-	return ((double)p.Y - h < ground_noise1_val * f);
+	return val_is_ground_column(ground_noise1_val, p.Y, f, h);
 }
 
 /*
@@ -1192,11 +1228,28 @@ double largestone_amount_2d(u64 seed, v2s16 p)
 /*
 	Incrementally find ground level from 3d noise
 */
+static s16 find_ground_level_in_column(u64 seed, v2s16 p2d, s16 precision,
+		double factor, double height);
+
 s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 {
+	double f, h;
+	get_column_ground_params(seed, p2d, f, h);
+	return find_ground_level_in_column(seed, p2d, precision, f, h);
+}
+
+// factor and height are the 2D values of the column
+static s16 find_ground_level_in_column(u64 seed, v2s16 p2d, s16 precision,
+		double factor, double height)
+{
+	NoiseParams ground_noise1 = get_ground_noise1_params(seed);
+
 	// Start a bit fuzzy to make averaging lower precision values
-	// more useful
-	s16 level = myrand_range(-precision/2, precision/2);
+	// more useful. The fuzz depends only on the position so that this
+	// can be called from several threads at once.
+	PseudoRandom random((int)((u32)seed + (u32)p2d.X*73856093
+			+ (u32)p2d.Y*19349663));
+	s16 level = random.range(-precision/2, precision/2);
 	s16 dec[] = {31000, 100, 20, 4, 1, 0};
 	s16 i;
 	for(i = 1; dec[i] != 0 && precision <= dec[i]; i++)
@@ -1208,7 +1261,8 @@ s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 			v3s16 p(p2d.X, level, p2d.Y);
 			for(; p.Y < max; p.Y += dec[i])
 			{
-				if(!is_ground(seed, p))
+				if(!val_is_ground_column(noise3d_param(ground_noise1,
+						p.X, p.Y, p.Z), p.Y, factor, height))
 				{
 					level = p.Y;
 					break;
@@ -1222,7 +1276,8 @@ s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 			v3s16 p(p2d.X, level, p2d.Y);
 			for(; p.Y>min; p.Y-=dec[i])
 			{
-				bool ground = is_ground(seed, p);
+				bool ground = val_is_ground_column(noise3d_param(ground_noise1,
+						p.X, p.Y, p.Z), p.Y, factor, height);
 				/*if(dec[i] == 1 && is_cave(seed, p))
 					ground = false;*/
 				if(ground)
@@ -1240,93 +1295,188 @@ s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 	return level;
 }
 
-double get_sector_average_ground_level(u64 seed, v2s16 sectorpos, double p=4);
+/*
+	Sector noise cache
+*/
+
+// Maximum number of sectors in the cache
+#define SECTOR_NOISE_CACHE_SIZE 512
+
+class SectorNoiseCache
+{
+public:
+	SectorNoiseCache()
+	{
+		m_mutex.Init();
+	}
+
+	~SectorNoiseCache()
+	{
+		for(core::map<v2s16, SectorNoise*>::Iterator
+				i = m_sectors.getIterator();
+				i.atEnd() == false; i++)
+		{
+			delete i.getNode()->getValue();
+		}
+	}
+
+	// Returns false if not found
+	bool get(u64 seed, v2s16 sectorpos, SectorNoise &dst)
+	{
+		JMutexAutoLock lock(m_mutex);
+		core::map<v2s16, SectorNoise*>::Node *n = m_sectors.find(sectorpos);
+		if(n == NULL || n->getValue()->seed != seed)
+			return false;
+		dst = *n->getValue();
+		return true;
+	}
+
+	void put(const SectorNoise &src)
+	{
+		JMutexAutoLock lock(m_mutex);
+		core::map<v2s16, SectorNoise*>::Node *n = m_sectors.find(src.pos);
+		if(n != NULL)
+		{
+			// Computed by another thread or for another seed
+			*n->getValue() = src;
+			return;
+		}
+		m_sectors.insert(src.pos, new SectorNoise(src));
+		m_order.push_back(src.pos);
+
+		// Drop the oldest ones
+		while(m_order.size() > SECTOR_NOISE_CACHE_SIZE)
+		{
+			core::list<v2s16>::Iterator i = m_order.begin();
+			core::map<v2s16, SectorNoise*>::Node *n = m_sectors.find(*i);
+			assert(n);
+			delete n->getValue();
+			m_sectors.remove(*i);
+			m_order.erase(i);
+		}
+	}
+
+private:
+	core::map<v2s16, SectorNoise*> m_sectors;
+	// Insertion order of m_sectors
+	core::list<v2s16> m_order;
+	JMutex m_mutex;
+};
+
+static SectorNoiseCache g_sector_noise_cache;
+
+static s16 sector_ground_level(const SectorNoise &sn, v2s16 p2d,
+		s16 precision)
+{
+	u32 i = sn.columnIndex(p2d);
+	return find_ground_level_in_column(sn.seed, p2d, precision,
+			sn.ground_factor[i], sn.ground_height[i]);
+}
 
-double get_sector_average_ground_level(u64 seed, v2s16 sectorpos, double p)
+static void compute_sector_noise(u64 seed, v2s16 sectorpos, SectorNoise &sn)
 {
+	sn.seed = seed;
+	sn.pos = sectorpos;
+
 	v2s16 node_min = sectorpos*MAP_BLOCKSIZE;
 	v2s16 node_max = (sectorpos+v2s16(1,1))*MAP_BLOCKSIZE-v2s16(1,1);
+
+	/*
+		2D noise of the columns.
+		The coordinates are the same as in the point versions.
+	*/
+	const u32 count = MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	double x250[count], z250[count];
+	double x500[count], z500[count];
+	for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+	for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+	{
+		v2s16 p2d = node_min + v2s16(x,z);
+		u32 i = sn.columnIndex(p2d);
+		x250[i] = 0.5+(float)p2d.X/250;
+		z250[i] = 0.5+(float)p2d.Y/250;
+		x500[i] = 0.5+(float)p2d.X/500;
+		z500[i] = 0.5+(float)p2d.Y/500;
+	}
+
+	double noise[count];
+	noise2d_perlin_batch(x250, z250, count, seed+920381, 3, 0.45, false,
+			noise);
+	for(u32 i=0; i<count; i++)
+		sn.ground_factor[i] = ground_factor_from_noise(noise[i]);
+	noise2d_perlin_batch(x250, z250, count, seed+84174, 4, 0.5, false,
+			noise);
+	for(u32 i=0; i<count; i++)
+		sn.ground_height[i] = ground_height_from_noise(noise[i]);
+	// See get_have_sand()
+	noise2d_perlin_batch(x500, z500, count, seed+59420, 3, 0.50, false,
+			noise);
+	for(u32 i=0; i<count; i++)
+		sn.have_sand[i] = (noise[i] > -0.15);
+	noise2d_perlin_batch(x500, z500, count, seed+4321, 6, 0.95, false,
+			noise);
+	for(u32 i=0; i<count; i++)
+		sn.clay[i] = noise[i] + 0.5;
+
+	/*
+		Ground levels at some points of the sector
+	*/
+	v2s16 center(node_min.X+MAP_BLOCKSIZE/2, node_min.Y+MAP_BLOCKSIZE/2);
+
 	double a = 0;
-	a += find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_min.Y), p);
-	a += find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_max.Y), p);
-	a += find_ground_level_from_noise(seed,
-			v2s16(node_max.X, node_max.Y), p);
-	a += find_ground_level_from_noise(seed,
-			v2s16(node_max.X, node_min.Y), p);
-	a += find_ground_level_from_noise(seed,
-			v2s16(node_min.X+MAP_BLOCKSIZE/2, node_min.Y+MAP_BLOCKSIZE/2), p);
+	a += sector_ground_level(sn, v2s16(node_min.X, node_min.Y), 4);
+	a += sector_ground_level(sn, v2s16(node_min.X, node_max.Y), 4);
+	a += sector_ground_level(sn, v2s16(node_max.X, node_max.Y), 4);
+	a += sector_ground_level(sn, v2s16(node_max.X, node_min.Y), 4);
+	a += sector_ground_level(sn, center, 4);
 	a /= 5;
-	return a;
-}
+	sn.average_ground_level = a;
+
+	// Corners (one of them twice), center and side middle points
+	v2s16 points[9] = {
+		v2s16(node_min.X, node_min.Y),
+		v2s16(node_min.X, node_max.Y),
+		v2s16(node_max.X, node_max.Y),
+		v2s16(node_min.X, node_min.Y),
+		center,
+		v2s16(node_min.X+MAP_BLOCKSIZE/2, node_min.Y),
+		v2s16(node_min.X+MAP_BLOCKSIZE/2, node_max.Y),
+		v2s16(node_min.X, node_min.Y+MAP_BLOCKSIZE/2),
+		v2s16(node_max.X, node_min.Y+MAP_BLOCKSIZE/2),
+	};
+	double maximum = -31000;
+	double minimum = 31000;
+	for(u32 i=0; i<9; i++)
+	{
+		maximum = MYMAX(maximum, sector_ground_level(sn, points[i], 1));
+		minimum = MYMIN(minimum, sector_ground_level(sn, points[i], 4));
+	}
+	sn.maximum_ground_level = maximum;
+	sn.minimum_ground_level = minimum;
 
-double get_sector_maximum_ground_level(u64 seed, v2s16 sectorpos, double p=4);
+	/*
+		Values at the center
+	*/
+	sn.surface_humidity = surface_humidity_2d(seed, center);
+	sn.tree_amount = tree_amount_2d(seed, center);
+}
 
-double get_sector_maximum_ground_level(u64 seed, v2s16 sectorpos, double p)
+void get_sector_noise(u64 seed, v2s16 sectorpos, SectorNoise &dst)
 {
-	v2s16 node_min = sectorpos*MAP_BLOCKSIZE;
-	v2s16 node_max = (sectorpos+v2s16(1,1))*MAP_BLOCKSIZE-v2s16(1,1);
-	double a = -31000;
-	// Corners
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_min.Y), p));
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_max.Y), p));
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_max.X, node_max.Y), p));
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_min.Y), p));
-	// Center
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X+MAP_BLOCKSIZE/2, node_min.Y+MAP_BLOCKSIZE/2), p));
-	// Side middle points
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X+MAP_BLOCKSIZE/2, node_min.Y), p));
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X+MAP_BLOCKSIZE/2, node_max.Y), p));
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_min.Y+MAP_BLOCKSIZE/2), p));
-	a = MYMAX(a, find_ground_level_from_noise(seed,
-			v2s16(node_max.X, node_min.Y+MAP_BLOCKSIZE/2), p));
-	return a;
-}
+	if(g_sector_noise_cache.get(seed, sectorpos, dst))
+		return;
 
-double get_sector_minimum_ground_level(u64 seed, v2s16 sectorpos, double p=4);
+	ScopeProfiler sp(g_profiler, "Mapgen: compute sector noise", SPT_AVG);
 
-double get_sector_minimum_ground_level(u64 seed, v2s16 sectorpos, double p)
-{
-	v2s16 node_min = sectorpos*MAP_BLOCKSIZE;
-	v2s16 node_max = (sectorpos+v2s16(1,1))*MAP_BLOCKSIZE-v2s16(1,1);
-	double a = 31000;
-	// Corners
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_min.Y), p));
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_max.Y), p));
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_max.X, node_max.Y), p));
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_min.Y), p));
-	// Center
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X+MAP_BLOCKSIZE/2, node_min.Y+MAP_BLOCKSIZE/2), p));
-	// Side middle points
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X+MAP_BLOCKSIZE/2, node_min.Y), p));
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X+MAP_BLOCKSIZE/2, node_max.Y), p));
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_min.X, node_min.Y+MAP_BLOCKSIZE/2), p));
-	a = MYMIN(a, find_ground_level_from_noise(seed,
-			v2s16(node_max.X, node_min.Y+MAP_BLOCKSIZE/2), p));
-	return a;
+	compute_sector_noise(seed, sectorpos, dst);
+	g_sector_noise_cache.put(dst);
 }
 
 bool block_is_underground(u64 seed, v3s16 blockpos)
 {
-	s16 minimum_groundlevel = (s16)get_sector_minimum_ground_level(
-			seed, v2s16(blockpos.X, blockpos.Z));
+	SectorNoise sn;
+	get_sector_noise(seed, v2s16(blockpos.X, blockpos.Z), sn);
+	s16 minimum_groundlevel = (s16)sn.minimum_ground_level;
 	
 	if(blockpos.Y*MAP_BLOCKSIZE + MAP_BLOCKSIZE <= minimum_groundlevel)
 		return true;
@@ -1513,23 +1663,27 @@ void make_block(BlockMakeData *data)
 
 	v2s16 p2d_center(node_min.X+MAP_BLOCKSIZE/2, node_min.Z+MAP_BLOCKSIZE/2);
 
+	/*
+		Get 2D noise of the columns of the sector; this is shared by
+		all blocks of the sector.
+	*/
+	SectorNoise sn;
+	get_sector_noise(data->seed, v2s16(blockpos.X, blockpos.Z), sn);
+
 	/*
 		Get average ground level from noise
 	*/
 	
-	s16 approx_groundlevel = (s16)get_sector_average_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z));
+	s16 approx_groundlevel = (s16)sn.average_ground_level;
 	//dstream<<"approx_groundlevel="<<approx_groundlevel<<std::endl;
 	
 	s16 approx_ground_depth = approx_groundlevel - (node_min.Y+MAP_BLOCKSIZE/2);
 	
-	s16 minimum_groundlevel = (s16)get_sector_minimum_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z));
+	s16 minimum_groundlevel = (s16)sn.minimum_ground_level;
 	// Minimum amount of ground above the top of the central block
 	s16 minimum_ground_depth = minimum_groundlevel - node_max.Y;
 
-	s16 maximum_groundlevel = (s16)get_sector_maximum_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z), 1);
+	s16 maximum_groundlevel = (s16)sn.maximum_ground_level;
 	// Maximum amount of ground above the bottom of the central block
 	s16 maximum_ground_depth = maximum_groundlevel - node_min.Y;
 
@@ -1675,6 +1829,9 @@ void make_block(BlockMakeData *data)
 	{
 		// Node position
 		v2s16 p2d(x,z);
+		u32 column = sn.columnIndex(p2d);
+		double ground_factor = sn.ground_factor[column];
+		double ground_height = sn.ground_height[column];
 		{
 			// Use fast index incrementing
 			v3s16 em = vmanip.m_area.getExtent();
@@ -1687,8 +1844,8 @@ void make_block(BlockMakeData *data)
 					// First priority: make air and water.
 					// This avoids caves inside water.
 					if(all_is_ground_except_caves == false
-							&& val_is_ground(noisebuf_ground.get(x,y,z),
-							v3s16(x,y,z), data->seed) == false)
+							&& val_is_ground_column(noisebuf_ground.get(x,y,z),
+							y, ground_factor, ground_height) == false)
 					{
 						if(y <= WATER_LEVEL)
 							vmanip.m_data[i] = n_water_source;
@@ -1905,7 +2062,8 @@ void make_block(BlockMakeData *data)
 			// Node position
 			v2s16 p2d(x,z);
 			{
-				bool possibly_have_sand = get_have_sand(data->seed, p2d);
+				u32 column = sn.columnIndex(p2d);
+				bool possibly_have_sand = sn.have_sand[column];
 				bool have_sand = false;
 				u32 current_depth = 0;
 				bool air_detected = false;
@@ -1939,9 +2097,7 @@ void make_block(BlockMakeData *data)
 							if(have_sand)
 							{
 								// Determine whether to have clay in the sand here
-								double claynoise = noise2d_perlin(
-										0.5+(float)p2d.X/500, 0.5+(float)p2d.Y/500,
-										data->seed+4321, 6, 0.95) + 0.5;
+								double claynoise = sn.clay[column];
 				
 								have_clay = (y <= WATER_LEVEL) && (y >= WATER_LEVEL-2) && (
 									((claynoise > 0) && (claynoise < 0.04) && (current_depth == 0)) ||
@@ -1984,10 +2140,10 @@ void make_block(BlockMakeData *data)
 			Calculate some stuff
 		*/
 		
-		float surface_humidity = surface_humidity_2d(data->seed, p2d_center);
+		float surface_humidity = sn.surface_humidity;
 		bool is_jungle = surface_humidity > 0.75;
 		// Amount of trees
-		u32 tree_count = block_area_nodes * tree_amount_2d(data->seed, p2d_center);
+		u32 tree_count = block_area_nodes * sn.tree_amount;
 		if(is_jungle)
 			tree_count *= 5;
 
@@ -2001,7 +2157,7 @@ void make_block(BlockMakeData *data)
 			s16 x = treerandom.range(node_min.X, node_max.X);
 			s16 z = treerandom.range(node_min.Z, node_max.Z);
 			//s16 y = find_ground_level(data->vmanip, v2s16(x,z));
-			s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 4);
+			s16 y = sector_ground_level(sn, v2s16(x,z), 4);
 			// Don't make a tree under water level
 			if(y < WATER_LEVEL)
 				continue;
@@ -2039,7 +2195,7 @@ void make_block(BlockMakeData *data)
 				if(n->getContent() == c_dirt && y <= WATER_LEVEL)
 				{
 					p.Y++;
-					make_papyrus(vmanip, p, ndef);
+					make_papyrus(vmanip, p, ndef, treerandom.next());
 				}
 				// Trees grow only on mud and grass, on land
 				else if((n->getContent() == c_dirt || n->getContent() == c_dirt_with_grass) && y > WATER_LEVEL + 2)
@@ -2049,16 +2205,17 @@ void make_block(BlockMakeData *data)
 					if(is_jungle == false)
 					{
 						bool is_apple_tree;
-						if(myrand_range(0,4) != 0)
+						if(treerandom.range(0,4) != 0)
 							is_apple_tree = false;
 						else
 							is_apple_tree = noise2d_perlin(
 									0.5+(float)p.X/100, 0.5+(float)p.Z/100,
 									data->seed+342902, 3, 0.45) > 0.2;
-						make_tree(vmanip, p, is_apple_tree, ndef);
+						make_tree(vmanip, p, is_apple_tree, ndef,
+								treerandom.next());
 					}
 					else
-						make_jungletree(vmanip, p, ndef);
+						make_jungletree(vmanip, p, ndef, treerandom.next());
 				}
 				// Cactii grow only on sand, on land
 				else if(n->getContent() == c_sand && y > WATER_LEVEL + 2)
@@ -2079,7 +2236,7 @@ void make_block(BlockMakeData *data)
 			{
 				s16 x = grassrandom.range(node_min.X, node_max.X);
 				s16 z = grassrandom.range(node_min.Z, node_max.Z);
-				s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 4);
+				s16 y = sector_ground_level(sn, v2s16(x,z), 4);
 				if(y < WATER_LEVEL)
 					continue;
 				if(y < node_min.Y || y > node_max.Y)
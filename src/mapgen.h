@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "common_irrlicht.h"
 #include "utility.h" // UniqueQueue
+#include "constants.h" // MAP_BLOCKSIZE
 
 struct BlockMakeData;
 class MapBlock;
@@ -36,15 +37,53 @@ namespace mapgen
 	// Find out if block is completely underground
 	bool block_is_underground(u64 seed, v3s16 blockpos);
 
-	// Main map generation routine
+	/*
+		Values of a sector (a column of blocks) that depend only on the
+		2D position. They are the same for every block of the sector, so
+		they are computed once and shared.
+	*/
+	struct SectorNoise
+	{
+		u64 seed;
+		v2s16 pos;
+
+		// Indexed by columnIndex()
+		double ground_factor[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		double ground_height[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		bool have_sand[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		double clay[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+
+		double average_ground_level;
+		double minimum_ground_level;
+		double maximum_ground_level;
+		// At the center of the sector
+		double surface_humidity;
+		double tree_amount;
+
+		// p2d is a node position inside the sector
+		u32 columnIndex(v2s16 p2d) const
+		{
+			return (p2d.Y - pos.Y*MAP_BLOCKSIZE) * MAP_BLOCKSIZE
+					+ (p2d.X - pos.X*MAP_BLOCKSIZE);
+		}
+	};
+
+	/*
+		Gets the values of a sector from a cache, computing them if
+		needed. The cache is bounded and shared by all threads.
+	*/
+	void get_sector_noise(u64 seed, v2s16 sectorpos, SectorNoise &dst);
+
+	// Main map generation routine.
+	// Uses only data, so it can be run in several threads at once.
 	void make_block(BlockMakeData *data);
 	
 	// Add objects according to block content
 	void add_random_objects(MapBlock *block);
 
-	// Add a tree
+	// Add a tree; the same seed makes the same tree
 	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
-			bool is_apple_tree, INodeDefManager *ndef);
+			bool is_apple_tree, INodeDefManager *ndef, int seed);
 	
 	/*
 		These are used by FarMesh
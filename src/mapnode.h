@@ -122,7 +122,7 @@ struct MapNode
 	MapNode(INodeDefManager *ndef, const std::string &name,
 			u8 a_param1=0, u8 a_param2=0);
 
-	bool operator==(const MapNode &other)
+	bool operator==(const MapNode &other) const
 	{
 		return (param0 == other.param0
 				&& param1 == other.param1
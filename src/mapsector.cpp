@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "client.h"
 #include "exceptions.h"
 #include "mapblock.h"
+#include "map.h"
 
 MapSector::MapSector(Map *parent, v2s16 pos, IGameDef *gamedef):
 		differs_from_disk(false),
@@ -46,7 +47,10 @@ void MapSector::deleteBlocks()
 	core::map<s16, MapBlock*>::Iterator i = m_blocks.getIterator();
 	for(; i.atEnd() == false; i++)
 	{
-		delete i.getNode()->getValue();
+		MapBlock *block = i.getNode()->getValue();
+		if(m_parent)
+			m_parent->unindexBlock(block->getPos());
+		delete block;
 	}
 
 	// Clear container
@@ -100,6 +104,8 @@ MapBlock * MapSector::createBlankBlock(s16 y)
 	MapBlock *block = createBlankBlockNoInsert(y);
 	
 	m_blocks.insert(y, block);
+	if(m_parent)
+		m_parent->indexBlock(block);
 
 	return block;
 }
@@ -118,6 +124,8 @@ void MapSector::insertBlock(MapBlock *block)
 	
 	// Insert into container
 	m_blocks.insert(block_y, block);
+	if(m_parent)
+		m_parent->indexBlock(block);
 }
 
 void MapSector::deleteBlock(MapBlock *block)
@@ -129,6 +137,8 @@ void MapSector::deleteBlock(MapBlock *block)
 	
 	// Remove from container
 	m_blocks.remove(block_y);
+	if(m_parent)
+		m_parent->unindexBlock(block->getPos());
 
 	// Delete
 	delete block;
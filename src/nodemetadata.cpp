@@ -165,6 +165,12 @@ void NodeMetadataList::serialize(std::ostream &os)
 }
 void NodeMetadataList::deSerialize(std::istream &is, IGameDef *gamedef)
 {
+	for(core::map<v3s16, NodeMetadata*>::Iterator
+			i = m_data.getIterator();
+			i.atEnd()==false; i++)
+	{
+		delete i.getNode()->getValue();
+	}
 	m_data.clear();
 
 	u8 buf[6];
@@ -264,3 +270,13 @@ bool NodeMetadataList::step(float dtime)
 	return something_changed;
 }
 
+
+void NodeMetadataList::getPositions(core::list<v3s16> &dst)
+{
+	for(core::map<v3s16, NodeMetadata*>::Iterator
+			i = m_data.getIterator();
+			i.atEnd()==false; i++)
+	{
+		dst.push_back(i.getNode()->getKey());
+	}
+}
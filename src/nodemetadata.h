@@ -65,6 +65,12 @@ class NodeMetadata
 
 	// A step in time. Shall return true if metadata changed.
 	virtual bool step(float dtime) {return false;}
+	/*
+		Interval at which step() should be called, driven by the node
+		timer of the node. 0 if the metadata needs no stepping for now.
+		Checked again after inventoryModified() and step().
+	*/
+	virtual float getStepInterval() {return 0;}
 
 	// Whether the related node and this metadata cannot be removed
 	virtual bool nodeRemovalDisabled(){return false;}
@@ -131,6 +137,8 @@ class NodeMetadataList
 	
 	// A step in time. Returns true if something changed.
 	bool step(float dtime);
+	// Gets the positions of all the metadata
+	void getPositions(core::list<v3s16> &dst);
 
 private:
 	core::map<v3s16, NodeMetadata*> m_data;
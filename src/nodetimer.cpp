@@ -0,0 +1,203 @@
+/*
+Minetest-c55
+Copyright (C) 2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "nodetimer.h"
+#include "utility.h"
+#include "exceptions.h"
+#include "constants.h"
+
+NodeTimerList::NodeTimerList():
+	m_time(0)
+{
+}
+
+/*
+	Format:
+	u8 version (0)
+	u16 count
+	for each timer:
+		u16 node index (z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x)
+		s32 timeout*1000
+		s32 remaining time*1000
+*/
+void NodeTimerList::serialize(std::ostream &os)
+{
+	writeU8(os, 0);
+	writeU16(os, m_timers.size());
+	for(core::map<v3s16, Timer>::Iterator i = m_timers.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v3s16 p = i.getNode()->getKey();
+		const Timer &t = i.getNode()->getValue();
+		writeU16(os, p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X);
+		writeF1000(os, t.timeout);
+		writeF1000(os, t.due - m_time);
+	}
+}
+
+void NodeTimerList::deSerialize(std::istream &is)
+{
+	clear();
+
+	u8 version = readU8(is);
+	if(version != 0)
+		throw SerializationError("NodeTimerList::deSerialize: "
+				"unsupported version");
+	u16 count = readU16(is);
+	for(u16 i=0; i<count; i++)
+	{
+		u16 index = readU16(is);
+		v3s16 p(index % MAP_BLOCKSIZE,
+				(index / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+				(index / MAP_BLOCKSIZE / MAP_BLOCKSIZE) % MAP_BLOCKSIZE);
+		float timeout = readF1000(is);
+		float remaining = readF1000(is);
+		Timer t;
+		t.due = m_time + remaining;
+		t.timeout = timeout;
+		m_timers[p] = t;
+		HeapEntry e;
+		e.due = t.due;
+		e.p = p;
+		heapPush(e);
+	}
+}
+
+void NodeTimerList::set(v3s16 p, float timeout)
+{
+	Timer t;
+	t.due = m_time + timeout;
+	t.timeout = timeout;
+	m_timers[p] = t;
+
+	HeapEntry e;
+	e.due = t.due;
+	e.p = p;
+	heapPush(e);
+
+	if(m_heap.size() > m_timers.size() * 2 + 16)
+		rebuildHeap();
+}
+
+void NodeTimerList::remove(v3s16 p)
+{
+	// The heap entry is skipped when it comes up
+	m_timers.remove(p);
+	if(m_timers.size() == 0)
+		clear();
+}
+
+float NodeTimerList::getRemaining(v3s16 p)
+{
+	core::map<v3s16, Timer>::Node *n = m_timers.find(p);
+	if(n == NULL)
+		return -1;
+	return n->getValue().due - m_time;
+}
+
+void NodeTimerList::clear()
+{
+	m_timers.clear();
+	m_heap.clear();
+	m_time = 0;
+}
+
+void NodeTimerList::step(float dtime, core::list<NodeTimerExpired> &expired)
+{
+	if(m_timers.size() == 0)
+		return;
+
+	m_time += dtime;
+
+	while(m_heap.size() != 0 && m_heap[0].due <= m_time)
+	{
+		HeapEntry e = m_heap[0];
+		heapPop();
+
+		core::map<v3s16, Timer>::Node *n = m_timers.find(e.p);
+		// Skip if removed or restarted
+		if(n == NULL || n->getValue().due != e.due)
+			continue;
+
+		NodeTimerExpired x;
+		x.p = e.p;
+		x.elapsed = m_time - (e.due - n->getValue().timeout);
+		x.timeout = n->getValue().timeout;
+		expired.push_back(x);
+		m_timers.remove(e.p);
+	}
+
+	if(m_timers.size() == 0)
+		clear();
+}
+
+void NodeTimerList::heapPush(const HeapEntry &e)
+{
+	m_heap.push_back(e);
+	u32 i = m_heap.size() - 1;
+	while(i > 0)
+	{
+		u32 parent = (i - 1) / 2;
+		if(m_heap[parent].due <= m_heap[i].due)
+			break;
+		HeapEntry tmp = m_heap[parent];
+		m_heap[parent] = m_heap[i];
+		m_heap[i] = tmp;
+		i = parent;
+	}
+}
+
+void NodeTimerList::heapPop()
+{
+	u32 last = m_heap.size() - 1;
+	m_heap[0] = m_heap[last];
+	m_heap.erase(last);
+	u32 size = m_heap.size();
+	u32 i = 0;
+	for(;;)
+	{
+		u32 smallest = i;
+		u32 l = i * 2 + 1;
+		u32 r = i * 2 + 2;
+		if(l < size && m_heap[l].due < m_heap[smallest].due)
+			smallest = l;
+		if(r < size && m_heap[r].due < m_heap[smallest].due)
+			smallest = r;
+		if(smallest == i)
+			break;
+		HeapEntry tmp = m_heap[smallest];
+		m_heap[smallest] = m_heap[i];
+		m_heap[i] = tmp;
+		i = smallest;
+	}
+}
+
+void NodeTimerList::rebuildHeap()
+{
+	m_heap.clear();
+	for(core::map<v3s16, Timer>::Iterator i = m_timers.getIterator();
+			i.atEnd() == false; i++)
+	{
+		HeapEntry e;
+		e.due = i.getNode()->getValue().due;
+		e.p = i.getNode()->getKey();
+		heapPush(e);
+	}
+}
+
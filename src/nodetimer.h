@@ -0,0 +1,104 @@
+/*
+Minetest-c55
+Copyright (C) 2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef NODETIMER_HEADER
+#define NODETIMER_HEADER
+
+#include "common_irrlicht.h"
+#include <iostream>
+
+/*
+	Node timers of a MapBlock.
+
+	A timer expires after a given time has passed while the block is
+	active (or, as with node metadata, when the block is activated after
+	having been inactive for long enough). The timers are kept in a
+	min-heap by expiry time, so stepping a block only touches the
+	timers that have expired.
+
+	Positions are relative to the block.
+*/
+
+struct NodeTimerExpired
+{
+	v3s16 p;
+	// Time since the timer was started
+	float elapsed;
+	// The timeout the timer was started with
+	float timeout;
+};
+
+class NodeTimerList
+{
+public:
+	NodeTimerList();
+
+	// Only the remaining times are stored
+	void serialize(std::ostream &os);
+	void deSerialize(std::istream &is);
+
+	// Starts or restarts the timer of a node
+	void set(v3s16 p, float timeout);
+	void remove(v3s16 p);
+	// Returns the time left, or -1 if the node has no timer
+	float getRemaining(v3s16 p);
+	u32 size()
+	{
+		return m_timers.size();
+	}
+	void clear();
+
+	/*
+		Advances time by dtime and moves the expired timers to expired.
+		An expired timer is removed; it has to be set again to
+		continue.
+	*/
+	void step(float dtime, core::list<NodeTimerExpired> &expired);
+
+private:
+	struct Timer
+	{
+		// Expiry time on m_time
+		double due;
+		float timeout;
+	};
+	struct HeapEntry
+	{
+		double due;
+		v3s16 p;
+	};
+
+	void heapPush(const HeapEntry &e);
+	void heapPop();
+	// Removes the heap entries of removed or restarted timers
+	void rebuildHeap();
+
+	// The current timers
+	core::map<v3s16, Timer> m_timers;
+	/*
+		Min-heap of expiry times. May also contain stale entries of
+		timers that have been removed or restarted; these are skipped.
+	*/
+	core::array<HeapEntry> m_heap;
+	// Time stepped in this list
+	double m_time;
+};
+
+#endif
+
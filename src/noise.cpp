@@ -22,6 +22,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include "debug.h"
 
+#if defined(__AVX__)
+	#include <immintrin.h>
+	#define NOISE_USE_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || \
+		(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define NOISE_USE_SSE2
+#endif
+
 #define NOISE_MAGIC_X 1619
 #define NOISE_MAGIC_Y 31337
 #define NOISE_MAGIC_Z 52591
@@ -269,6 +278,338 @@ double noise3d_param(const NoiseParams &param, double x, double y, double z)
 	else assert(0);
 }
 
+/*
+	Batch noise
+
+	Every octave is done in two passes over a chunk of points:
+	1) Scalar: find the lattice cell of each point and look up the
+	   corner values. Consecutive points are usually in the same cell,
+	   so the corner values of the previous point are reused.
+	2) Interpolate the corners and add the octave to the result. This
+	   is done with SSE2 or AVX when available.
+	The arithmetic is done in the same order as in the point functions.
+*/
+
+// Points processed at a time; the temporary arrays are on the stack
+#define NOISE_BATCH_CHUNK 128
+
+/*
+	Pass 2 of 3D noise: result[i] += g * trilinear(corners, t)
+*/
+static void noise3d_batch_accumulate(int count, double g, bool abs,
+		const double *tx, const double *ty, const double *tz,
+		double *const *v, double *result)
+{
+	int i = 0;
+#if defined(NOISE_USE_AVX)
+	const __m256d one = _mm256_set1_pd(1.0);
+	const __m256d gg = _mm256_set1_pd(g);
+	const __m256d signmask = _mm256_set1_pd(-0.0);
+	for(; i+4<=count; i+=4)
+	{
+		__m256d x = _mm256_loadu_pd(tx+i);
+		__m256d y = _mm256_loadu_pd(ty+i);
+		__m256d z = _mm256_loadu_pd(tz+i);
+		__m256d x1 = _mm256_sub_pd(one, x);
+		__m256d y1 = _mm256_sub_pd(one, y);
+		__m256d z1 = _mm256_sub_pd(one, z);
+		#define NOISE_TERM(n, a, b, c) _mm256_mul_pd(_mm256_mul_pd(\
+				_mm256_mul_pd(_mm256_loadu_pd(v[n]+i), a), b), c)
+		__m256d sum = NOISE_TERM(0, x1, y1, z1);
+		sum = _mm256_add_pd(sum, NOISE_TERM(1, x, y1, z1));
+		sum = _mm256_add_pd(sum, NOISE_TERM(2, x1, y, z1));
+		sum = _mm256_add_pd(sum, NOISE_TERM(3, x, y, z1));
+		sum = _mm256_add_pd(sum, NOISE_TERM(4, x1, y1, z));
+		sum = _mm256_add_pd(sum, NOISE_TERM(5, x, y1, z));
+		sum = _mm256_add_pd(sum, NOISE_TERM(6, x1, y, z));
+		sum = _mm256_add_pd(sum, NOISE_TERM(7, x, y, z));
+		#undef NOISE_TERM
+		if(abs)
+			sum = _mm256_andnot_pd(signmask, sum);
+		_mm256_storeu_pd(result+i, _mm256_add_pd(_mm256_loadu_pd(result+i),
+				_mm256_mul_pd(gg, sum)));
+	}
+#elif defined(NOISE_USE_SSE2)
+	const __m128d one = _mm_set1_pd(1.0);
+	const __m128d gg = _mm_set1_pd(g);
+	const __m128d signmask = _mm_set1_pd(-0.0);
+	for(; i+2<=count; i+=2)
+	{
+		__m128d x = _mm_loadu_pd(tx+i);
+		__m128d y = _mm_loadu_pd(ty+i);
+		__m128d z = _mm_loadu_pd(tz+i);
+		__m128d x1 = _mm_sub_pd(one, x);
+		__m128d y1 = _mm_sub_pd(one, y);
+		__m128d z1 = _mm_sub_pd(one, z);
+		#define NOISE_TERM(n, a, b, c) _mm_mul_pd(_mm_mul_pd(\
+				_mm_mul_pd(_mm_loadu_pd(v[n]+i), a), b), c)
+		__m128d sum = NOISE_TERM(0, x1, y1, z1);
+		sum = _mm_add_pd(sum, NOISE_TERM(1, x, y1, z1));
+		sum = _mm_add_pd(sum, NOISE_TERM(2, x1, y, z1));
+		sum = _mm_add_pd(sum, NOISE_TERM(3, x, y, z1));
+		sum = _mm_add_pd(sum, NOISE_TERM(4, x1, y1, z));
+		sum = _mm_add_pd(sum, NOISE_TERM(5, x, y1, z));
+		sum = _mm_add_pd(sum, NOISE_TERM(6, x1, y, z));
+		sum = _mm_add_pd(sum, NOISE_TERM(7, x, y, z));
+		#undef NOISE_TERM
+		if(abs)
+			sum = _mm_andnot_pd(signmask, sum);
+		_mm_storeu_pd(result+i, _mm_add_pd(_mm_loadu_pd(result+i),
+				_mm_mul_pd(gg, sum)));
+	}
+#endif
+	for(; i<count; i++)
+	{
+		double a = triLinearInterpolation(v[0][i], v[1][i], v[2][i], v[3][i],
+				v[4][i], v[5][i], v[6][i], v[7][i], tx[i], ty[i], tz[i]);
+		if(abs)
+			a = fabs(a);
+		result[i] += g * a;
+	}
+}
+
+/*
+	Pass 2 of 2D noise: result[i] += g * bilinear(corners, t)
+	t is already eased.
+*/
+static void noise2d_batch_accumulate(int count, double g, bool abs,
+		const double *tx, const double *ty,
+		double *const *v, double *result)
+{
+	int i = 0;
+#if defined(NOISE_USE_AVX)
+	const __m256d gg = _mm256_set1_pd(g);
+	const __m256d signmask = _mm256_set1_pd(-0.0);
+	for(; i+4<=count; i+=4)
+	{
+		__m256d x = _mm256_loadu_pd(tx+i);
+		__m256d y = _mm256_loadu_pd(ty+i);
+		__m256d v00 = _mm256_loadu_pd(v[0]+i);
+		__m256d v10 = _mm256_loadu_pd(v[1]+i);
+		__m256d v01 = _mm256_loadu_pd(v[2]+i);
+		__m256d v11 = _mm256_loadu_pd(v[3]+i);
+		__m256d u = _mm256_add_pd(v00,
+				_mm256_mul_pd(_mm256_sub_pd(v10, v00), x));
+		__m256d w = _mm256_add_pd(v01,
+				_mm256_mul_pd(_mm256_sub_pd(v11, v01), x));
+		__m256d a = _mm256_add_pd(u, _mm256_mul_pd(_mm256_sub_pd(w, u), y));
+		if(abs)
+			a = _mm256_andnot_pd(signmask, a);
+		_mm256_storeu_pd(result+i, _mm256_add_pd(_mm256_loadu_pd(result+i),
+				_mm256_mul_pd(gg, a)));
+	}
+#elif defined(NOISE_USE_SSE2)
+	const __m128d gg = _mm_set1_pd(g);
+	const __m128d signmask = _mm_set1_pd(-0.0);
+	for(; i+2<=count; i+=2)
+	{
+		__m128d x = _mm_loadu_pd(tx+i);
+		__m128d y = _mm_loadu_pd(ty+i);
+		__m128d v00 = _mm_loadu_pd(v[0]+i);
+		__m128d v10 = _mm_loadu_pd(v[1]+i);
+		__m128d v01 = _mm_loadu_pd(v[2]+i);
+		__m128d v11 = _mm_loadu_pd(v[3]+i);
+		__m128d u = _mm_add_pd(v00, _mm_mul_pd(_mm_sub_pd(v10, v00), x));
+		__m128d w = _mm_add_pd(v01, _mm_mul_pd(_mm_sub_pd(v11, v01), x));
+		__m128d a = _mm_add_pd(u, _mm_mul_pd(_mm_sub_pd(w, u), y));
+		if(abs)
+			a = _mm_andnot_pd(signmask, a);
+		_mm_storeu_pd(result+i, _mm_add_pd(_mm_loadu_pd(result+i),
+				_mm_mul_pd(gg, a)));
+	}
+#endif
+	for(; i<count; i++)
+	{
+		double u = linearInterpolation(v[0][i], v[1][i], tx[i]);
+		double w = linearInterpolation(v[2][i], v[3][i], tx[i]);
+		double a = linearInterpolation(u, w, ty[i]);
+		if(abs)
+			a = fabs(a);
+		result[i] += g * a;
+	}
+}
+
+static void noise3d_perlin_batch_chunk(const double *x, const double *y,
+		const double *z, int count, int seed, int octaves,
+		double persistence, bool abs, double *result)
+{
+	double tx[NOISE_BATCH_CHUNK];
+	double ty[NOISE_BATCH_CHUNK];
+	double tz[NOISE_BATCH_CHUNK];
+	double corners[8][NOISE_BATCH_CHUNK];
+	double *v[8];
+	for(int k=0; k<8; k++)
+		v[k] = corners[k];
+
+	for(int i=0; i<count; i++)
+		result[i] = 0;
+
+	double f = 1.0;
+	double g = 1.0;
+	for(int octave=0; octave<octaves; octave++)
+	{
+		int s = seed + octave;
+		// Cell of the previous point
+		bool have_prev = false;
+		int px0 = 0, py0 = 0, pz0 = 0;
+		double c[8] = {0};
+		for(int i=0; i<count; i++)
+		{
+			double xf = x[i]*f;
+			double yf = y[i]*f;
+			double zf = z[i]*f;
+			int x0 = (xf > 0.0 ? (int)xf : (int)xf - 1);
+			int y0 = (yf > 0.0 ? (int)yf : (int)yf - 1);
+			int z0 = (zf > 0.0 ? (int)zf : (int)zf - 1);
+			tx[i] = xf - (double)x0;
+			ty[i] = yf - (double)y0;
+			tz[i] = zf - (double)z0;
+			if(!have_prev || x0 != px0 || y0 != py0 || z0 != pz0)
+			{
+				c[0] = noise3d(x0, y0, z0, s);
+				c[1] = noise3d(x0+1, y0, z0, s);
+				c[2] = noise3d(x0, y0+1, z0, s);
+				c[3] = noise3d(x0+1, y0+1, z0, s);
+				c[4] = noise3d(x0, y0, z0+1, s);
+				c[5] = noise3d(x0+1, y0, z0+1, s);
+				c[6] = noise3d(x0, y0+1, z0+1, s);
+				c[7] = noise3d(x0+1, y0+1, z0+1, s);
+				px0 = x0;
+				py0 = y0;
+				pz0 = z0;
+				have_prev = true;
+			}
+			for(int k=0; k<8; k++)
+				corners[k][i] = c[k];
+		}
+		noise3d_batch_accumulate(count, g, abs, tx, ty, tz, v, result);
+		f *= 2.0;
+		g *= persistence;
+	}
+}
+
+static void noise2d_perlin_batch_chunk(const double *x, const double *y,
+		int count, int seed, int octaves, double persistence, bool abs,
+		double *result)
+{
+	double tx[NOISE_BATCH_CHUNK];
+	double ty[NOISE_BATCH_CHUNK];
+	double corners[4][NOISE_BATCH_CHUNK];
+	double *v[4];
+	for(int k=0; k<4; k++)
+		v[k] = corners[k];
+
+	for(int i=0; i<count; i++)
+		result[i] = 0;
+
+	double f = 1.0;
+	double g = 1.0;
+	for(int octave=0; octave<octaves; octave++)
+	{
+		int s = seed + octave;
+		bool have_prev = false;
+		int px0 = 0, py0 = 0;
+		double c[4] = {0};
+		for(int i=0; i<count; i++)
+		{
+			double xf = x[i]*f;
+			double yf = y[i]*f;
+			int x0 = (xf > 0.0 ? (int)xf : (int)xf - 1);
+			int y0 = (yf > 0.0 ? (int)yf : (int)yf - 1);
+			tx[i] = easeCurve(xf - (double)x0);
+			ty[i] = easeCurve(yf - (double)y0);
+			if(!have_prev || x0 != px0 || y0 != py0)
+			{
+				c[0] = noise2d(x0, y0, s);
+				c[1] = noise2d(x0+1, y0, s);
+				c[2] = noise2d(x0, y0+1, s);
+				c[3] = noise2d(x0+1, y0+1, s);
+				px0 = x0;
+				py0 = y0;
+				have_prev = true;
+			}
+			for(int k=0; k<4; k++)
+				corners[k][i] = c[k];
+		}
+		noise2d_batch_accumulate(count, g, abs, tx, ty, v, result);
+		f *= 2.0;
+		g *= persistence;
+	}
+}
+
+void noise3d_perlin_batch(const double *x, const double *y, const double *z,
+		int count, int seed, int octaves, double persistence, bool abs,
+		double *result)
+{
+	for(int i=0; i<count; i+=NOISE_BATCH_CHUNK)
+	{
+		int n = count - i;
+		if(n > NOISE_BATCH_CHUNK)
+			n = NOISE_BATCH_CHUNK;
+		noise3d_perlin_batch_chunk(x+i, y+i, z+i, n, seed, octaves,
+				persistence, abs, result+i);
+	}
+}
+
+void noise2d_perlin_batch(const double *x, const double *y,
+		int count, int seed, int octaves, double persistence, bool abs,
+		double *result)
+{
+	for(int i=0; i<count; i+=NOISE_BATCH_CHUNK)
+	{
+		int n = count - i;
+		if(n > NOISE_BATCH_CHUNK)
+			n = NOISE_BATCH_CHUNK;
+		noise2d_perlin_batch_chunk(x+i, y+i, n, seed, octaves,
+				persistence, abs, result+i);
+	}
+}
+
+void noise3d_param_batch(const NoiseParams &param,
+		const double *x, const double *y, const double *z,
+		int count, double *result)
+{
+	if(param.type == NOISE_CONSTANT_ONE)
+	{
+		for(int i=0; i<count; i++)
+			result[i] = 1.0;
+		return;
+	}
+
+	double xs[NOISE_BATCH_CHUNK];
+	double ys[NOISE_BATCH_CHUNK];
+	double zs[NOISE_BATCH_CHUNK];
+	double s = param.pos_scale;
+	bool abs = (param.type == NOISE_PERLIN_ABS);
+	bool flip_yz = (param.type == NOISE_PERLIN_CONTOUR_FLIP_YZ);
+	bool contoured = (param.type == NOISE_PERLIN_CONTOUR
+			|| param.type == NOISE_PERLIN_CONTOUR_FLIP_YZ);
+	assert(param.type == NOISE_PERLIN || abs || contoured);
+
+	for(int i0=0; i0<count; i0+=NOISE_BATCH_CHUNK)
+	{
+		int n = count - i0;
+		if(n > NOISE_BATCH_CHUNK)
+			n = NOISE_BATCH_CHUNK;
+		for(int i=0; i<n; i++)
+		{
+			xs[i] = x[i0+i] / s;
+			ys[i] = y[i0+i] / s;
+			zs[i] = z[i0+i] / s;
+		}
+		double *r = result + i0;
+		noise3d_perlin_batch_chunk(xs, flip_yz ? zs : ys, flip_yz ? ys : zs,
+				n, param.seed, param.octaves, param.persistence, abs, r);
+		for(int i=0; i<n; i++)
+		{
+			if(contoured)
+				r[i] = contour(param.noise_scale*r[i]);
+			else
+				r[i] = param.noise_scale*r[i];
+		}
+	}
+}
+
 /*
 	NoiseBuffer
 */
@@ -313,32 +654,40 @@ void NoiseBuffer::create(const NoiseParams &param,
 
 	m_data = new double[m_size_x*m_size_y*m_size_z];
 
-	for(int x=0; x<m_size_x; x++)
-	for(int y=0; y<m_size_y; y++)
-	for(int z=0; z<m_size_z; z++)
-	{
-		double xd = (m_start_x + (double)x*m_samplelength_x);
-		double yd = (m_start_y + (double)y*m_samplelength_y);
-		double zd = (m_start_z + (double)z*m_samplelength_z);
-		double a = noise3d_param(param, xd,yd,zd);
-		intSet(x,y,z, a);
-	}
+	fill(param, m_data);
 }
 
 void NoiseBuffer::multiply(const NoiseParams &param)
 {
 	assert(m_data != NULL);
 
-	for(int x=0; x<m_size_x; x++)
-	for(int y=0; y<m_size_y; y++)
+	int volume = m_size_x*m_size_y*m_size_z;
+	double *a = new double[volume];
+	fill(param, a);
+	for(int i=0; i<volume; i++)
+		m_data[i] = m_data[i] * a[i];
+	delete[] a;
+}
+
+void NoiseBuffer::fill(const NoiseParams &param, double *dst)
+{
+	// Sample coordinates in the order of m_data; x changes fastest
+	int volume = m_size_x*m_size_y*m_size_z;
+	double *xd = new double[volume*3];
+	double *yd = xd + volume;
+	double *zd = yd + volume;
+	int i = 0;
 	for(int z=0; z<m_size_z; z++)
+	for(int y=0; y<m_size_y; y++)
+	for(int x=0; x<m_size_x; x++)
 	{
-		double xd = (m_start_x + (double)x*m_samplelength_x);
-		double yd = (m_start_y + (double)y*m_samplelength_y);
-		double zd = (m_start_z + (double)z*m_samplelength_z);
-		double a = noise3d_param(param, xd,yd,zd);
-		intMultiply(x,y,z, a);
+		xd[i] = (m_start_x + (double)x*m_samplelength_x);
+		yd[i] = (m_start_y + (double)y*m_samplelength_y);
+		zd[i] = (m_start_z + (double)z*m_samplelength_z);
+		i++;
 	}
+	noise3d_param_batch(param, xd, yd, zd, volume, dst);
+	delete[] xd;
 }
 
 // Deprecated
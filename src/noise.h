@@ -113,6 +113,30 @@ struct NoiseParams
 
 double noise3d_param(const NoiseParams &param, double x, double y, double z);
 
+/*
+	Batch versions of the above. They compute result[i] for the points
+	(x[i], y[i], z[i]), 0 <= i < count.
+
+	The results are bit-identical to calling the point functions for
+	each point, as long as the compiler is not allowed to reorder
+	floating point math. (With -ffast-math both may be reordered
+	differently; the differences are then a few ulps.)
+
+	They are fastest when consecutive points are near each other, like
+	the rows of a grid, because the corner values of a lattice cell are
+	reused. Interpolation is vectorized with SSE2 or AVX if the compiler
+	targets them.
+*/
+void noise2d_perlin_batch(const double *x, const double *y,
+		int count, int seed, int octaves, double persistence, bool abs,
+		double *result);
+void noise3d_perlin_batch(const double *x, const double *y, const double *z,
+		int count, int seed, int octaves, double persistence, bool abs,
+		double *result);
+void noise3d_param_batch(const NoiseParams &param,
+		const double *x, const double *y, const double *z,
+		int count, double *result);
+
 class NoiseBuffer
 {
 public:
@@ -139,6 +163,9 @@ class NoiseBuffer
 	//bool contains(double x, double y, double z);
 
 private:
+	// Computes param for every sample into dst (in the order of m_data)
+	void fill(const NoiseParams &param, double *dst);
+
 	double *m_data;
 	double m_start_x, m_start_y, m_start_z;
 	double m_samplelength_x, m_samplelength_y, m_samplelength_z;
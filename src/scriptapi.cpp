@@ -1780,8 +1780,11 @@ class NodeMetaRef
 		// Set the block to be saved
 		MapBlock *block = ref->m_env->getMap().getBlockNoCreateNoEx(blockpos);
 		if(block)
+		{
+			block->noteMetadataChanged();
 			block->raiseModified(MOD_STATE_WRITE_NEEDED,
 					"NodeMetaRef::reportMetadataChange");
+		}
 	}
 	
 	// Exported functions
@@ -2864,6 +2867,42 @@ class EnvRef
 		return 1;
 	}
 
+	// EnvRef:set_node_timer(pos, timeout)
+	// timeout 0 or nil stops the timer
+	static int l_set_node_timer(lua_State *L)
+	{
+		EnvRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		// pos
+		v3s16 pos = read_v3s16(L, 2);
+		// timeout
+		float timeout = 0;
+		if(!lua_isnil(L, 3))
+			timeout = luaL_checknumber(L, 3);
+		// Do it
+		env->getMap().setNodeTimer(pos, timeout);
+		return 0;
+	}
+
+	// EnvRef:get_node_timer(pos) -> time left or nil
+	static int l_get_node_timer(lua_State *L)
+	{
+		EnvRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+		// pos
+		v3s16 pos = read_v3s16(L, 2);
+		// Do it
+		float remaining = env->getMap().getNodeTimer(pos);
+		if(remaining < 0){
+			lua_pushnil(L);
+			return 1;
+		}
+		lua_pushnumber(L, remaining);
+		return 1;
+	}
+
 	// EnvRef:get_player_by_name(name)
 	static int l_get_player_by_name(lua_State *L)
 	{
@@ -3020,6 +3059,8 @@ const luaL_reg EnvRef::methods[] = {
 	method(EnvRef, add_rat),
 	method(EnvRef, add_firefly),
 	method(EnvRef, get_meta),
+	method(EnvRef, set_node_timer),
+	method(EnvRef, get_node_timer),
 	method(EnvRef, get_player_by_name),
 	method(EnvRef, get_objects_inside_radius),
 	method(EnvRef, set_timeofday),
@@ -4520,6 +4561,27 @@ bool scriptapi_node_on_dig(lua_State *L, v3s16 pos, MapNode node,
 	return true;
 }
 
+bool scriptapi_node_on_timer(lua_State *L, v3s16 pos, MapNode node,
+		float elapsed)
+{
+	realitycheck(L);
+	assert(lua_checkstack(L, 20));
+	StackUnroller stack_unroller(L);
+
+	INodeDefManager *ndef = get_server(L)->ndef();
+
+	// Push callback function on stack
+	if(!get_item_callback(L, ndef->get(node).name.c_str(), "on_timer"))
+		return false;
+
+	// Call function
+	push_v3s16(L, pos);
+	lua_pushnumber(L, elapsed);
+	if(lua_pcall(L, 2, 1, 0))
+		script_error(L, "error: %s", lua_tostring(L, -1));
+	return lua_toboolean(L, -1);
+}
+
 /*
 	environment
 */
@@ -71,6 +71,9 @@ bool scriptapi_node_on_punch(lua_State *L, v3s16 p, MapNode node,
 		ServerActiveObject *puncher);
 bool scriptapi_node_on_dig(lua_State *L, v3s16 p, MapNode node,
 		ServerActiveObject *digger);
+// Returns true if the timer should be started again
+bool scriptapi_node_on_timer(lua_State *L, v3s16 p, MapNode node,
+		float elapsed);
 
 /* luaentity */
 // Returns true if succesfully added into Lua; false otherwise.
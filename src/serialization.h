@@ -58,11 +58,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	20: many existing content types translated to extended ones
 	21: dynamic content type allocation
 	22: full 16-bit content types, minerals removed, facedir & wallmounted changed
+	23: node timers (on disk only)
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
-#define SER_FMT_VER_HIGHEST 22
+#define SER_FMT_VER_HIGHEST 23
 // Lowest supported serialization version
 #define SER_FMT_VER_LOWEST 0
 
@@ -46,6 +46,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapgen.h"
 #include "content_abm.h"
 #include "mods.h"
+#include "nameidmapping.h"
 #include "sha1.h"
 #include "base64.h"
 
@@ -115,6 +116,193 @@ void * ServerThread::Thread()
 	return NULL;
 }
 
+/*
+	BlockEmergeQueue
+*/
+
+// m_order_counter restarts from zero when it reaches this
+#define EMERGE_ORDER_COUNTER_END ((u64)1 << 48)
+
+BlockEmergeQueue::BlockEmergeQueue():
+	m_order_counter(0)
+{
+	m_mutex.Init();
+}
+
+BlockEmergeQueue::~BlockEmergeQueue()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(core::map<u64, QueuedBlockEmerge*>::Iterator
+			i = m_order.getIterator();
+			i.atEnd() == false; i++)
+	{
+		delete i.getNode()->getValue();
+	}
+	for(u32 i=0; i<m_deferred.capacity(); i++)
+	{
+		if(m_deferred.used(i))
+			delete m_deferred.valueAt(i);
+	}
+}
+
+void BlockEmergeQueue::addBlock(u16 peer_id, v3s16 pos, u8 flags,
+		u16 distance)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	JMutexAutoLock lock(m_mutex);
+
+	bool *in_progress_from_disk = m_in_progress.find(pos);
+	if(in_progress_from_disk != NULL)
+	{
+		/*
+			Being handled right now. Keep the request for when it is
+			done if it allows generating and the handling doesn't.
+		*/
+		if(*in_progress_from_disk == false
+				|| (flags & BLOCK_EMERGE_FLAG_FROMDISK))
+			return;
+		QueuedBlockEmerge *q;
+		QueuedBlockEmerge **dp = m_deferred.find(pos);
+		if(dp != NULL)
+		{
+			q = *dp;
+			if(distance < q->distance)
+				q->distance = distance;
+		}
+		else
+		{
+			q = new QueuedBlockEmerge;
+			q->pos = pos;
+			q->only_from_disk = true;
+			q->distance = distance;
+			m_deferred.set(pos, q);
+		}
+		addRequestNoLock(q, peer_id, flags);
+		return;
+	}
+
+	QueuedBlockEmerge **qp = m_index.find(pos);
+	if(qp != NULL)
+	{
+		/*
+			Block is already in queue.
+			Update the peer to it and move it forward if needed.
+		*/
+		QueuedBlockEmerge *q = *qp;
+		addRequestNoLock(q, peer_id, flags);
+		if(distance < q->distance)
+		{
+			m_order.remove(q->order_key);
+			m_index.remove(pos);
+			q->distance = distance;
+			enqueueNoLock(q);
+		}
+		return;
+	}
+
+	/*
+		Add the block
+	*/
+	QueuedBlockEmerge *q = new QueuedBlockEmerge;
+	q->pos = pos;
+	q->only_from_disk = true;
+	q->distance = distance;
+	addRequestNoLock(q, peer_id, flags);
+	enqueueNoLock(q);
+}
+
+QueuedBlockEmerge * BlockEmergeQueue::pop()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<u64, QueuedBlockEmerge*>::Iterator i = m_order.getIterator();
+	if(i.atEnd())
+		return NULL;
+	QueuedBlockEmerge *q = i.getNode()->getValue();
+	m_order.remove(q->order_key);
+	m_index.remove(q->pos);
+	m_in_progress.set(q->pos, q->only_from_disk);
+
+	for(core::map<u16, u8>::Iterator
+			j = q->peer_ids.getIterator();
+			j.atEnd() == false; j++)
+	{
+		u16 peer_id = j.getNode()->getKey();
+		u32 count = peerItemCountNoLock(peer_id);
+		if(count <= 1)
+			m_peer_counts.remove(peer_id);
+		else
+			m_peer_counts[peer_id] = count - 1;
+	}
+
+	return q;
+}
+
+void BlockEmergeQueue::done(v3s16 pos)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_in_progress.remove(pos);
+
+	QueuedBlockEmerge **dp = m_deferred.find(pos);
+	if(dp != NULL)
+	{
+		QueuedBlockEmerge *q = *dp;
+		m_deferred.remove(pos);
+		enqueueNoLock(q);
+	}
+}
+
+u32 BlockEmergeQueue::peerItemCountNoLock(u16 peer_id)
+{
+	core::map<u16, u32>::Node *n = m_peer_counts.find(peer_id);
+	if(n == NULL)
+		return 0;
+	return n->getValue();
+}
+
+void BlockEmergeQueue::addRequestNoLock(QueuedBlockEmerge *q, u16 peer_id,
+		u8 flags)
+{
+	if(peer_id != 0)
+	{
+		if(q->peer_ids.find(peer_id) == NULL)
+			m_peer_counts[peer_id] = peerItemCountNoLock(peer_id) + 1;
+		q->peer_ids[peer_id] = flags;
+	}
+	if((flags & BLOCK_EMERGE_FLAG_FROMDISK) == 0)
+		q->only_from_disk = false;
+}
+
+void BlockEmergeQueue::enqueueNoLock(QueuedBlockEmerge *q)
+{
+	if(m_order_counter == EMERGE_ORDER_COUNTER_END)
+		renumberNoLock();
+	q->order_key = ((u64)q->distance << 48) | m_order_counter++;
+	m_order.insert(q->order_key, q);
+	m_index.set(q->pos, q);
+}
+
+void BlockEmergeQueue::renumberNoLock()
+{
+	core::array<QueuedBlockEmerge*> queued;
+	for(core::map<u64, QueuedBlockEmerge*>::Iterator
+			i = m_order.getIterator();
+			i.atEnd() == false; i++)
+	{
+		queued.push_back(i.getNode()->getValue());
+	}
+	m_order.clear();
+	m_order_counter = 0;
+	for(u32 i=0; i<queued.size(); i++)
+	{
+		QueuedBlockEmerge *q = queued[i];
+		q->order_key = ((u64)q->distance << 48) | m_order_counter++;
+		m_order.insert(q->order_key, q);
+	}
+}
+
 void * EmergeThread::Thread()
 {
 	ThreadStarted();
@@ -148,7 +336,10 @@ void * EmergeThread::Thread()
 			Do not generate over-limit
 		*/
 		if(blockpos_over_limit(p))
+		{
+			m_server->m_emerge_queue.done(p);
 			continue;
+		}
 			
 		//infostream<<"EmergeThread::Thread(): running"<<std::endl;
 
@@ -162,27 +353,10 @@ void * EmergeThread::Thread()
 		*/
 		
 		/*
-			Check if any peer wants it as non-optional. In that case it
-			will be generated.
-
-			Also decrement the emerge queue count in clients.
+			If any request wants it as non-optional, it will be
+			generated.
 		*/
-
-		bool only_from_disk = true;
-
-		{
-			core::map<u16, u8>::Iterator i;
-			for(i=q->peer_ids.getIterator(); i.atEnd()==false; i++)
-			{
-				//u16 peer_id = i.getNode()->getKey();
-
-				// Check flags
-				u8 flags = i.getNode()->getValue();
-				if((flags & BLOCK_EMERGE_FLAG_FROMDISK) == false)
-					only_from_disk = false;
-				
-			}
-		}
+		bool only_from_disk = q->only_from_disk;
 		
 		if(enable_mapgen_debug_info)
 			infostream<<"EmergeThread: p="
@@ -203,6 +377,43 @@ void * EmergeThread::Thread()
 		bool started_generate = false;
 		mapgen::BlockMakeData data;
 
+		/*
+			If the block is not in memory at all, read and deserialize
+			it from disk without holding envlock.
+		*/
+		bool load_without_envlock = false;
+		u32 save_counter = 0;
+		{
+			JMutexAutoLock envlock(m_server->m_env_mutex);
+			if(map.getBlockNoCreateNoEx(p) == NULL)
+			{
+				load_without_envlock = true;
+				save_counter = map.getBlockSaveCounter();
+			}
+		}
+		g_profiler->add(load_without_envlock ?
+				"EmergeThread: block cache misses" :
+				"EmergeThread: block cache hits", 1);
+
+		MapBlock *loaded_block = NULL;
+		NameIdMapping loaded_nimap;
+		bool not_on_disk = false;
+		if(load_without_envlock)
+		{
+			ScopeProfiler sp(g_profiler, "EmergeThread: load block "
+					"(no envlock)", SPT_AVG);
+			loaded_block = map.loadBlockNoInsert(p, &loaded_nimap,
+					&not_on_disk);
+		}
+
+		/*
+			Lock the generation area if generating is possible, so that
+			no other thread generates blocks overlapping it.
+			This has to be done before envlock.
+		*/
+		if(only_from_disk == false)
+			map.lockBlockMakeArea(p);
+
 		{
 			JMutexAutoLock envlock(m_server->m_env_mutex);
 			
@@ -210,15 +421,26 @@ void * EmergeThread::Thread()
 			if(map.getSectorNoGenerateNoEx(p2d) == NULL)
 				map.loadSectorMeta(p2d);
 			
+			// Insert the block loaded above if it is still up-to-date
+			if(loaded_block)
+				map.insertLoadedBlock(loaded_block, loaded_nimap,
+						save_counter);
+			
 			// Attempt to load block
 			block = map.getBlockNoCreateNoEx(p);
 			if(!block || block->isDummy() || !block->isGenerated())
 			{
-				if(enable_mapgen_debug_info)
-					infostream<<"EmergeThread: not in memory, "
-							<<"attempting to load from disk"<<std::endl;
+				// No need to look again if nothing has been saved since
+				bool disk_checked = (block == NULL && not_on_disk &&
+						save_counter == map.getBlockSaveCounter());
+				if(!disk_checked)
+				{
+					if(enable_mapgen_debug_info)
+						infostream<<"EmergeThread: not in memory, "
+								<<"attempting to load from disk"<<std::endl;
 
-				block = map.loadBlock(p);
+					block = map.loadBlock(p);
+				}
 			}
 			
 			// If could not load and allowed to generate, start generation
@@ -293,6 +515,9 @@ void * EmergeThread::Thread()
 			}while(false);
 		}
 
+		if(only_from_disk == false)
+			map.unlockBlockMakeArea(p);
+
 		if(block == NULL)
 			got_block = false;
 			
@@ -328,6 +553,7 @@ void * EmergeThread::Thread()
 			}
 		}
 		
+		m_server->m_emerge_queue.done(p);
 	}
 
 	END_DEBUG_EXCEPTION_HANDLER(errorstream)
@@ -690,8 +916,8 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 					if(generate == false)
 						flags |= BLOCK_EMERGE_FLAG_FROMDISK;
 					
-					server->m_emerge_queue.addBlock(peer_id, p, flags);
-					server->m_emergethread.trigger();
+					server->m_emerge_queue.addBlock(peer_id, p, flags, d);
+					server->triggerEmergeThreads();
 
 					if(nearest_emerged_d == -1)
 						nearest_emerged_d = d;
@@ -853,7 +1079,6 @@ Server::Server(
 	m_nodedef(createNodeDefManager()),
 	m_craftdef(createCraftDefManager()),
 	m_thread(this),
-	m_emergethread(this),
 	m_time_counter(0),
 	m_time_of_day_send_timer(0),
 	m_uptime(0),
@@ -874,6 +1099,17 @@ Server::Server(
 	m_step_dtime_mutex.Init();
 	m_step_dtime = 0.0;
 
+	// Create emerge threads; they are started when needed
+	{
+		u16 thread_count = g_settings->getU16("num_emerge_threads");
+		if(thread_count == 0)
+			thread_count = 1;
+		for(u16 i=0; i<thread_count; i++)
+			m_emergethreads.push_back(new EmergeThread(this));
+		infostream<<"Server: Using "<<thread_count<<" emerge threads"
+				<<std::endl;
+	}
+
 	JMutexAutoLock envlock(m_env_mutex);
 	JMutexAutoLock conlock(m_con_mutex);
 
@@ -1037,6 +1273,13 @@ Server::~Server()
 			// Delete client
 			delete i.getNode()->getValue();
 		}
+
+		for(core::map<u16, core::array<RemoteClient*>* >::Iterator
+				i = m_object_subscribers.getIterator();
+				i.atEnd() == false; i++)
+		{
+			delete i.getNode()->getValue();
+		}
 	}
 
 	// Delete Environment
@@ -1048,6 +1291,13 @@ Server::~Server()
 	delete m_nodedef;
 	delete m_craftdef;
 	
+	// Delete emerge threads (stopped above)
+	for(core::list<EmergeThread*>::Iterator i = m_emergethreads.begin();
+			i != m_emergethreads.end(); i++)
+	{
+		delete *i;
+	}
+	
 	// Deinitialize scripting
 	infostream<<"Server: Deinitializing scripting"<<std::endl;
 	script_deinit(m_lua);
@@ -1078,9 +1328,13 @@ void Server::stop()
 
 	// Stop threads (set run=false first so both start stopping)
 	m_thread.setRun(false);
-	m_emergethread.setRun(false);
+	for(core::list<EmergeThread*>::Iterator i = m_emergethreads.begin();
+			i != m_emergethreads.end(); i++)
+		(*i)->setRun(false);
 	m_thread.stop();
-	m_emergethread.stop();
+	for(core::list<EmergeThread*>::Iterator i = m_emergethreads.begin();
+			i != m_emergethreads.end(); i++)
+		(*i)->stop();
 	
 	infostream<<"Server: Threads stopped"<<std::endl;
 }
@@ -1206,6 +1460,18 @@ void Server::AsyncRunStep()
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
 		m_env->getMap().timerUpdate(map_timer_and_unload_dtime,
 				g_settings->getFloat("server_unload_unused_data_timeout"));
+
+		// Then keep to the memory budget. Active blocks have their usage
+		// timers reset every couple of seconds, so they are never unloaded.
+		u64 budget = (u64)g_settings->getU16("server_map_memory_budget")
+				* 1024 * 1024;
+		if(budget != 0)
+		{
+			u32 evicted = m_env->getMap().unloadToMemoryBudget(budget,
+					2 * map_timer_and_unload_dtime);
+			g_profiler->add("Server: blocks evicted over memory budget",
+					evicted);
+		}
 	}
 	
 	/*
@@ -1327,22 +1593,16 @@ void Server::AsyncRunStep()
 		}
 #endif
 		/*
-			Set the modified blocks unsent for all the clients
+			Send the changes of the modified blocks to the clients
 		*/
 		
 		JMutexAutoLock lock2(m_con_mutex);
 
-		for(core::map<u16, RemoteClient*>::Iterator
-				i = m_clients.getIterator();
+		for(core::map<v3s16, MapBlock*>::Iterator
+				i = modified_blocks.getIterator();
 				i.atEnd() == false; i++)
 		{
-			RemoteClient *client = i.getNode()->getValue();
-			
-			if(modified_blocks.size() > 0)
-			{
-				// Remove block from sent history
-				client->SetBlocksNotSent(modified_blocks);
-			}
+			sendBlockChanges(i.getNode()->getKey());
 		}
 	}
 
@@ -1369,6 +1629,8 @@ void Server::AsyncRunStep()
 					continue;
 				infostream<<"* "<<player->getName()<<"\t";
 				client->PrintInfo(infostream);
+				infostream<<"  ";
+				m_con.PrintPeerInfo(client->peer_id, infostream);
 			}
 		}
 	}
@@ -1447,6 +1709,7 @@ void Server::AsyncRunStep()
 				
 				// Remove from known objects
 				client->m_known_objects.remove(i.getNode()->getKey());
+				unsubscribeObject(id, client);
 
 				if(obj && obj->m_known_by_count > 0)
 					obj->m_known_by_count--;
@@ -1485,6 +1748,7 @@ void Server::AsyncRunStep()
 
 				// Add to known objects
 				client->m_known_objects.insert(i.getNode()->getKey(), false);
+				subscribeObject(id, client);
 
 				if(obj)
 					obj->m_known_by_count++;
@@ -1541,75 +1805,52 @@ void Server::AsyncRunStep()
 
 		ScopeProfiler sp(g_profiler, "Server: sending object messages");
 
-		// Key = object id
-		// Value = data sent by object
-		core::map<u16, core::list<ActiveObjectMessage>* > buffered_messages;
-
-		// Get active object messages from environment
+		/*
+			Get active object messages from environment and add them
+			to the buffers of the clients that know the object.
+			Each message is encoded only once.
+		*/
+		std::string new_data;
 		for(;;)
 		{
 			ActiveObjectMessage aom = m_env->getActiveObjectMessage();
 			if(aom.id == 0)
 				break;
-			
-			core::list<ActiveObjectMessage>* message_list = NULL;
-			core::map<u16, core::list<ActiveObjectMessage>* >::Node *n;
-			n = buffered_messages.find(aom.id);
+
+			core::map<u16, core::array<RemoteClient*>* >::Node *n =
+					m_object_subscribers.find(aom.id);
 			if(n == NULL)
+				continue;
+			core::array<RemoteClient*> &subscribers = *n->getValue();
+
+			// Compose the full new data with header
+			new_data.clear();
+			// Add object id
+			char buf[2];
+			writeU16((u8*)&buf[0], aom.id);
+			new_data.append(buf, 2);
+			// Add data
+			new_data += serializeString(aom.datastring);
+
+			for(u32 i=0; i<subscribers.size(); i++)
 			{
-				message_list = new core::list<ActiveObjectMessage>;
-				buffered_messages.insert(aom.id, message_list);
-			}
-			else
-			{
-				message_list = n->getValue();
+				RemoteClient *client = subscribers[i];
+				if(aom.reliable)
+					client->m_object_messages_reliable += new_data;
+				else
+					client->m_object_messages_unreliable += new_data;
 			}
-			message_list->push_back(aom);
 		}
 		
-		// Route data to every client
+		// Send the buffers of every client
 		for(core::map<u16, RemoteClient*>::Iterator
 			i = m_clients.getIterator();
 			i.atEnd()==false; i++)
 		{
 			RemoteClient *client = i.getNode()->getValue();
-			std::string reliable_data;
-			std::string unreliable_data;
-			// Go through all objects in message buffer
-			for(core::map<u16, core::list<ActiveObjectMessage>* >::Iterator
-					j = buffered_messages.getIterator();
-					j.atEnd()==false; j++)
-			{
-				// If object is not known by client, skip it
-				u16 id = j.getNode()->getKey();
-				if(client->m_known_objects.find(id) == NULL)
-					continue;
-				// Get message list of object
-				core::list<ActiveObjectMessage>* list = j.getNode()->getValue();
-				// Go through every message
-				for(core::list<ActiveObjectMessage>::Iterator
-						k = list->begin(); k != list->end(); k++)
-				{
-					// Compose the full new data with header
-					ActiveObjectMessage aom = *k;
-					std::string new_data;
-					// Add object id
-					char buf[2];
-					writeU16((u8*)&buf[0], aom.id);
-					new_data.append(buf, 2);
-					// Add data
-					new_data += serializeString(aom.datastring);
-					// Add data to buffer
-					if(aom.reliable)
-						reliable_data += new_data;
-					else
-						unreliable_data += new_data;
-				}
-			}
-			/*
-				reliable_data and unreliable_data are now ready.
-				Send them.
-			*/
+			std::string &reliable_data = client->m_object_messages_reliable;
+			std::string &unreliable_data =
+					client->m_object_messages_unreliable;
 			if(reliable_data.size() > 0)
 			{
 				SharedBuffer<u8> reply(2 + reliable_data.size());
@@ -1636,14 +1877,10 @@ void Server::AsyncRunStep()
 						<<", unreliable: "<<unreliable_data.size()
 						<<std::endl;
 			}*/
-		}
 
-		// Clear buffered_messages
-		for(core::map<u16, core::list<ActiveObjectMessage>* >::Iterator
-				i = buffered_messages.getIterator();
-				i.atEnd()==false; i++)
-		{
-			delete i.getNode()->getValue();
+			// Keep the memory for the next step
+			reliable_data.clear();
+			unreliable_data.clear();
 		}
 	}
 
@@ -1703,7 +1940,7 @@ void Server::AsyncRunStep()
 			{
 				infostream<<"Server: MEET_BLOCK_NODE_METADATA_CHANGED"<<std::endl;
 				prof.add("MEET_BLOCK_NODE_METADATA_CHANGED", 1);
-				setBlockNotSent(event->p);
+				sendBlockChanges(event->p, true);
 			}
 			else if(event->type == MEET_OTHER)
 			{
@@ -1714,7 +1951,7 @@ void Server::AsyncRunStep()
 						i.atEnd()==false; i++)
 				{
 					v3s16 p = i.getNode()->getKey();
-					setBlockNotSent(p);
+					sendBlockChanges(p);
 				}
 			}
 			else
@@ -1779,7 +2016,7 @@ void Server::AsyncRunStep()
 		{
 			counter = 0.0;
 			
-			m_emergethread.trigger();
+			triggerEmergeThreads();
 		}
 	}
 
@@ -2352,11 +2589,12 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(blockpos);
 		if(block)
 		{
+			block->noteMetadataChanged();
 			block->raiseModified(MOD_STATE_WRITE_NEEDED,
 					"sign node text");
 		}
 
-		setBlockNotSent(blockpos);
+		sendBlockChanges(blockpos, true);
 	}
 	else if(command == TOSERVER_INVENTORY_ACTION)
 	{
@@ -2923,7 +3161,8 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 							<<" Adding block to emerge queue."
 							<<std::endl;
 					m_emerge_queue.addBlock(peer_id,
-							getNodeBlockPos(p_above), BLOCK_EMERGE_FLAG_FROMDISK);
+							getNodeBlockPos(p_above), BLOCK_EMERGE_FLAG_FROMDISK,
+							0);
 				}
 				if(n.getContent() != CONTENT_IGNORE)
 					scriptapi_node_on_punch(m_lua, p_under, n, srp);
@@ -2970,7 +3209,8 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 							<<" Adding block to emerge queue."
 							<<std::endl;
 					m_emerge_queue.addBlock(peer_id,
-							getNodeBlockPos(p_above), BLOCK_EMERGE_FLAG_FROMDISK);
+							getNodeBlockPos(p_above), BLOCK_EMERGE_FLAG_FROMDISK,
+							0);
 				}
 				if(n.getContent() != CONTENT_IGNORE)
 					scriptapi_node_on_dig(m_lua, p_under, n, srp);
@@ -3146,13 +3386,23 @@ void Server::setInventoryModified(const InventoryLocation &loc)
 
 		NodeMetadata *meta = m_env->getMap().getNodeMetadata(loc.p);
 		if(meta)
+		{
 			meta->inventoryModified();
+
+			// Wake up the metadata if it has become active
+			float interval = meta->getStepInterval();
+			if(interval > 0 && m_env->getMap().getNodeTimer(loc.p) < 0)
+				m_env->getMap().setNodeTimer(loc.p, interval);
+		}
 		
 		MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(blockpos);
 		if(block)
+		{
+			block->noteMetadataChanged();
 			block->raiseModified(MOD_STATE_WRITE_NEEDED);
+		}
 		
-		setBlockNotSent(blockpos);
+		sendBlockChanges(blockpos, true);
 	}
 	break;
 	default:
@@ -3603,6 +3853,88 @@ void Server::setBlockNotSent(v3s16 p)
 	}
 }
 
+void Server::sendBlockChanges(v3s16 p, bool metadata_changed)
+{
+	MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(p);
+	core::array<u16> changed;
+	bool block_metadata_changed = false;
+	if(block == NULL
+			|| block->takeChangedNodes(changed, &block_metadata_changed) == false)
+	{
+		g_profiler->add("Server: whole blocks resent", 1);
+		setBlockNotSent(p);
+		return;
+	}
+	// Nodes with metadata may have been removed or added by any kind
+	// of edit (eg. explosions), so don't rely on the caller only
+	if(block_metadata_changed)
+		metadata_changed = true;
+	if(changed.size() == 0 && metadata_changed == false)
+		return;
+
+	/*
+		Packet data after the command. Built for the serialization
+		version of the first client that needs it; the clients normally
+		all use the same version.
+	*/
+	std::string data;
+	u8 data_ver = SER_FMT_VER_INVALID;
+
+	for(core::map<u16, RemoteClient*>::Iterator
+		i = m_clients.getIterator();
+		i.atEnd()==false; i++)
+	{
+		RemoteClient *client = i.getNode()->getValue();
+
+		if(client->IsBlockSent(p) == false)
+			continue;
+
+		if(client->net_proto_version < 8)
+		{
+			client->SetBlockNotSent(p);
+			continue;
+		}
+
+		u8 ver = client->serialization_version;
+		if(ver != data_ver)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			writeV3S16(os, p);
+			writeU8(os, block->serializeFlags());
+			writeU16(os, changed.size());
+			u32 nodelen = MapNode::serializedLength(ver);
+			SharedBuffer<u8> nodebuf(nodelen);
+			for(u32 j=0; j<changed.size(); j++)
+			{
+				u16 index = changed[j];
+				v3s16 p_rel(index % MAP_BLOCKSIZE,
+						(index / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+						index / MAP_BLOCKSIZE / MAP_BLOCKSIZE);
+				writeU16(os, index);
+				block->getNodeNoCheck(p_rel).serialize(*nodebuf, ver);
+				os.write((char*)*nodebuf, nodelen);
+			}
+			writeU8(os, metadata_changed ? 1 : 0);
+			if(metadata_changed)
+			{
+				std::ostringstream oss(std::ios_base::binary);
+				block->m_node_metadata->serialize(oss);
+				compressZlib(oss.str(), os);
+			}
+			data = os.str();
+			data_ver = ver;
+		}
+
+		SharedBuffer<u8> reply(2 + data.size());
+		writeU16(&reply[0], TOCLIENT_BLOCK_DELTA);
+		memcpy(&reply[2], data.c_str(), data.size());
+		// Send as reliable, on the channel of the block data
+		m_con.Send(client->peer_id, 1, reply, true);
+
+		g_profiler->add("Server: block deltas sent", 1);
+	}
+}
+
 void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -3631,21 +3963,37 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 #endif
 
 	/*
-		Create a packet with the block in the right format
+		Create a packet with the block in the right format.
+		The serialized block is cached in the block, so that it is
+		serialized and compressed only once for all the clients.
 	*/
 	
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
+	const std::string *blockdata = block->getNetworkCache(ver);
+	if(blockdata == NULL)
+	{
+		std::ostringstream os(std::ios_base::binary);
+		block->serialize(os, ver, false);
+		block->setNetworkCache(ver, os.str());
+		blockdata = block->getNetworkCache(ver);
+		assert(blockdata);
+	}
+	else
+	{
+		g_profiler->add("Server: block data cache hits", 1);
+	}
 
-	u32 replysize = 8 + blockdata.getSize();
+	/*
+		The packet is not shared between peers because the reference
+		count of SharedBuffer is not thread-safe and the connection
+		thread holds on to the data.
+	*/
+	u32 replysize = 8 + blockdata->size();
 	SharedBuffer<u8> reply(replysize);
 	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
 	writeS16(&reply[2], p.X);
 	writeS16(&reply[4], p.Y);
 	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+	memcpy(&reply[8], blockdata->c_str(), blockdata->size());
 
 	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
 			<<":  \tpacket size: "<<replysize<<std::endl;*/
@@ -4052,6 +4400,46 @@ RemoteClient* Server::getClient(u16 peer_id)
 	return n->getValue();
 }
 
+void Server::subscribeObject(u16 id, RemoteClient *client)
+{
+	core::array<RemoteClient*> *subscribers = NULL;
+	core::map<u16, core::array<RemoteClient*>* >::Node *n =
+			m_object_subscribers.find(id);
+	if(n == NULL)
+	{
+		subscribers = new core::array<RemoteClient*>;
+		m_object_subscribers.insert(id, subscribers);
+	}
+	else
+	{
+		subscribers = n->getValue();
+	}
+	subscribers->push_back(client);
+}
+
+void Server::unsubscribeObject(u16 id, RemoteClient *client)
+{
+	core::map<u16, core::array<RemoteClient*>* >::Node *n =
+			m_object_subscribers.find(id);
+	if(n == NULL)
+		return;
+	core::array<RemoteClient*> *subscribers = n->getValue();
+	for(u32 i=0; i<subscribers->size(); i++)
+	{
+		if((*subscribers)[i] != client)
+			continue;
+		// Order does not matter
+		(*subscribers)[i] = (*subscribers)[subscribers->size()-1];
+		subscribers->erase(subscribers->size()-1);
+		break;
+	}
+	if(subscribers->size() == 0)
+	{
+		delete subscribers;
+		m_object_subscribers.remove(id);
+	}
+}
+
 std::wstring Server::getStatusString()
 {
 	std::wostringstream os(std::ios_base::binary);
@@ -4129,7 +4517,145 @@ void Server::queueBlockEmerge(v3s16 blockpos, bool allow_generate)
 	u8 flags = 0;
 	if(!allow_generate)
 		flags |= BLOCK_EMERGE_FLAG_FROMDISK;
-	m_emerge_queue.addBlock(PEER_ID_INEXISTENT, blockpos, flags);
+	
+	// Prioritize by the distance to the nearest player
+	u16 distance = 65535;
+	core::list<Player*> players = m_env->getPlayers(true);
+	for(core::list<Player*>::Iterator i = players.begin();
+			i != players.end(); i++)
+	{
+		v3s16 playerblockpos = getNodeBlockPos(
+				floatToInt((*i)->getPosition(), BS));
+		v3s16 diff = blockpos - playerblockpos;
+		u16 d = MYMAX(abs(diff.X), MYMAX(abs(diff.Y), abs(diff.Z)));
+		if(d < distance)
+			distance = d;
+	}
+	
+	m_emerge_queue.addBlock(PEER_ID_INEXISTENT, blockpos, flags, distance);
+}
+
+void Server::pregenerate(v3s16 nodepos_min, v3s16 nodepos_max, bool &kill)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v3s16 bmin = getNodeBlockPos(nodepos_min);
+	v3s16 bmax = getNodeBlockPos(nodepos_max);
+	if(bmin.X > bmax.X) { s16 t = bmin.X; bmin.X = bmax.X; bmax.X = t; }
+	if(bmin.Y > bmax.Y) { s16 t = bmin.Y; bmin.Y = bmax.Y; bmax.Y = t; }
+	if(bmin.Z > bmax.Z) { s16 t = bmin.Z; bmin.Z = bmax.Z; bmax.Z = t; }
+	v3s16 size = bmax - bmin + v3s16(1,1,1);
+	u64 total = (u64)size.X * size.Y * size.Z;
+
+	actionstream<<"Pregenerating "<<total<<" blocks from ("
+			<<bmin.X<<","<<bmin.Y<<","<<bmin.Z<<") to ("
+			<<bmax.X<<","<<bmax.Y<<","<<bmax.Z<<") (block coordinates)"
+			<<std::endl;
+
+	// Keep enough blocks queued for the threads, but not the whole area
+	u32 queue_max = 64 * m_emergethreads.size();
+	// Blocks are unloaded (and saved) soon after being generated
+	float unload_timeout = 5.0;
+
+	u64 queued = 0;
+	v3s16 p = bmin;
+	u32 start_time = porting::getTimeMs();
+	u32 last_time = start_time;
+	float progress_timer = 0.0;
+
+	for(;;)
+	{
+		if(kill)
+		{
+			actionstream<<"Pregenerating interrupted"<<std::endl;
+			break;
+		}
+
+		/*
+			Queue more blocks. Sectors are done one at a time from bottom
+			to top, which keeps the loaded area small.
+		*/
+		while(queued < total && m_emerge_queue.size() < queue_max)
+		{
+			// distance=0: generated in the order of queueing
+			m_emerge_queue.addBlock(PEER_ID_INEXISTENT, p, 0, 0);
+			queued++;
+			p.Y++;
+			if(p.Y > bmax.Y)
+			{
+				p.Y = bmin.Y;
+				p.X++;
+				if(p.X > bmax.X)
+				{
+					p.X = bmin.X;
+					p.Z++;
+				}
+			}
+		}
+		triggerEmergeThreads();
+
+		u64 pending = m_emerge_queue.size() + m_emerge_queue.inProgressCount();
+		u64 done = queued - pending;
+
+		sleep_ms(100);
+
+		u32 time = porting::getTimeMs();
+		float dtime = (float)(time - last_time) / 1000.0;
+		last_time = time;
+
+		{
+			JMutexAutoLock envlock(m_env_mutex);
+
+			// Nobody else runs liquids here
+			core::map<v3s16, MapBlock*> modified_blocks;
+			m_env->getMap().transformLiquids(modified_blocks);
+
+			// Saves modified blocks before unloading them
+			m_env->getMap().timerUpdate(dtime, unload_timeout);
+
+			// There are no clients to send map edits to
+			while(m_unsent_map_edit_queue.size() != 0)
+				delete m_unsent_map_edit_queue.pop_front();
+		}
+
+		/*
+			Print progress
+		*/
+		progress_timer += dtime;
+		bool finished = (queued == total && pending == 0);
+		if(progress_timer >= 5.0 || finished)
+		{
+			progress_timer = 0.0;
+			float elapsed = (float)(time - start_time) / 1000.0;
+			float bps = elapsed > 0.0 ? (float)done / elapsed : 0.0;
+			actionstream<<"Pregenerating: "<<done<<"/"<<total<<" blocks ("
+					<<(100 * done / total)<<"%), "
+					<<(u32)bps<<" blocks/s";
+			if(bps > 0.0 && !finished)
+			{
+				u32 eta = (u32)((float)(total - done) / bps);
+				actionstream<<", ETA "<<(eta/3600)<<"h "<<(eta/60%60)<<"min "
+						<<(eta%60)<<"s";
+			}
+			actionstream<<std::endl;
+		}
+
+		if(finished)
+			break;
+	}
+
+	/*
+		Stop the emerge threads and save everything
+	*/
+	stop();
+
+	{
+		JMutexAutoLock envlock(m_env_mutex);
+		m_env->getMap().save(MOD_STATE_WRITE_NEEDED);
+		m_env->saveMeta();
+	}
+
+	actionstream<<"Pregenerating done"<<std::endl;
 }
 
 // IGameDef interface
@@ -4382,6 +4908,8 @@ void Server::handlePeerChange(PeerChange &c)
 			
 			if(obj && obj->m_known_by_count > 0)
 				obj->m_known_by_count--;
+
+			unsubscribeObject(id, client);
 		}
 
 		ServerRemotePlayer* player =
@@ -4471,6 +4999,18 @@ void Server::handlePeerChanges()
 	}
 }
 
+void Server::triggerEmergeThreads()
+{
+	// Start a thread for each queued block, up to the number of threads.
+	// Idle threads exit when the queue is empty.
+	u32 queued = m_emerge_queue.size();
+	for(core::list<EmergeThread*>::Iterator i = m_emergethreads.begin();
+			i != m_emergethreads.end() && queued > 0; i++, queued--)
+	{
+		(*i)->trigger();
+	}
+}
+
 u64 Server::getPlayerPrivs(Player *player)
 {
 	if(player==NULL)
@@ -34,6 +34,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serverremoteplayer.h"
 #include "mods.h"
 #include "inventorymanager.h"
+#include "blockposmap.h"
 struct LuaState;
 typedef struct lua_State lua_State;
 class IWritableItemDefManager;
@@ -54,107 +55,91 @@ struct QueuedBlockEmerge
 	v3s16 pos;
 	// key = peer_id, value = flags
 	core::map<u16, u8> peer_ids;
+	// False if any request, also one without a peer, allows generating
+	bool only_from_disk;
+	// Distance to the nearest requester, in blocks
+	u16 distance;
+	// Key in BlockEmergeQueue::m_order
+	u64 order_key;
 };
 
 /*
+	Queue of blocks to be emerged.
+
+	Blocks are indexed by position so that adding a block that is
+	already queued is O(1), and they are popped in the order of distance
+	to the nearest player that requested them.
+
+	A block that has been popped is considered to be in progress until
+	done() is called for it; adding it again meanwhile is ignored.
+	The emerge thread sets the block unsent for all clients when it is
+	done, so the requesters will get it anyway. The exception is a
+	request that allows generating a block that is being only loaded;
+	it is kept and queued again by done().
+
 	This is a thread-safe class.
 */
 class BlockEmergeQueue
 {
 public:
-	BlockEmergeQueue()
-	{
-		m_mutex.Init();
-	}
-
-	~BlockEmergeQueue()
-	{
-		JMutexAutoLock lock(m_mutex);
-
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
-		{
-			QueuedBlockEmerge *q = *i;
-			delete q;
-		}
-	}
+	BlockEmergeQueue();
+	~BlockEmergeQueue();
 	
 	/*
-		peer_id=0 adds with nobody to send to
+		peer_id=0 adds with nobody to send to.
+		distance is the distance of the block from the requester.
 	*/
-	void addBlock(u16 peer_id, v3s16 pos, u8 flags)
-	{
-		DSTACK(__FUNCTION_NAME);
-	
-		JMutexAutoLock lock(m_mutex);
-
-		if(peer_id != 0)
-		{
-			/*
-				Find if block is already in queue.
-				If it is, update the peer to it and quit.
-			*/
-			core::list<QueuedBlockEmerge*>::Iterator i;
-			for(i=m_queue.begin(); i!=m_queue.end(); i++)
-			{
-				QueuedBlockEmerge *q = *i;
-				if(q->pos == pos)
-				{
-					q->peer_ids[peer_id] = flags;
-					return;
-				}
-			}
-		}
-		
-		/*
-			Add the block
-		*/
-		QueuedBlockEmerge *q = new QueuedBlockEmerge;
-		q->pos = pos;
-		if(peer_id != 0)
-			q->peer_ids[peer_id] = flags;
-		m_queue.push_back(q);
-	}
+	void addBlock(u16 peer_id, v3s16 pos, u8 flags, u16 distance);
 
 	// Returned pointer must be deleted
 	// Returns NULL if queue is empty
-	QueuedBlockEmerge * pop()
-	{
-		JMutexAutoLock lock(m_mutex);
+	QueuedBlockEmerge * pop();
 
-		core::list<QueuedBlockEmerge*>::Iterator i = m_queue.begin();
-		if(i == m_queue.end())
-			return NULL;
-		QueuedBlockEmerge *q = *i;
-		m_queue.erase(i);
-		return q;
-	}
+	// Call when a popped block has been handled
+	void done(v3s16 pos);
 
 	u32 size()
 	{
 		JMutexAutoLock lock(m_mutex);
-		return m_queue.size();
+		return m_index.size() + m_deferred.size();
+	}
+	
+	// Number of popped blocks that are not done yet
+	u32 inProgressCount()
+	{
+		JMutexAutoLock lock(m_mutex);
+		return m_in_progress.size();
 	}
 	
 	u32 peerItemCount(u16 peer_id)
 	{
 		JMutexAutoLock lock(m_mutex);
-
-		u32 count = 0;
-
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
-		{
-			QueuedBlockEmerge *q = *i;
-			if(q->peer_ids.find(peer_id) != NULL)
-				count++;
-		}
-
-		return count;
+		return peerItemCountNoLock(peer_id);
 	}
 
 private:
-	core::list<QueuedBlockEmerge*> m_queue;
+	u32 peerItemCountNoLock(u16 peer_id);
+	// Adds the requester and its flags to a queued block
+	void addRequestNoLock(QueuedBlockEmerge *q, u16 peer_id, u8 flags);
+	// Puts a block in m_index and m_order
+	void enqueueNoLock(QueuedBlockEmerge *q);
+	// Restarts m_order_counter, keeping the order of the queue
+	void renumberNoLock();
+
+	// Queued blocks by position
+	BlockPosMap<QueuedBlockEmerge*> m_index;
+	/*
+		Queued blocks by (distance, insertion order).
+		The key is distance << 48 | m_order_counter.
+	*/
+	core::map<u64, QueuedBlockEmerge*> m_order;
+	u64 m_order_counter;
+	// Number of queued blocks for each peer
+	core::map<u16, u32> m_peer_counts;
+	// Popped blocks that haven't been handled yet; value = only_from_disk
+	BlockPosMap<bool> m_in_progress;
+	// Requests to generate blocks that are being only loaded
+	BlockPosMap<QueuedBlockEmerge*> m_deferred;
 	JMutex m_mutex;
 };
 
@@ -307,6 +292,13 @@ class RemoteClient
 	void SetBlockNotSent(v3s16 p);
 	void SetBlocksNotSent(core::map<v3s16, MapBlock*> &blocks);
 
+	// Whether the block has been sent or is being sent to the client
+	bool IsBlockSent(v3s16 p)
+	{
+		return (m_blocks_sent.find(p) != NULL
+				|| m_blocks_sending.find(p) != NULL);
+	}
+
 	s32 SendingCount()
 	{
 		return m_blocks_sending.size();
@@ -343,6 +335,13 @@ class RemoteClient
 	*/
 	core::map<u16, bool> m_known_objects;
 
+	/*
+		Active object messages to the client are composed in these.
+		They are kept from step to step so that the memory is reused.
+	*/
+	std::string m_object_messages_reliable;
+	std::string m_object_messages_unreliable;
+
 private:
 	/*
 		Blocks that have been sent to client.
@@ -509,6 +508,14 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	void queueBlockEmerge(v3s16 blockpos, bool allow_generate);
 	
+	/*
+		Generates and saves all blocks of an area given in node
+		coordinates, using the emerge threads. Returns when done or when
+		kill is set.
+		For generating a world offline; call instead of start().
+	*/
+	void pregenerate(v3s16 nodepos_min, v3s16 nodepos_max, bool &kill);
+	
 	// Envlock and conlock should be locked when using Lua
 	lua_State *getLua(){ return m_lua; }
 	
@@ -575,6 +582,13 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void sendAddNode(v3s16 p, MapNode n, u16 ignore_id=0,
 			core::list<u16> *far_players=NULL, float far_d_nodes=100);
 	void setBlockNotSent(v3s16 p);
+	/*
+		Sends the changes of a block to the clients that have it.
+		The whole block is sent again if the changes are not known
+		or the client is too old for TOCLIENT_BLOCK_DELTA.
+		Envlock and conlock should be locked when calling this
+	*/
+	void sendBlockChanges(v3s16 p, bool metadata_changed=false);
 	
 	// Environment and Connection must be locked when called
 	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver);
@@ -599,6 +613,14 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	
 	// When called, connection mutex should be locked
 	RemoteClient* getClient(u16 peer_id);
+
+	/*
+		Maintain m_object_subscribers along with the known objects of
+		the clients.
+		When called, connection mutex should be locked
+	*/
+	void subscribeObject(u16 id, RemoteClient *client);
+	void unsubscribeObject(u16 id, RemoteClient *client);
 	
 	// When called, environment mutex should be locked
 	std::string getPlayerName(u16 peer_id)
@@ -625,6 +647,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	u64 getPlayerPrivs(Player *player);
 
+	// Starts enough emerge threads for the current queue
+	void triggerEmergeThreads();
+
 	/*
 		Variables
 	*/
@@ -649,6 +674,12 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	JMutex m_con_mutex;
 	// Connected clients (behind the con mutex)
 	core::map<u16, RemoteClient*> m_clients;
+	/*
+		The clients that know each active object, by object id.
+		Object messages are routed with this to only the interested
+		clients. (behind the con mutex)
+	*/
+	core::map<u16, core::array<RemoteClient*>* > m_object_subscribers;
 
 	// User authentication
 	AuthManager* m_authmanager;
@@ -683,9 +714,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// The server mainly operates in this thread
 	ServerThread m_thread;
-	// This thread fetches and generates map
-	EmergeThread m_emergethread;
-	// Queue of block coordinates to be processed by the emerge thread
+	// These threads fetch and generate map
+	core::list<EmergeThread*> m_emergethreads;
+	// Queue of block coordinates to be processed by the emerge threads
 	BlockEmergeQueue m_emerge_queue;
 	
 	/*
@@ -211,6 +211,9 @@ int main(int argc, char *argv[])
 	allowed_options.insert("enable-unittests", ValueSpec(VALUETYPE_FLAG));
 	allowed_options.insert("map-dir", ValueSpec(VALUETYPE_STRING));
 	allowed_options.insert("info-on-stderr", ValueSpec(VALUETYPE_FLAG));
+	allowed_options.insert("pregenerate", ValueSpec(VALUETYPE_STRING,
+			"Generate an area and exit: \"<minp> <maxp>\" in nodes, "
+			"e.g. \"(-500,-32,-500) (500,64,500)\""));
 
 	Settings cmd_args;
 	
@@ -349,8 +352,66 @@ int main(int argc, char *argv[])
 	else if(g_settings->exists("map-dir"))
 		map_dir = g_settings->get("map-dir");
 	
+	/*
+		Parse the area to pregenerate; any separators between the six
+		numbers are accepted
+	*/
+	bool pregenerate = false;
+	v3s16 pregen_minp, pregen_maxp;
+	if(cmd_args.exists("pregenerate"))
+	{
+		std::string s = cmd_args.get("pregenerate");
+		s32 v[6];
+		u32 count = 0;
+		bool valid = true;
+		for(u32 i=0; i<s.size() && count<6; )
+		{
+			bool digit = (s[i] >= '0' && s[i] <= '9');
+			bool sign = (s[i] == '-' && i+1 < s.size()
+					&& s[i+1] >= '0' && s[i+1] <= '9');
+			if(!digit && !sign)
+			{
+				i++;
+				continue;
+			}
+			u32 end = i + 1;
+			while(end < s.size() && s[end] >= '0' && s[end] <= '9')
+				end++;
+			// Longer numbers would overflow stoi()
+			if(end - i > 7)
+				valid = false;
+			else
+				v[count] = stoi(s.substr(i, end - i));
+			// The coordinates must be within the map
+			if(valid && (v[count] < -MAP_GENERATION_LIMIT
+					|| v[count] > MAP_GENERATION_LIMIT))
+				valid = false;
+			count++;
+			i = end;
+		}
+		if(count != 6 || !valid)
+		{
+			errorstream<<"Invalid --pregenerate area \""<<s<<"\"; "
+					<<"expected six node coordinates between "
+					<<-MAP_GENERATION_LIMIT<<" and "<<MAP_GENERATION_LIMIT
+					<<std::endl;
+			return 1;
+		}
+		pregen_minp = v3s16(v[0], v[1], v[2]);
+		pregen_maxp = v3s16(v[3], v[4], v[5]);
+		pregenerate = true;
+	}
+	
 	// Create server
 	Server server(map_dir.c_str(), configpath);
+
+	if(pregenerate)
+	{
+		// Generate without starting the network
+		server.pregenerate(pregen_minp, pregen_maxp, kill);
+		return 0;
+	}
+
 	server.start(port);
 
 	// Run server
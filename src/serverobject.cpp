@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include "inventory.h"
 #include "materials.h"
+#include "environment.h"
 
 ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 	ActiveObject(0),
@@ -29,11 +30,21 @@ ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 	m_pending_deactivation(false),
 	m_static_exists(false),
 	m_static_block(1337,1337,1337),
+	m_indexed(false),
+	m_index_unlimited(false),
+	m_index_block(0,0,0),
 	m_env(env),
 	m_base_position(pos)
 {
 }
 
+void ServerActiveObject::setBasePosition(v3f pos)
+{
+	m_base_position = pos;
+	if(m_indexed)
+		m_env->activeObjectMoved(this);
+}
+
 ServerActiveObject::~ServerActiveObject()
 {
 }
@@ -77,7 +77,8 @@ class ServerActiveObject : public ActiveObject
 		Some simple getters/setters
 	*/
 	v3f getBasePosition(){ return m_base_position; }
-	void setBasePosition(v3f pos){ m_base_position = pos; }
+	// Also updates the object index of the environment
+	void setBasePosition(v3f pos);
 	ServerEnvironment* getEnv(){ return m_env; }
 	
 	/*
@@ -198,6 +199,14 @@ class ServerActiveObject : public ActiveObject
 		a copy of the static data resides.
 	*/
 	v3s16 m_static_block;
+
+	/*
+		Set by ActiveObjectIndex of the environment.
+		m_index_block is the block in which the object is indexed.
+	*/
+	bool m_indexed;
+	bool m_index_unlimited;
+	v3s16 m_index_block;
 	
 	/*
 		Queue of messages to be sent to the client
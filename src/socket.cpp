@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
 #include "utility.h"
 
 // Debug printing options
@@ -177,6 +178,12 @@ UDPSocket::UDPSocket()
 #endif*/
 
 	setTimeoutMs(0);
+
+#ifdef USE_MMSG
+	m_mmsg_supported = true;
+#else
+	m_mmsg_supported = false;
+#endif
 }
 
 UDPSocket::~UDPSocket()
@@ -299,6 +306,127 @@ int UDPSocket::Receive(Address & sender, void * data, int size)
 	return received;
 }
 
+void UDPSocket::SendBatch(const UDPDatagram *datagrams, int count)
+{
+#ifdef USE_MMSG
+	// The debug options are handled by Send()
+	if(m_mmsg_supported && !DP && !INTERNET_SIMULATOR)
+	{
+		struct mmsghdr msgs[UDP_BATCH_MAX];
+		struct iovec iovecs[UDP_BATCH_MAX];
+		sockaddr_in addresses[UDP_BATCH_MAX];
+		int done = 0;
+		while(done < count)
+		{
+			int n = count - done;
+			if(n > UDP_BATCH_MAX)
+				n = UDP_BATCH_MAX;
+			memset(msgs, 0, sizeof(struct mmsghdr) * n);
+			for(int i=0; i<n; i++)
+			{
+				const UDPDatagram &d = datagrams[done + i];
+				addresses[i].sin_family = AF_INET;
+				addresses[i].sin_addr.s_addr = htonl(d.address.getAddress());
+				addresses[i].sin_port = htons(d.address.getPort());
+				iovecs[i].iov_base = d.data;
+				iovecs[i].iov_len = d.size;
+				msgs[i].msg_hdr.msg_name = &addresses[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				msgs[i].msg_hdr.msg_iov = &iovecs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			int sent = sendmmsg(m_handle, msgs, n, 0);
+			if(sent < 0 && errno == ENOSYS)
+			{
+				// Old kernel; send the rest one by one
+				m_mmsg_supported = false;
+				break;
+			}
+			if(sent <= 0)
+			{
+				// The first datagram failed; skip it
+				dstream<<"UDPSocket::SendBatch(): Failed to send packet to "
+						<<datagrams[done].address.serializeString()
+						<<std::endl;
+				sent = 1;
+			}
+			done += sent;
+		}
+		if(done == count)
+			return;
+		datagrams += done;
+		count -= done;
+	}
+#endif
+
+	for(int i=0; i<count; i++)
+	{
+		try{
+			Send(datagrams[i].address, datagrams[i].data, datagrams[i].size);
+		} catch(SendFailedException &e){
+			dstream<<"UDPSocket::SendBatch(): Failed to send packet to "
+					<<datagrams[i].address.serializeString()<<std::endl;
+		}
+	}
+}
+
+int UDPSocket::ReceiveBatch(UDPDatagram *datagrams, int count,
+		int buffer_size, bool wait)
+{
+	if(wait && WaitData(m_timeout_ms) == false)
+		return 0;
+
+#ifdef USE_MMSG
+	// The debug options are handled by Receive()
+	if(m_mmsg_supported && !DP)
+	{
+		if(count > UDP_BATCH_MAX)
+			count = UDP_BATCH_MAX;
+		struct mmsghdr msgs[UDP_BATCH_MAX];
+		struct iovec iovecs[UDP_BATCH_MAX];
+		sockaddr_in addresses[UDP_BATCH_MAX];
+		memset(msgs, 0, sizeof(struct mmsghdr) * count);
+		for(int i=0; i<count; i++)
+		{
+			iovecs[i].iov_base = datagrams[i].data;
+			iovecs[i].iov_len = buffer_size;
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int received = recvmmsg(m_handle, msgs, count, MSG_DONTWAIT, NULL);
+		if(received >= 0 || errno != ENOSYS)
+		{
+			if(received < 0)
+				return 0;
+			for(int i=0; i<received; i++)
+			{
+				datagrams[i].address = Address(
+						ntohl(addresses[i].sin_addr.s_addr),
+						ntohs(addresses[i].sin_port));
+				datagrams[i].size = msgs[i].msg_len;
+			}
+			return received;
+		}
+		// Old kernel; fall back to receiving one by one
+		m_mmsg_supported = false;
+	}
+#endif
+
+	int received = 0;
+	while(received < count && WaitData(0))
+	{
+		UDPDatagram &d = datagrams[received];
+		int size = Receive(d.address, d.data, buffer_size);
+		if(size < 0)
+			break;
+		d.size = size;
+		received++;
+	}
+	return received;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
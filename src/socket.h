@@ -42,6 +42,12 @@ typedef int socklen_t;
 	#include <netdb.h>
 	#include <unistd.h>
 typedef int socket_t;
+	// recvmmsg() and sendmmsg() are in glibc 2.14 and newer
+	#if defined(__linux__) && defined(__GLIBC__)
+		#if __GLIBC_PREREQ(2, 14)
+			#define USE_MMSG 1
+		#endif
+	#endif
 #endif
 
 #include <ostream>
@@ -103,6 +109,19 @@ class Address
 	unsigned short m_port;
 };
 
+// Maximum number of datagrams moved in one system call
+#define UDP_BATCH_MAX 32
+
+// A datagram for the batched functions of UDPSocket
+struct UDPDatagram
+{
+	// Sender or destination
+	Address address;
+	void *data;
+	// Size of the data; set by UDPSocket::ReceiveBatch()
+	int size;
+};
+
 class UDPSocket
 {
 public:
@@ -114,6 +133,20 @@ class UDPSocket
 	void Send(const Address & destination, const void * data, int size);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	/*
+		Batched versions of Send() and Receive(). On Linux these use
+		sendmmsg() and recvmmsg() to move many datagrams with a single
+		system call; elsewhere they loop the one-datagram functions.
+	*/
+	// Sends all the datagrams; the ones that fail are skipped
+	void SendBatch(const UDPDatagram *datagrams, int count);
+	/*
+		Receives up to count datagrams to buffers of buffer_size bytes.
+		If wait is true, waits for the first one for the time set by
+		setTimeoutMs(). Returns the number of datagrams received.
+	*/
+	int ReceiveBatch(UDPDatagram *datagrams, int count, int buffer_size,
+			bool wait);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
@@ -121,6 +154,8 @@ class UDPSocket
 private:
 	int m_handle;
 	int m_timeout_ms;
+	// Cleared if the kernel turns out not to support sendmmsg/recvmmsg
+	bool m_mmsg_supported;
 };
 
 #endif
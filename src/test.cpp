@@ -33,8 +33,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "nodedef.h"
 #include "mapsector.h"
+#include "mapblock.h"
 #include "settings.h"
 #include "log.h"
+#include "blockposmap.h"
+#include "noise.h"
+#include "nodetimer.h"
 
 /*
 	Asserts that the exception occurs
@@ -163,6 +167,145 @@ struct TestSettings
 	}
 };
 
+struct TestBlockPosMap
+{
+	void Run()
+	{
+		BlockPosMap<s32> m;
+		// Enough entries for a few rehashes, including negative positions
+		for(s16 z=-8; z<8; z++)
+		for(s16 y=-8; y<8; y++)
+		for(s16 x=-8; x<8; x++)
+			m.set(v3s16(x,y,z), x*10000+y*100+z);
+		assert(m.size() == 16*16*16);
+		assert(m.find(v3s16(-8,7,-3)) != NULL);
+		assert(*m.find(v3s16(-8,7,-3)) == -8*10000+7*100-3);
+		assert(m.find(v3s16(8,0,0)) == NULL);
+		assert(m.find(v3s16(-32768,32767,0)) == NULL);
+		// Replace
+		m.set(v3s16(1,2,3), 42);
+		assert(*m.find(v3s16(1,2,3)) == 42);
+		assert(m.size() == 16*16*16);
+		// Remove every other entry; the rest must stay reachable
+		for(s16 z=-8; z<8; z++)
+		for(s16 y=-8; y<8; y++)
+		for(s16 x=-8; x<8; x+=2)
+			assert(m.remove(v3s16(x,y,z)) == true);
+		assert(m.remove(v3s16(-8,0,0)) == false);
+		assert(m.size() == 16*16*8);
+		for(s16 z=-8; z<8; z++)
+		for(s16 y=-8; y<8; y++)
+		for(s16 x=-7; x<8; x+=2)
+		{
+			if(x == 1 && y == 2 && z == 3)
+				continue;
+			assert(m.find(v3s16(x,y,z)) != NULL);
+			assert(*m.find(v3s16(x,y,z)) == x*10000+y*100+z);
+		}
+		// Iteration
+		u32 count = 0;
+		for(u32 i=0; i<m.capacity(); i++)
+		{
+			if(!m.used(i))
+				continue;
+			v3s16 p = m.posAt(i);
+			assert(p.X % 2 != 0);
+			count++;
+		}
+		assert(count == m.size());
+		m.clear();
+		assert(m.size() == 0);
+		assert(m.find(v3s16(1,2,3)) == NULL);
+	}
+};
+
+struct TestNodeTimerList
+{
+	void Run()
+	{
+		NodeTimerList timers;
+		core::list<NodeTimerExpired> expired;
+
+		// Set and overwrite
+		timers.set(v3s16(1,2,3), 2.0);
+		timers.set(v3s16(4,5,6), 5.0);
+		timers.set(v3s16(7,8,9), 3.0);
+		assert(timers.size() == 3);
+		assert(fabs(timers.getRemaining(v3s16(1,2,3)) - 2.0) < 0.001);
+		timers.set(v3s16(1,2,3), 4.0);
+		assert(timers.size() == 3);
+		assert(fabs(timers.getRemaining(v3s16(1,2,3)) - 4.0) < 0.001);
+		assert(timers.getRemaining(v3s16(0,0,0)) < 0);
+
+		// Remove
+		timers.remove(v3s16(7,8,9));
+		assert(timers.size() == 2);
+		assert(timers.getRemaining(v3s16(7,8,9)) < 0);
+
+		// Nothing expires before its time; the restarted and the
+		// removed timer don't fire at their old times
+		timers.step(3.5, expired);
+		assert(expired.size() == 0);
+		assert(fabs(timers.getRemaining(v3s16(1,2,3)) - 0.5) < 0.001);
+
+		// Serialize/deSerialize; continue with the loaded list
+		NodeTimerList timers2;
+		{
+			std::ostringstream os(std::ios_base::binary);
+			timers.serialize(os);
+			std::istringstream is(os.str(), std::ios_base::binary);
+			timers2.deSerialize(is);
+		}
+		assert(timers2.size() == 2);
+		assert(fabs(timers2.getRemaining(v3s16(1,2,3)) - 0.5) < 0.001);
+		assert(fabs(timers2.getRemaining(v3s16(4,5,6)) - 1.5) < 0.001);
+
+		// Expire one
+		timers2.step(1.0, expired);
+		assert(expired.size() == 1);
+		assert(expired.begin()->p == v3s16(1,2,3));
+		assert(fabs(expired.begin()->timeout - 4.0) < 0.001);
+		assert(fabs(expired.begin()->elapsed - 4.5) < 0.001);
+		assert(timers2.size() == 1);
+		assert(timers2.getRemaining(v3s16(1,2,3)) < 0);
+
+		// Expire the rest
+		expired.clear();
+		timers2.step(1.0, expired);
+		assert(expired.size() == 1);
+		assert(expired.begin()->p == v3s16(4,5,6));
+		assert(timers2.size() == 0);
+	}
+};
+
+struct TestNoise
+{
+	void Run()
+	{
+		// Batch noise must give the same values as point noise.
+		// They are bit-identical unless built with -ffast-math.
+		const int count = 300;
+		double x[count], y[count], z[count], r[count];
+		for(int i=0; i<count; i++)
+		{
+			// Includes negative and integer coordinates
+			x[i] = -20.0 + 0.25*(i%50);
+			y[i] = -(double)(i/50);
+			z[i] = 0.37*i - 50.0;
+		}
+		noise3d_perlin_batch(x, y, z, count, 42, 4, 0.6, false, r);
+		for(int i=0; i<count; i++)
+			assert(fabs(r[i] - noise3d_perlin(x[i], y[i], z[i], 42, 4, 0.6)) < 1e-9);
+		noise2d_perlin_batch(x, z, count, 43, 3, 0.5, true, r);
+		for(int i=0; i<count; i++)
+			assert(fabs(r[i] - noise2d_perlin_abs(x[i], z[i], 43, 3, 0.5)) < 1e-9);
+		NoiseParams param(NOISE_PERLIN_CONTOUR_FLIP_YZ, 44, 3, 0.5, 10.0, 2.0);
+		noise3d_param_batch(param, x, y, z, count, r);
+		for(int i=0; i<count; i++)
+			assert(fabs(r[i] - noise3d_param(param, x[i], y[i], z[i])) < 1e-9);
+	}
+};
+
 struct TestSerialization
 {
 	// To be used like this:
@@ -485,6 +628,287 @@ struct TestVoxelManipulator
 	}
 };
 
+/*
+	Compares the light spreading of VoxelManipulator to the recursive
+	algorithm it replaced, which is kept here as a reference.
+*/
+struct TestVoxelLighting
+{
+	// The old recursive VoxelManipulator::spreadLight()
+	void refSpreadLight(VoxelManipulator &v, enum LightBank bank, v3s16 p,
+			INodeDefManager *ndef)
+	{
+		MapNode &n = v.m_data[v.m_area.index(p)];
+		u8 oldlight = n.getLight(bank, ndef);
+		u8 newlight = diminish_light(oldlight);
+		for(u16 i=0; i<6; i++)
+		{
+			v3s16 n2pos = p + g_6dirs[i];
+			if(v.m_area.contains(n2pos) == false)
+				continue;
+			MapNode &n2 = v.m_data[v.m_area.index(n2pos)];
+			u8 light2 = n2.getLight(bank, ndef);
+			if(light2 > undiminish_light(oldlight))
+				refSpreadLight(v, bank, n2pos, ndef);
+			if(light2 < newlight && ndef->get(n2).light_propagates)
+			{
+				n2.setLight(bank, newlight, ndef);
+				refSpreadLight(v, bank, n2pos, ndef);
+			}
+		}
+	}
+
+	// The old recursive VoxelManipulator::unspreadLight()
+	void refUnspreadLight(VoxelManipulator &v, enum LightBank bank, v3s16 p,
+			u8 oldlight, core::map<v3s16, bool> &light_sources,
+			INodeDefManager *ndef)
+	{
+		for(u16 i=0; i<6; i++)
+		{
+			v3s16 n2pos = p + g_6dirs[i];
+			if(v.m_area.contains(n2pos) == false)
+				continue;
+			MapNode &n2 = v.m_data[v.m_area.index(n2pos)];
+			u8 light2 = n2.getLight(bank, ndef);
+			if(light2 < oldlight)
+			{
+				if(ndef->get(n2).light_propagates && light2 != 0)
+				{
+					n2.setLight(bank, 0, ndef);
+					refUnspreadLight(v, bank, n2pos, light2, light_sources,
+							ndef);
+				}
+			}
+			else
+			{
+				light_sources.insert(n2pos, true);
+			}
+		}
+	}
+
+	// Air with a stone wall that light has to go around
+	void fill(VoxelManipulator &v)
+	{
+		VoxelArea a(v3s16(-12,-12,-12), v3s16(12,12,12));
+		v.addArea(a);
+		for(s16 z=-12; z<=12; z++)
+		for(s16 y=-12; y<=12; y++)
+		for(s16 x=-12; x<=12; x++)
+		{
+			MapNode n(CONTENT_AIR);
+			if(x == 2 && !(y == 0 && z == 5))
+				n = MapNode(CONTENT_STONE);
+			v.setNodeNoRef(v3s16(x,y,z), n);
+		}
+	}
+
+	void compare(VoxelManipulator &v, VoxelManipulator &ref,
+			enum LightBank bank, INodeDefManager *ndef)
+	{
+		for(s16 z=-12; z<=12; z++)
+		for(s16 y=-12; y<=12; y++)
+		for(s16 x=-12; x<=12; x++)
+		{
+			v3s16 p(x,y,z);
+			assert(v.getNode(p).getLight(bank, ndef)
+					== ref.getNode(p).getLight(bank, ndef));
+		}
+	}
+
+	void addLight(VoxelManipulator &v, VoxelManipulator &ref,
+			enum LightBank bank, v3s16 p, INodeDefManager *ndef)
+	{
+		v.getNodeRef(p).setLight(bank, LIGHT_MAX, ndef);
+		ref.getNodeRef(p).setLight(bank, LIGHT_MAX, ndef);
+		v.spreadLight(bank, p, ndef);
+		refSpreadLight(ref, bank, p, ndef);
+	}
+
+	void removeLight(VoxelManipulator &v, VoxelManipulator &ref,
+			enum LightBank bank, v3s16 p, INodeDefManager *ndef)
+	{
+		u8 oldlight = v.getNode(p).getLight(bank, ndef);
+		assert(oldlight == ref.getNode(p).getLight(bank, ndef));
+		v.getNodeRef(p).setLight(bank, 0, ndef);
+		ref.getNodeRef(p).setLight(bank, 0, ndef);
+
+		core::map<v3s16, bool> light_sources;
+		v.unspreadLight(bank, p, oldlight, light_sources, ndef);
+		v.spreadLight(bank, light_sources, ndef);
+
+		core::map<v3s16, bool> ref_light_sources;
+		refUnspreadLight(ref, bank, p, oldlight, ref_light_sources, ndef);
+		for(core::map<v3s16, bool>::Iterator
+				i = ref_light_sources.getIterator();
+				i.atEnd() == false; i++)
+			refSpreadLight(ref, bank, i.getNode()->getKey(), ndef);
+	}
+
+	void Run(INodeDefManager *ndef)
+	{
+		enum LightBank bank = LIGHTBANK_NIGHT;
+		VoxelManipulator v;
+		VoxelManipulator ref;
+		fill(v);
+		fill(ref);
+		v3s16 a(-3,0,0);
+		v3s16 b(6,1,-2);
+
+		addLight(v, ref, bank, a, ndef);
+		compare(v, ref, bank, ndef);
+		assert(v.getNode(v3s16(-3,0,4)).getLight(bank, ndef) == LIGHT_MAX-4);
+		// Through the hole in the wall
+		assert(v.getNode(v3s16(3,0,5)).getLight(bank, ndef) == LIGHT_MAX-11);
+		assert(v.getNode(v3s16(3,0,-5)).getLight(bank, ndef) == 0);
+
+		addLight(v, ref, bank, b, ndef);
+		compare(v, ref, bank, ndef);
+
+		removeLight(v, ref, bank, a, ndef);
+		compare(v, ref, bank, ndef);
+		assert(v.getNode(a).getLight(bank, ndef) == 0);
+		assert(v.getNode(v3s16(6,1,0)).getLight(bank, ndef) == LIGHT_MAX-2);
+
+		removeLight(v, ref, bank, b, ndef);
+		compare(v, ref, bank, ndef);
+		assert(v.getNode(v3s16(6,1,0)).getLight(bank, ndef) == 0);
+	}
+};
+
+struct TestMapBlockStorage
+{
+	// Checks block contents against a reference array
+	bool equals(MapBlock &b, MapNode *ref)
+	{
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			u32 i = z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x;
+			if(!(b.getNodeNoCheck(x,y,z) == ref[i]))
+				return false;
+		}
+		return true;
+	}
+
+	void Run()
+	{
+		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+		MapNode *ref = new MapNode[nodecount];
+		for(u32 i=0; i<nodecount; i++)
+			ref[i] = MapNode(CONTENT_IGNORE);
+
+		MapBlock b(NULL, v3s16(0,0,0), NULL);
+
+		// New blocks are uniform
+		assert(b.isDummy() == false);
+		assert(b.isCompact());
+		assert(b.getNodeMemoryUsage() == sizeof(MapNode));
+		assert(equals(b, ref));
+
+		// A few different nodes fit in the palette
+		for(u32 i=0; i<nodecount; i+=7)
+		{
+			MapNode n(i % 5, i % 3, 0);
+			b.setNodeNoCheck(i % MAP_BLOCKSIZE,
+					(i / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+					i / MAP_BLOCKSIZE / MAP_BLOCKSIZE, n);
+			ref[i] = n;
+		}
+		assert(b.isCompact());
+		assert(equals(b, ref));
+
+		// Many different nodes expand it
+		for(u32 i=0; i<nodecount; i+=3)
+		{
+			MapNode n(i % 40, 0, i % 2);
+			b.setNodeNoCheck(i % MAP_BLOCKSIZE,
+					(i / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+					i / MAP_BLOCKSIZE / MAP_BLOCKSIZE, n);
+			ref[i] = n;
+		}
+		assert(b.isCompact() == false);
+		assert(equals(b, ref));
+
+		// Compacting keeps the contents
+		b.compact();
+		assert(b.isCompact());
+		assert(b.getNodeMemoryUsage() < nodecount * sizeof(MapNode));
+		assert(equals(b, ref));
+
+		// Existing nodes are written in place
+		v3s16 p(1,2,3);
+		MapNode n = b.getNodeNoCheck(4,5,6);
+		b.setNode(p, n);
+		ref[3*MAP_BLOCKSIZE*MAP_BLOCKSIZE + 2*MAP_BLOCKSIZE + 1] = n;
+		assert(b.isCompact());
+		assert(equals(b, ref));
+
+		b.expand();
+		assert(b.isCompact() == false);
+		assert(equals(b, ref));
+
+		// Content lookup finds exactly the nodes with the content
+		u32 bits[CONTENT_BITMAP_WORDS];
+		memset(bits, 0, sizeof(bits));
+		contentBitmapSet(bits, 39);
+		u16 *found = new u16[nodecount];
+		u32 found_count = b.findNodesWithContent(bits, found);
+		u32 ref_count = 0;
+		for(u32 i=0; i<nodecount; i++)
+		{
+			if(ref[i].getContent() != 39)
+				continue;
+			assert(ref_count < found_count && found[ref_count] == i);
+			ref_count++;
+		}
+		assert(ref_count != 0 && found_count == ref_count);
+		b.compact();
+		assert(b.findNodesWithContent(bits, found) == ref_count);
+		delete[] found;
+		b.expand();
+
+		// Uniform content compacts to a single node
+		for(u32 i=0; i<nodecount; i++)
+			ref[i] = MapNode(CONTENT_AIR, 0xff);
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+			b.setNodeNoCheck(x, y, z, ref[0]);
+		b.compact();
+		assert(b.getNodeMemoryUsage() == sizeof(MapNode));
+		assert(equals(b, ref));
+		assert(b.mayContainAny(bits) == false);
+		contentBitmapSet(bits, CONTENT_AIR);
+		assert(b.mayContainAny(bits));
+
+		// Changed nodes are tracked until there are too many of them
+		core::array<u16> changed;
+		bool meta_changed = true;
+		assert(b.takeChangedNodes(changed, &meta_changed) == false);
+		assert(meta_changed == false);
+		b.setNode(v3s16(1,2,3), n);
+		b.setNode(v3s16(1,2,3), n);
+		b.setNode(v3s16(4,5,6), n);
+		assert(b.takeChangedNodes(changed, &meta_changed));
+		assert(changed.size() == 2);
+		assert(changed[0] == 3*MAP_BLOCKSIZE*MAP_BLOCKSIZE + 2*MAP_BLOCKSIZE + 1);
+		changed.clear();
+		b.noteMetadataChanged();
+		assert(b.takeChangedNodes(changed, &meta_changed) && changed.size() == 0);
+		assert(meta_changed);
+		assert(b.takeChangedNodes(changed, &meta_changed));
+		assert(meta_changed == false);
+		for(u32 i=0; i<nodecount; i+=2)
+			b.setNodeNoCheck(i % MAP_BLOCKSIZE,
+					(i / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+					i / MAP_BLOCKSIZE / MAP_BLOCKSIZE, n);
+		assert(b.takeChangedNodes(changed, &meta_changed) == false);
+
+		delete[] ref;
+	}
+};
+
 /*
 	NOTE: These tests became non-working then NodeContainer was removed.
 	      These should be redone, utilizing some kind of a virtual
@@ -846,6 +1270,23 @@ struct TestSocket
 
 struct TestConnection
 {
+	// Inserts a chunk of a split packet of 10 bytes in 2 chunks
+	SharedBuffer<u8> insertSplitChunk(con::IncomingSplitBuffer &sb,
+			u16 seqnum, u32 chunk_num, bool reliable)
+	{
+		SharedBuffer<u8> data(10);
+		memset(*data, 1, data.getSize());
+		core::list<SharedBuffer<u8> > chunks =
+				con::makeSplitPacket(data, 12, seqnum);
+		assert(chunks.size() == 2);
+		core::list<SharedBuffer<u8> >::Iterator i = chunks.begin();
+		if(chunk_num == 1)
+			i++;
+		Address a(127,0,0,1, 10);
+		con::BufferedPacket p = con::makePacket(a, *i, 0x12345678, 123, 2);
+		return sb.insert(p, reliable);
+	}
+
 	void TestHelpers()
 	{
 		/*
@@ -891,6 +1332,116 @@ struct TestConnection
 		assert(readU8(&p2[0]) == TYPE_RELIABLE);
 		assert(readU16(&p2[1]) == seqnum);
 		assert(readU8(&p2[3]) == data1[0]);
+
+		/*
+			Reliable packets come out of the buffer in seqnum order,
+			also across the wrap-around of seqnums
+		*/
+		con::ReliablePacketBuffer rb;
+		for(u32 i=0; i<300; i++)
+		{
+			u16 s = 65500 + (i * 7) % 300;
+			SharedBuffer<u8> data = con::makeReliablePacket(data1, s);
+			con::BufferedPacket p = con::makePacket(a, data,
+					proto_id, peer_id, channel);
+			rb.insert(p);
+			rb.incrementTimeouts(0.01);
+		}
+		assert(rb.size() == 300);
+		assert(rb.anyTotaltimeReached(2.95));
+		assert(rb.anyTotaltimeReached(3.05) == false);
+		assert(rb.getTimedOuts(0.995).size() == 201);
+		rb.resetTimedOuts(0.995);
+		assert(rb.getTimedOuts(0.995).size() == 0);
+		rb.popSeqnum((u16)(65500 + 150));
+		for(u32 i=0; i<300; i++)
+		{
+			if(i == 150)
+				continue;
+			assert(rb.getFirstSeqnum() == (u16)(65500 + i));
+			rb.popFirst();
+		}
+		assert(rb.empty());
+
+		// Seqnums too far from the buffered ones are refused
+		{
+			SharedBuffer<u8> data = con::makeReliablePacket(data1, 100);
+			con::BufferedPacket p = con::makePacket(a, data,
+					proto_id, peer_id, channel);
+			rb.insert(p);
+			data = con::makeReliablePacket(data1,
+					100 + RELIABLE_BUFFER_MAX_SIZE);
+			p = con::makePacket(a, data, proto_id, peer_id, channel);
+			bool refused = false;
+			try{
+				rb.insert(p);
+			}
+			catch(ContainerFullException &e){
+				refused = true;
+			}
+			assert(refused);
+			assert(rb.size() == 1);
+			rb.popFirst();
+		}
+
+		/*
+			Split packets with too many chunks are refused, and a full
+			split buffer drops unreliable packets to make room
+		*/
+		{
+			con::IncomingSplitBuffer sb;
+			SharedBuffer<u8> b(8);
+			writeU8(&b[0], TYPE_SPLIT);
+			writeU16(&b[1], 0);
+			writeU16(&b[3], SPLIT_CHUNK_COUNT_MAX + 1);
+			writeU16(&b[5], 0);
+			writeU8(&b[7], 0);
+			con::BufferedPacket p = con::makePacket(a, b,
+					proto_id, peer_id, channel);
+			bool refused = false;
+			try{
+				sb.insert(p, false);
+			}
+			catch(con::InvalidIncomingDataException &e){
+				refused = true;
+			}
+			assert(refused);
+
+			for(u32 i=0; i<SPLIT_BUFFER_MAX_SIZE; i++)
+				assert(insertSplitChunk(sb, i, 0, false).getSize() == 0);
+			// Drops 0, which is in the same slot
+			u16 s = SPLIT_BUFFER_MAX_SIZE;
+			assert(insertSplitChunk(sb, s, 0, false).getSize() == 0);
+			assert(insertSplitChunk(sb, s, 1, false).getSize() == 10);
+			assert(insertSplitChunk(sb, 0, 1, false).getSize() == 0);
+			// Reliable ones are not dropped
+			s = SPLIT_BUFFER_MAX_SIZE * 2;
+			assert(insertSplitChunk(sb, s, 0, true).getSize() == 0);
+			refused = false;
+			try{
+				s = SPLIT_BUFFER_MAX_SIZE * 3;
+				insertSplitChunk(sb, s, 0, false);
+			}
+			catch(con::InvalidIncomingDataException &e){
+				refused = true;
+			}
+			assert(refused);
+		}
+
+		/*
+			Congestion window grows with acks and is halved only once
+			per resend timeout
+		*/
+		con::Peer peer(peer_id, a);
+		float window = peer.congestion_window;
+		peer.reportAck();
+		assert(peer.congestion_window > window);
+		window = peer.congestion_window;
+		peer.reportLoss(3);
+		assert(fabs(peer.congestion_window - window / 2) < 0.001);
+		peer.reportLoss(2);
+		assert(fabs(peer.congestion_window - window / 2) < 0.001);
+		assert(peer.resent_count == 5 && peer.loss_count == 1);
 	}
 
 	struct Handler : public con::PeerHandler
@@ -922,6 +1473,29 @@ struct TestConnection
 		const char *name;
 	};
 
+	/*
+		Waits for a data packet with the given contents and returns its
+		sender. Other packets are skipped. Returns 0 on timeout.
+	*/
+	u16 receiveData(con::Connection &con, SharedBuffer<u8> &contents)
+	{
+		u32 timems0 = porting::getTimeMs();
+		while(porting::getTimeMs() - timems0 < 5000)
+		{
+			try{
+				u16 peer_id;
+				SharedBuffer<u8> data;
+				con.Receive(peer_id, data);
+				if(data.getSize() == contents.getSize() && memcmp(*data,
+						*contents, data.getSize()) == 0)
+					return peer_id;
+			}catch(con::NoIncomingDataException &e){
+			}
+			sleep_ms(10);
+		}
+		return 0;
+	}
+
 	void Run()
 	{
 		DSTACK("TestConnection::Run");
@@ -1242,7 +1816,71 @@ struct TestConnection
 		assert(hand_client.last_id == 1);
 		assert(hand_server.count == 1);
 		assert(hand_server.last_id == 2);
-		
+
+		/*
+			A second client can connect while the first one has an
+			established peer id
+		*/
+		{
+			Handler hand_client2("client2");
+			con::Connection client2(proto_id, 512, 5.0, &hand_client2);
+			client2.Connect(server_address);
+
+			SharedBuffer<u8> data = SharedBufferFromString("Hello again!");
+			client2.Send(PEER_ID_SERVER, 0, data, true);
+
+			u16 peer_id = 132;
+			SharedBuffer<u8> recvdata;
+			bool received = false;
+			u32 timems0 = porting::getTimeMs();
+			while(received == false
+					&& porting::getTimeMs() - timems0 < 5000)
+			{
+				try{
+					// Let the client handle the new peer id
+					u16 client_peer_id;
+					SharedBuffer<u8> client_data;
+					client2.Receive(client_peer_id, client_data);
+				}catch(con::NoIncomingDataException &e){
+				}
+				try{
+					server.Receive(peer_id, recvdata);
+					received = (peer_id == 3);
+				}catch(con::NoIncomingDataException &e){
+				}
+				sleep_ms(10);
+			}
+			assert(received);
+			assert(memcmp(*data, *recvdata, data.getSize()) == 0);
+			assert(hand_server.count == 2);
+			assert(hand_server.last_id == 3);
+			assert(hand_client2.last_id == 1);
+		}
+
+		/*
+			Packets without a peer id from a known address belong to
+			the existing peer, also after it has sent with its id.
+			Those are resends of the packets sent before getting the id.
+		*/
+		{
+			UDPSocket socket;
+			// Not the address of any previous client
+			socket.Bind(30002);
+			SharedBuffer<u8> data = SharedBufferFromString("Raw");
+			SharedBuffer<u8> original = con::makeOriginalPacket(data);
+			con::BufferedPacket p0 = con::makePacket(server_address,
+					original, proto_id, PEER_ID_INEXISTENT, 0);
+			socket.Send(server_address, *p0.data, p0.data.getSize());
+			u16 raw_peer_id = receiveData(server, data);
+			assert(raw_peer_id >= 2);
+			con::BufferedPacket p1 = con::makePacket(server_address,
+					original, proto_id, raw_peer_id, 0);
+			socket.Send(server_address, *p1.data, p1.data.getSize());
+			assert(receiveData(server, data) == raw_peer_id);
+			socket.Send(server_address, *p0.data, p0.data.getSize());
+			assert(receiveData(server, data) == raw_peer_id);
+		}
+
 		//assert(0);
 	}
 };
@@ -1276,10 +1914,15 @@ void run_tests()
 	infostream<<"run_tests() started"<<std::endl;
 	TEST(TestUtilities);
 	TEST(TestSettings);
+	TEST(TestBlockPosMap);
+	TEST(TestNodeTimerList);
+	TEST(TestNoise);
 	TEST(TestCompress);
 	TEST(TestSerialization);
 	TESTPARAMS(TestMapNode, ndef);
 	TESTPARAMS(TestVoxelManipulator, ndef);
+	TESTPARAMS(TestVoxelLighting, ndef);
+	TEST(TestMapBlockStorage);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	if(INTERNET_SIMULATOR == false){
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "utility.h" // For TimeTaker
 #include "gettime.h"
 #include "nodedef.h"
+#include "lighting.h"
 
 /*
 	Debug stuff
@@ -282,70 +283,13 @@ void VoxelManipulator::clearFlag(u8 flags)
 void VoxelManipulator::unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
 		core::map<v3s16, bool> & light_sources, INodeDefManager *nodemgr)
 {
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-	
-	emerge(VoxelArea(p - v3s16(1,1,1), p + v3s16(1,1,1)));
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-		
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-		
-		/*
-			If the neighbor is dimmer than what was specified
-			as oldlight (the light of the previous node)
-		*/
-		u8 light2 = n2.getLight(bank, nodemgr);
-		if(light2 < oldlight)
-		{
-			/*
-				And the neighbor is transparent and it has some light
-			*/
-			if(nodemgr->get(n2).light_propagates && light2 != 0)
-			{
-				/*
-					Set light to 0 and add to queue
-				*/
-
-				n2.setLight(bank, 0, nodemgr);
-				
-				unspreadLight(bank, n2pos, light2, light_sources, nodemgr);
-				
-				/*
-					Remove from light_sources if it is there
-					NOTE: This doesn't happen nearly at all
-				*/
-				/*if(light_sources.find(n2pos))
-				{
-					std::cout<<"Removed from light_sources"<<std::endl;
-					light_sources.remove(n2pos);
-				}*/
-			}
-		}
-		else{
-			light_sources.insert(n2pos, true);
-		}
-	}
+	core::map<v3s16, u8> from_nodes;
+	from_nodes.insert(p, oldlight);
+	unspreadLight(bank, from_nodes, light_sources, nodemgr);
 }
 
-#if 1
 /*
-	Goes recursively through the neighbours of the node.
+	Goes through the neighbours of the nodes, breadth-first.
 
 	Alters only transparent nodes.
 
@@ -360,53 +304,15 @@ void VoxelManipulator::unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
 	light_sources to re-light the area without the removed light.
 
 	values of from_nodes are lighting values.
-*/
-void VoxelManipulator::unspreadLight(enum LightBank bank,
-		core::map<v3s16, u8> & from_nodes,
-		core::map<v3s16, bool> & light_sources, INodeDefManager *nodemgr)
-{
-	if(from_nodes.size() == 0)
-		return;
-	
-	core::map<v3s16, u8>::Iterator j;
-	j = from_nodes.getIterator();
 
-	for(; j.atEnd() == false; j++)
-	{
-		v3s16 pos = j.getNode()->getKey();
-		
-		//MapNode &n = m_data[m_area.index(pos)];
-		
-		u8 oldlight = j.getNode()->getValue();
-
-		unspreadLight(bank, pos, oldlight, light_sources, nodemgr);
-	}
-}
-#endif
-
-#if 0
-/*
-	Goes recursively through the neighbours of the node.
-
-	Alters only transparent nodes.
-
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
-
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
-
-	values of from_nodes are lighting values.
+	Nodes outside the current area are handled as inexistent; the area
+	is not changed, so node indices stay valid for the whole run.
 */
 void VoxelManipulator::unspreadLight(enum LightBank bank,
 		core::map<v3s16, u8> & from_nodes,
-		core::map<v3s16, bool> & light_sources)
+		core::map<v3s16, bool> & light_sources, INodeDefManager *nodemgr)
 {
-	v3s16 dirs[6] = {
+	const v3s16 dirs[6] = {
 		v3s16(0,0,1), // back
 		v3s16(0,1,0), // top
 		v3s16(1,0,0), // right
@@ -414,66 +320,55 @@ void VoxelManipulator::unspreadLight(enum LightBank bank,
 		v3s16(0,-1,0), // bottom
 		v3s16(-1,0,0), // left
 	};
-	
+
 	if(from_nodes.size() == 0)
 		return;
-	
-	core::map<v3s16, u8> unlighted_nodes;
-	core::map<v3s16, u8>::Iterator j;
-	j = from_nodes.getIterator();
 
-	for(; j.atEnd() == false; j++)
+	NodeLightTable lighttable(nodemgr);
+
+	LightQueue queue;
+	for(core::map<v3s16, u8>::Iterator j = from_nodes.getIterator();
+			j.atEnd() == false; j++)
+	{
+		queue.push(j.getNode()->getKey(), j.getNode()->getValue());
+	}
+
+	while(queue.empty() == false)
 	{
-		v3s16 pos = j.getNode()->getKey();
-		
-		emerge(VoxelArea(pos - v3s16(1,1,1), pos + v3s16(1,1,1)));
-
-		//MapNode &n = m_data[m_area.index(pos)];
-		
-		u8 oldlight = j.getNode()->getValue();
-		
+		LightQueueItem item = queue.pop();
+
 		// Loop through 6 neighbors
 		for(u16 i=0; i<6; i++)
 		{
 			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-			
+			v3s16 n2pos = item.p + dirs[i];
+			if(m_area.contains(n2pos) == false)
+				continue;
+
 			u32 n2i = m_area.index(n2pos);
 
 			if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
 				continue;
 
 			MapNode &n2 = m_data[n2i];
-			
+
 			/*
 				If the neighbor is dimmer than what was specified
 				as oldlight (the light of the previous node)
 			*/
-			if(n2.getLight(bank, nodemgr) < oldlight)
+			u8 light2 = lighttable.getLight(n2, bank);
+			if(light2 < item.light)
 			{
 				/*
 					And the neighbor is transparent and it has some light
 				*/
-				if(nodemgr->get(n2).light_propagates && n2.getLight(bank, nodemgr) != 0)
+				if(lighttable.lightPropagates(n2) && light2 != 0)
 				{
 					/*
 						Set light to 0 and add to queue
 					*/
-
-					u8 current_light = n2.getLight(bank, nodemgr);
-					n2.setLight(bank, 0);
-
-					unlighted_nodes.insert(n2pos, current_light);
-					
-					/*
-						Remove from light_sources if it is there
-						NOTE: This doesn't happen nearly at all
-					*/
-					/*if(light_sources.find(n2pos))
-					{
-						std::cout<<"Removed from light_sources"<<std::endl;
-						light_sources.remove(n2pos);
-					}*/
+					lighttable.setLight(n2, bank, 0);
+					queue.push(n2pos, light2);
 				}
 			}
 			else{
@@ -481,110 +376,21 @@ void VoxelManipulator::unspreadLight(enum LightBank bank,
 			}
 		}
 	}
-
-	/*dstream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-	
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources);
 }
-#endif
 
 void VoxelManipulator::spreadLight(enum LightBank bank, v3s16 p,
 		INodeDefManager *nodemgr)
 {
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	emerge(VoxelArea(p - v3s16(1,1,1), p + v3s16(1,1,1)));
-
-	u32 i = m_area.index(p);
-	
-	if(m_flags[i] & VOXELFLAG_INEXISTENT)
-		return;
-
-	MapNode &n = m_data[i];
-
-	u8 oldlight = n.getLight(bank, nodemgr);
-	u8 newlight = diminish_light(oldlight);
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-		
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-
-		u8 light2 = n2.getLight(bank, nodemgr);
-		
-		/*
-			If the neighbor is brighter than the current node,
-			add to list (it will light up this node on its turn)
-		*/
-		if(light2 > undiminish_light(oldlight))
-		{
-			spreadLight(bank, n2pos, nodemgr);
-		}
-		/*
-			If the neighbor is dimmer than how much light this node
-			would spread on it, add to list
-		*/
-		if(light2 < newlight)
-		{
-			if(nodemgr->get(n2).light_propagates)
-			{
-				n2.setLight(bank, newlight, nodemgr);
-				spreadLight(bank, n2pos, nodemgr);
-			}
-		}
-	}
+	core::map<v3s16, bool> from_nodes;
+	from_nodes.insert(p, true);
+	spreadLight(bank, from_nodes, nodemgr);
 }
 
-#if 0
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
-
-	NOTE: This is faster on small areas but will overflow the
-	      stack on large areas. Thus it is not used.
-*/
-void VoxelManipulator::spreadLight(enum LightBank bank,
-		core::map<v3s16, bool> & from_nodes)
-{
-	if(from_nodes.size() == 0)
-		return;
-	
-	core::map<v3s16, bool> lighted_nodes;
-	core::map<v3s16, bool>::Iterator j;
-	j = from_nodes.getIterator();
-
-	for(; j.atEnd() == false; j++)
-	{
-		v3s16 pos = j.getNode()->getKey();
-
-		spreadLight(bank, pos);
-	}
-}
-#endif
+	Lights neighbors of from_nodes and goes on through the nodes that
+	got lighted, breadth-first.
 
-#if 1
-/*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	Nodes outside the current area are handled as inexistent.
 */
 void VoxelManipulator::spreadLight(enum LightBank bank,
 		core::map<v3s16, bool> & from_nodes, INodeDefManager *nodemgr)
@@ -600,25 +406,28 @@ void VoxelManipulator::spreadLight(enum LightBank bank,
 
 	if(from_nodes.size() == 0)
 		return;
-	
-	core::map<v3s16, bool> lighted_nodes;
-	core::map<v3s16, bool>::Iterator j;
-	j = from_nodes.getIterator();
 
-	for(; j.atEnd() == false; j++)
+	NodeLightTable lighttable(nodemgr);
+
+	LightQueue queue;
+	for(core::map<v3s16, bool>::Iterator j = from_nodes.getIterator();
+			j.atEnd() == false; j++)
 	{
-		v3s16 pos = j.getNode()->getKey();
+		queue.push(j.getNode()->getKey());
+	}
 
-		emerge(VoxelArea(pos - v3s16(1,1,1), pos + v3s16(1,1,1)));
+	while(queue.empty() == false)
+	{
+		v3s16 pos = queue.pop().p;
+		if(m_area.contains(pos) == false)
+			continue;
 
 		u32 i = m_area.index(pos);
-		
+
 		if(m_flags[i] & VOXELFLAG_INEXISTENT)
 			continue;
 
-		MapNode &n = m_data[i];
-
-		u8 oldlight = n.getLight(bank, nodemgr);
+		u8 oldlight = lighttable.getLight(m_data[i], bank);
 		u8 newlight = diminish_light(oldlight);
 
 		// Loop through 6 neighbors
@@ -626,54 +435,40 @@ void VoxelManipulator::spreadLight(enum LightBank bank,
 		{
 			// Get the position of the neighbor node
 			v3s16 n2pos = pos + dirs[i];
-			
-			try
-			{
-				u32 n2i = m_area.index(n2pos);
+			if(m_area.contains(n2pos) == false)
+				continue;
 
-				if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
-					continue;
+			u32 n2i = m_area.index(n2pos);
 
-				MapNode &n2 = m_data[n2i];
+			if(m_flags[n2i] & VOXELFLAG_INEXISTENT)
+				continue;
 
-				u8 light2 = n2.getLight(bank, nodemgr);
-				
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(light2 > undiminish_light(oldlight))
-				{
-					lighted_nodes.insert(n2pos, true);
-				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(light2 < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						lighted_nodes.insert(n2pos, true);
-					}
-				}
+			MapNode &n2 = m_data[n2i];
+
+			u8 light2 = lighttable.getLight(n2, bank);
+
+			/*
+				If the neighbor is brighter than the current node,
+				add to queue (it will light up this node on its turn)
+			*/
+			if(light2 > undiminish_light(oldlight))
+			{
+				queue.push(n2pos);
 			}
-			catch(InvalidPositionException &e)
+			/*
+				If the neighbor is dimmer than how much light this node
+				would spread on it, add to queue
+			*/
+			if(light2 < newlight)
 			{
-				continue;
+				if(lighttable.lightPropagates(n2))
+				{
+					lighttable.setLight(n2, bank, newlight);
+					queue.push(n2pos);
+				}
 			}
 		}
 	}
-
-	/*dstream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-	
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, nodemgr);
 }
-#endif
 
 //END